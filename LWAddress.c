@@ -214,98 +214,143 @@ size_t LWScriptPushData(uint8_t *script, size_t scriptLen, const uint8_t *data,
 // we are unable to correctly sign later, then the entire wallet balance after that point would become stuck with the
 // current coin selection code
 
-// writes the bitcoin address for a scriptPubKey to addr
-// returns the number of bytes written, or addrLen needed if addr is NULL
-size_t LWAddressFromScriptPubKey(char *addr, size_t addrLen, const uint8_t *script, size_t scriptLen)
+// sets sh to the hash a scriptPubKey pays to, and returns true if the script type is recognized
+int LWScriptHashFromScriptPubKey(LWScriptHash *sh, const uint8_t *script, size_t scriptLen)
 {
+    assert(sh != NULL);
     assert(script != NULL || scriptLen == 0);
+    *sh = LW_SCRIPT_HASH_NONE;
     if (! script || scriptLen == 0 || scriptLen > MAX_SCRIPT_LENGTH) return 0;
     
-    uint8_t data[21];
     const uint8_t *d, *elems[LWScriptElements(NULL, 0, script, scriptLen)];
-    char a[91];
-    size_t r = 0, l = 0, count = LWScriptElements(elems, sizeof(elems)/sizeof(*elems), script, scriptLen);
+    size_t l = 0, count = LWScriptElements(elems, sizeof(elems)/sizeof(*elems), script, scriptLen);
     
     if (count == 5 && *elems[0] == OP_DUP && *elems[1] == OP_HASH160 && *elems[2] == 20 &&
         *elems[3] == OP_EQUALVERIFY && *elems[4] == OP_CHECKSIG) {
         // pay-to-pubkey-hash scriptPubKey
-        data[0] = LITECOIN_PUBKEY_ADDRESS;
-#if LITECOIN_TESTNET
-        data[0] = LITECOIN_PUBKEY_ADDRESS_TEST;
-#endif
-        memcpy(&data[1], LWScriptData(elems[2], &l), 20);
-        r = LWBase58CheckEncode(addr, addrLen, data, 21);
+        sh->type = SCRIPT_HASH_PUBKEY;
+        memcpy(sh->hash, LWScriptData(elems[2], &l), 20);
     }
     else if (count == 3 && *elems[0] == OP_HASH160 && *elems[1] == 20 && *elems[2] == OP_EQUAL) {
         // pay-to-script-hash scriptPubKey
-        data[0] = LITECOIN_SCRIPT_ADDRESS;
-#if LITECOIN_TESTNET
-        data[0] = LITECOIN_SCRIPT_ADDRESS_TEST;
-#endif
-        memcpy(&data[1], LWScriptData(elems[1], &l), 20);
-        r = LWBase58CheckEncode(addr, addrLen, data, 21);
+        sh->type = SCRIPT_HASH_SCRIPT;
+        memcpy(sh->hash, LWScriptData(elems[1], &l), 20);
     }
     else if (count == 2 && (*elems[0] == 65 || *elems[0] == 33) && *elems[1] == OP_CHECKSIG) {
         // pay-to-pubkey scriptPubKey
-        data[0] = LITECOIN_PUBKEY_ADDRESS;
-#if LITECOIN_TESTNET
-        data[0] = LITECOIN_PUBKEY_ADDRESS_TEST;
-#endif
+        sh->type = SCRIPT_HASH_PUBKEY;
         d = LWScriptData(elems[0], &l);
-        LWHash160(&data[1], d, l);
-        r = LWBase58CheckEncode(addr, addrLen, data, 21);
+        LWHash160(sh->hash, d, l);
     }
     else if (count == 2 && ((*elems[0] == OP_0 && (*elems[1] == 20 || *elems[1] == 32)) ||
                             (*elems[0] >= OP_1 && *elems[0] <= OP_16 && *elems[1] >= 2 && *elems[1] <= 40))) {
         // pay-to-witness scriptPubKey
-        r = LWBech32Encode(a, "ltc", script);
-#if LITECOIN_TESTNET
-        r = LWBech32Encode(a, "tltc", script);
-#endif
-        if (addr && r > addrLen) r = 0;
-        if (addr) memcpy(addr, a, r);
+        sh->type = SCRIPT_HASH_WITNESS;
+        sh->version = (*elems[0] == OP_0) ? 0 : *elems[0] - OP_1 + 1;
+        d = LWScriptData(elems[1], &l);
+        memcpy(sh->hash, d, l);
+        sh->len = (uint8_t)l;
     }
     
-    return r;
+    if (sh->type == SCRIPT_HASH_PUBKEY || sh->type == SCRIPT_HASH_SCRIPT) sh->len = 20;
+    return (sh->type != SCRIPT_HASH_NONE);
 }
 
-// writes the bitcoin address for a scriptSig to addr
-// returns the number of bytes written, or addrLen needed if addr is NULL
-size_t LWAddressFromScriptSig(char *addr, size_t addrLen, const uint8_t *script, size_t scriptLen)
+// sets sh to the hash a scriptSig spends from, and returns true if the script type is recognized
+int LWScriptHashFromScriptSig(LWScriptHash *sh, const uint8_t *script, size_t scriptLen)
 {
+    assert(sh != NULL);
     assert(script != NULL || scriptLen == 0);
+    *sh = LW_SCRIPT_HASH_NONE;
     if (! script || scriptLen == 0 || scriptLen > MAX_SCRIPT_LENGTH) return 0;
     
-    uint8_t data[21];
     const uint8_t *elems[LWScriptElements(NULL, 0, script, scriptLen)], *d = NULL;
     size_t count = LWScriptElements(elems, sizeof(elems)/sizeof(*elems), script, scriptLen), l = 0;
-
-    data[0] = LITECOIN_PUBKEY_ADDRESS;
-#if LITECOIN_TESTNET
-    data[0] = LITECOIN_PUBKEY_ADDRESS_TEST;
-#endif
     
     if (count >= 2 && *elems[count - 2] <= OP_PUSHDATA4 &&
         (*elems[count - 1] == 65 || *elems[count - 1] == 33)) { // pay-to-pubkey-hash scriptSig
         d = LWScriptData(elems[count - 1], &l);
         if (l != 65 && l != 33) d = NULL;
-        if (d) LWHash160(&data[1], d, l);
+        if (d) sh->type = SCRIPT_HASH_PUBKEY;
     }
     else if (count >= 2 && *elems[count - 2] <= OP_PUSHDATA4 && *elems[count - 1] <= OP_PUSHDATA4 &&
              *elems[count - 1] > 0) { // pay-to-script-hash scriptSig
-        data[0] = LITECOIN_SCRIPT_ADDRESS;
-#if LITECOIN_TESTNET
-        data[0] = LITECOIN_SCRIPT_ADDRESS_TEST;
-#endif
         d = LWScriptData(elems[count - 1], &l);
-        if (d) LWHash160(&data[1], d, l);
+        if (d) sh->type = SCRIPT_HASH_SCRIPT;
     }
     else if (count >= 1 && *elems[count - 1] <= OP_PUSHDATA4 && *elems[count - 1] > 0) { // pay-to-pubkey scriptSig
         // TODO: implement Peter Wullie's pubKey recovery from signature
     }
     // pay-to-witness scriptSig's are empty
     
-    return (d) ? LWBase58CheckEncode(addr, addrLen, data, 21) : 0;
+    if (d) LWHash160(sh->hash, d, l), sh->len = 20;
+    return (d != NULL);
+}
+
+// sets sh to the hash addr pays to, and returns true if addr is a valid bitcoin address
+int LWScriptHashFromAddress(LWScriptHash *sh, const char *addr)
+{
+    uint8_t script[42];
+    size_t scriptLen;
+    
+    assert(sh != NULL);
+    assert(addr != NULL);
+    *sh = LW_SCRIPT_HASH_NONE;
+    scriptLen = (addr) ? LWAddressScriptPubKey(script, sizeof(script), addr) : 0;
+    return (scriptLen > 0 && LWScriptHashFromScriptPubKey(sh, script, scriptLen));
+}
+
+// writes the bitcoin address for sh to addr
+// returns the number of bytes written, or addrLen needed if addr is NULL
+size_t LWScriptHashAddress(char *addr, size_t addrLen, const LWScriptHash *sh)
+{
+    uint8_t data[2 + 40];
+    char a[91];
+    size_t r = 0;
+    
+    assert(sh != NULL);
+    
+    if (sh->type == SCRIPT_HASH_PUBKEY || sh->type == SCRIPT_HASH_SCRIPT) {
+        data[0] = (sh->type == SCRIPT_HASH_PUBKEY) ? LITECOIN_PUBKEY_ADDRESS : LITECOIN_SCRIPT_ADDRESS;
+#if LITECOIN_TESTNET
+        data[0] = (sh->type == SCRIPT_HASH_PUBKEY) ? LITECOIN_PUBKEY_ADDRESS_TEST : LITECOIN_SCRIPT_ADDRESS_TEST;
+#endif
+        memcpy(&data[1], sh->hash, 20);
+        r = LWBase58CheckEncode(addr, addrLen, data, 21);
+    }
+    else if (sh->type == SCRIPT_HASH_WITNESS && sh->len >= 2 && sh->len <= 40) {
+        data[0] = (sh->version == 0) ? OP_0 : OP_1 + sh->version - 1; // rebuild the scriptPubKey that bech32 encodes
+        data[1] = sh->len;
+        memcpy(&data[2], sh->hash, sh->len);
+        r = LWBech32Encode(a, "ltc", data);
+#if LITECOIN_TESTNET
+        r = LWBech32Encode(a, "tltc", data);
+#endif
+        if (addr && r > addrLen) r = 0;
+        if (addr) memcpy(addr, a, r);
+    }
+    
+    return r;
+}
+
+// writes the bitcoin address for a scriptPubKey to addr
+// returns the number of bytes written, or addrLen needed if addr is NULL
+size_t LWAddressFromScriptPubKey(char *addr, size_t addrLen, const uint8_t *script, size_t scriptLen)
+{
+    LWScriptHash sh;
+    
+    assert(script != NULL || scriptLen == 0);
+    return (LWScriptHashFromScriptPubKey(&sh, script, scriptLen)) ? LWScriptHashAddress(addr, addrLen, &sh) : 0;
+}
+
+// writes the bitcoin address for a scriptSig to addr
+// returns the number of bytes written, or addrLen needed if addr is NULL
+size_t LWAddressFromScriptSig(char *addr, size_t addrLen, const uint8_t *script, size_t scriptLen)
+{
+    LWScriptHash sh;
+    
+    assert(script != NULL || scriptLen == 0);
+    return (LWScriptHashFromScriptSig(&sh, script, scriptLen)) ? LWScriptHashAddress(addr, addrLen, &sh) : 0;
 }
 
 // writes the bitcoin address for a witness to addr
@@ -315,6 +360,21 @@ size_t LWAddressFromWitness(char *addr, size_t addrLen, const uint8_t *witness,
     return 0; // TODO: XXX implement
 }
 
+// writes the pay-to-pubkey-hash bitcoin address for a serialized public key to addr, the key is not validated
+// returns the number of bytes written, or addrLen needed if addr is NULL
+size_t LWAddressFromPubKey(char *addr, size_t addrLen, const uint8_t *pubKey, size_t pkLen)
+{
+    uint8_t data[21];
+    
+    assert(pubKey != NULL || pkLen == 0);
+    data[0] = LITECOIN_PUBKEY_ADDRESS;
+#if LITECOIN_TESTNET
+    data[0] = LITECOIN_PUBKEY_ADDRESS_TEST;
+#endif
+    LWHash160(&data[1], pubKey, pkLen);
+    return LWBase58CheckEncode(addr, addrLen, data, sizeof(data));
+}
+
 // writes the scriptPubKey for addr to script
 // returns the number of bytes written, or scriptLen needed if script is NULL
 size_t LWAddressScriptPubKey(uint8_t *script, size_t scriptLen, const char *addr)
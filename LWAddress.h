@@ -78,6 +78,10 @@ size_t LWAddressFromScriptSig(char *addr, size_t addrLen, const uint8_t *script,
 // returns the number of bytes written, or addrLen needed if addr is NULL
 size_t LWAddressFromWitness(char *addr, size_t addrLen, const uint8_t *witness, size_t witLen);
 
+// writes the pay-to-pubkey-hash bitcoin address for a serialized public key to addr, the key is not validated
+// returns the number of bytes written, or addrLen needed if addr is NULL
+size_t LWAddressFromPubKey(char *addr, size_t addrLen, const uint8_t *pubKey, size_t pkLen);
+
 // writes the scriptPubKey for addr to script
 // returns the number of bytes written, or scriptLen needed if script is NULL
 size_t LWAddressScriptPubKey(uint8_t *script, size_t scriptLen, const char *addr);
@@ -101,6 +105,50 @@ inline static int LWAddressEq(const void *addr, const void *otherAddr)
             strncmp((const char *)addr, (const char *)otherAddr, sizeof(LWAddress)) == 0);
 }
 
+#define SCRIPT_HASH_NONE    0
+#define SCRIPT_HASH_PUBKEY  1 // hash160 of a pubkey, paid to by pay-to-pubkey-hash and pay-to-pubkey scripts
+#define SCRIPT_HASH_SCRIPT  2 // hash160 of a pay-to-script-hash redeem script
+#define SCRIPT_HASH_WITNESS 3 // witness program of a pay-to-witness script
+
+// compact binary form of an address, the type of script and the hash it pays to, encoded as a string only on demand
+typedef struct {
+    uint8_t type; // one of the SCRIPT_HASH_ types
+    uint8_t version; // witness version, for SCRIPT_HASH_WITNESS
+    uint8_t len; // 20 for a hash160, or 2 to 40 for a witness program
+    uint8_t hash[40];
+} LWScriptHash;
+
+#define LW_SCRIPT_HASH_NONE ((LWScriptHash) { SCRIPT_HASH_NONE, 0, 0, { 0 } })
+
+// sets sh to the hash a scriptPubKey pays to, and returns true if the script type is recognized
+int LWScriptHashFromScriptPubKey(LWScriptHash *sh, const uint8_t *script, size_t scriptLen);
+
+// sets sh to the hash a scriptSig spends from, and returns true if the script type is recognized
+int LWScriptHashFromScriptSig(LWScriptHash *sh, const uint8_t *script, size_t scriptLen);
+
+// sets sh to the hash addr pays to, and returns true if addr is a valid bitcoin address
+int LWScriptHashFromAddress(LWScriptHash *sh, const char *addr);
+
+// writes the bitcoin address for sh to addr
+// returns the number of bytes written, or addrLen needed if addr is NULL
+size_t LWScriptHashAddress(char *addr, size_t addrLen, const LWScriptHash *sh);
+
+// returns a hash value for sh suitable for use in a hashtable
+inline static size_t LWScriptHashHash(const void *sh)
+{
+    return LWMurmur3_32(((const LWScriptHash *)sh)->hash, ((const LWScriptHash *)sh)->len,
+                        ((const LWScriptHash *)sh)->type);
+}
+
+// true if sh and otherSh are equal
+inline static int LWScriptHashEq(const void *sh, const void *otherSh)
+{
+    const LWScriptHash *a = sh, *b = otherSh;
+
+    return (a == b || (a->type == b->type && a->version == b->version && a->len == b->len &&
+                       memcmp(a->hash, b->hash, a->len) == 0));
+}
+
 #ifdef __cplusplus
 }
 #endif
@@ -5,6 +5,8 @@
 #include "LWBIP32Sequence.h"
 #include "LWCrypto.h"
 #include "LWBase58.h"
+#include "LWThread.h"
+#include <stdlib.h>
 #include <string.h>
 #include <assert.h>
 
@@ -12,6 +14,9 @@
 #define BIP32_XPRV     "\x04\x88\xAD\xE4"
 #define BIP32_XPUB     "\x04\x88\xB2\x1E"
 
+#define BIP32_BATCH_MIN     64 // minimum number of keys to derive per worker thread
+#define BIP32_BATCH_THREADS 8
+
 // BIP32 is a scheme for deriving chains of addresses from a seed value
 // https://github.com/bitcoin/bips/blob/master/bip-0032.mediawiki
 
@@ -115,18 +120,30 @@ LWMasterPubKey LWBIP32MasterPubKey(const void *seed, size_t seedLen)
     return mpk;
 }
 
-// writes the public key for path N(m/0H/chain/index) to pubKey
-// returns number of bytes written, or pubKeyLen needed if pubKey is NULL
-size_t LWBIP32PubKey(uint8_t *pubKey, size_t pubKeyLen, LWMasterPubKey mpk, uint32_t chain, uint32_t index)
+// returns the extended public key for path N(m/0H/chain), to derive that chain's index keys with LWBIP32ChildPubKey()
+LWMasterPubKey LWBIP32ChainPubKey(LWMasterPubKey mpk, uint32_t chain)
 {
-    UInt256 chainCode = mpk.chainCode;
+    LWMasterPubKey chainKey = mpk;
+    UInt160 hash;
     
     assert(memcmp(&mpk, &LW_MASTER_PUBKEY_NONE, sizeof(mpk)) != 0);
     
-    if (pubKey && sizeof(LWECPoint) <= pubKeyLen) {
-        *(LWECPoint *)pubKey = *(LWECPoint *)mpk.pubKey;
+    LWHash160(&hash, mpk.pubKey, sizeof(mpk.pubKey));
+    chainKey.fingerPrint = hash.u32[0]; // parent key fingerprint, as in the serialized xpub format
+    _CKDpub((LWECPoint *)chainKey.pubKey, &chainKey.chainCode, chain); // path N(m/0H/chain)
+    return chainKey;
+}
 
-        _CKDpub((LWECPoint *)pubKey, &chainCode, chain); // path N(m/0H/chain)
+// writes the public key for the index'th child of the extended public key chainKey to pubKey
+// returns number of bytes written, or pubKeyLen needed if pubKey is NULL
+size_t LWBIP32ChildPubKey(uint8_t *pubKey, size_t pubKeyLen, LWMasterPubKey chainKey, uint32_t index)
+{
+    UInt256 chainCode = chainKey.chainCode;
+    
+    assert(memcmp(&chainKey, &LW_MASTER_PUBKEY_NONE, sizeof(chainKey)) != 0);
+    
+    if (pubKey && sizeof(LWECPoint) <= pubKeyLen) {
+        *(LWECPoint *)pubKey = *(LWECPoint *)chainKey.pubKey;
         _CKDpub((LWECPoint *)pubKey, &chainCode, index); // index'th key in chain
         var_clean(&chainCode);
     }
@@ -134,6 +151,81 @@ size_t LWBIP32PubKey(uint8_t *pubKey, size_t pubKeyLen, LWMasterPubKey mpk, uint
     return (! pubKey || sizeof(LWECPoint) <= pubKeyLen) ? sizeof(LWECPoint) : 0;
 }
 
+typedef struct {
+    LWECPoint *pubKeys;
+    size_t count;
+    const LWMasterPubKey *chainKey;
+    uint32_t index;
+    int r;
+} LWBIP32Batch;
+
+// derives a batch of consecutive child public keys, converting them to affine coordinates together
+static void *_LWBIP32DeriveBatch(void *info)
+{
+    LWBIP32Batch *batch = info;
+    const LWMasterPubKey *chainKey = batch->chainKey;
+    UInt256 *tweaks = malloc(batch->count*sizeof(*tweaks));
+    uint8_t buf[sizeof(LWECPoint) + sizeof(uint32_t)];
+    UInt512 I;
+
+    assert(tweaks != NULL);
+    memcpy(buf, chainKey->pubKey, sizeof(LWECPoint));
+
+    for (size_t i = 0; i < batch->count; i++) { // I = HMAC-SHA512(c, P(K) || i), see _CKDpub()
+        UInt32SetBE(&buf[sizeof(LWECPoint)], batch->index + (uint32_t)i);
+        LWHMAC(&I, LWSHA512, sizeof(UInt512), &chainKey->chainCode, sizeof(UInt256), buf, sizeof(buf));
+        tweaks[i] = *(UInt256 *)&I; // IL
+    }
+
+    batch->r = LWSecp256k1PointAddList(batch->pubKeys, (const LWECPoint *)chainKey->pubKey, tweaks, batch->count);
+    var_clean(&I);
+    mem_clean(tweaks, batch->count*sizeof(*tweaks));
+    free(tweaks);
+    return NULL;
+}
+
+// writes the public keys for children index through index + count - 1 of the extended public key chainKey to pubKeys
+// large batches are split across worker threads
+// returns the number of public keys written, or 0 on failure
+size_t LWBIP32ChildPubKeyList(LWECPoint pubKeys[], size_t count, LWMasterPubKey chainKey, uint32_t index)
+{
+    size_t i, threadCount = LWThreadCount(count, BIP32_BATCH_MIN, BIP32_BATCH_THREADS), off = 0;
+    LWBIP32Batch batches[BIP32_BATCH_THREADS];
+    int r = 1;
+
+    assert(pubKeys != NULL || count == 0);
+    assert(memcmp(&chainKey, &LW_MASTER_PUBKEY_NONE, sizeof(chainKey)) != 0);
+    assert(count <= BIP32_HARD - index); // hardened children can't be derived from a public key
+
+    for (i = 0; i < threadCount; i++) {
+        batches[i] = (LWBIP32Batch) { &pubKeys[off], count/threadCount + (i < count % threadCount ? 1 : 0),
+                                      &chainKey, index + (uint32_t)off, 0 };
+        off += batches[i].count;
+    }
+
+    LWThreadRunBatches(_LWBIP32DeriveBatch, batches, sizeof(*batches), threadCount);
+    for (i = 0; r && i < threadCount; i++) r = batches[i].r;
+
+    var_clean(&chainKey.chainCode);
+    return (r) ? count : 0;
+}
+
+// writes the public key for path N(m/0H/chain/index) to pubKey
+// returns number of bytes written, or pubKeyLen needed if pubKey is NULL
+size_t LWBIP32PubKey(uint8_t *pubKey, size_t pubKeyLen, LWMasterPubKey mpk, uint32_t chain, uint32_t index)
+{
+    assert(memcmp(&mpk, &LW_MASTER_PUBKEY_NONE, sizeof(mpk)) != 0);
+    
+    if (pubKey && sizeof(LWECPoint) <= pubKeyLen) {
+        LWMasterPubKey chainKey = LWBIP32ChainPubKey(mpk, chain);
+        
+        LWBIP32ChildPubKey(pubKey, pubKeyLen, chainKey, index);
+        var_clean(&chainKey.chainCode);
+    }
+    
+    return (! pubKey || sizeof(LWECPoint) <= pubKeyLen) ? sizeof(LWECPoint) : 0;
+}
+
 // sets the private key for path m/0H/chain/index to key
 void LWBIP32PrivKey(LWKey *key, const void *seed, size_t seedLen, uint32_t chain, uint32_t index)
 {
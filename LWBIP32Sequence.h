@@ -42,6 +42,17 @@ LWMasterPubKey LWBIP32MasterPubKey(const void *seed, size_t seedLen);
 // returns number of bytes written, or pubKeyLen needed if pubKey is NULL
 size_t LWBIP32PubKey(uint8_t *pubKey, size_t pubKeyLen, LWMasterPubKey mpk, uint32_t chain, uint32_t index);
 
+// returns the extended public key for path N(m/0H/chain), to derive that chain's index keys with LWBIP32ChildPubKey()
+LWMasterPubKey LWBIP32ChainPubKey(LWMasterPubKey mpk, uint32_t chain);
+
+// writes the public key for the index'th child of the extended public key chainKey to pubKey
+// returns number of bytes written, or pubKeyLen needed if pubKey is NULL
+size_t LWBIP32ChildPubKey(uint8_t *pubKey, size_t pubKeyLen, LWMasterPubKey chainKey, uint32_t index);
+
+// writes the public keys for children index through index + count - 1 of the extended public key chainKey to pubKeys
+// returns the number of public keys written, or 0 on failure
+size_t LWBIP32ChildPubKeyList(LWECPoint pubKeys[], size_t count, LWMasterPubKey chainKey, uint32_t index);
+
 // sets the private key for path m/0H/chain/index to key
 void LWBIP32PrivKey(LWKey *key, const void *seed, size_t seedLen, uint32_t chain, uint32_t index);
 
@@ -182,6 +182,56 @@ void LWSHA256_2(void *md32, const void *data, size_t len)
     LWSHA256(md32, t, sizeof(t));
 }
 
+void LWSHA256Init(LWSHA256Context *ctx)
+{
+    static const uint32_t buf[] = { 0x6a09e667, 0xbb67ae85, 0x3c6ef372, 0xa54ff53a, 0x510e527f, 0x9b05688c,
+                                    0x1f83d9ab, 0x5be0cd19 }; // initial buffer values
+    
+    assert(ctx != NULL);
+    memcpy(ctx->buf, buf, sizeof(buf));
+    ctx->len = 0;
+}
+
+void LWSHA256Update(LWSHA256Context *ctx, const void *data, size_t len)
+{
+    size_t i = 0, off;
+    
+    assert(ctx != NULL);
+    assert(data != NULL || len == 0);
+    off = (size_t)(ctx->len % 64);
+    ctx->len += len;
+    
+    if (off > 0) { // top up a partially filled block first
+        i = (len < 64 - off) ? len : 64 - off;
+        memcpy((uint8_t *)ctx->x + off, data, i);
+        if (off + i < 64) return;
+        _LWSHA256Compress(ctx->buf, ctx->x);
+    }
+    
+    for (; i + 64 <= len; i += 64) { // process data in 64 byte blocks
+        memcpy(ctx->x, (const uint8_t *)data + i, 64);
+        _LWSHA256Compress(ctx->buf, ctx->x);
+    }
+    
+    memcpy(ctx->x, (const uint8_t *)data + i, len - i); // save remainder for the next update
+}
+
+void LWSHA256Final(LWSHA256Context *ctx, void *md32)
+{
+    size_t i = (size_t)(ctx->len % 64);
+    
+    assert(ctx != NULL);
+    assert(md32 != NULL);
+    memset((uint8_t *)ctx->x + i, 0, 64 - i); // clear remainder of x
+    ((uint8_t *)ctx->x)[i] = 0x80; // append padding
+    if (i >= 56) _LWSHA256Compress(ctx->buf, ctx->x), memset(ctx->x, 0, 64); // length goes to next block
+    ctx->x[14] = be32((uint32_t)(ctx->len >> 29)), ctx->x[15] = be32((uint32_t)(ctx->len << 3)); // length in bits
+    _LWSHA256Compress(ctx->buf, ctx->x); // finalize
+    for (i = 0; i < 8; i++) ctx->buf[i] = be32(ctx->buf[i]); // endian swap
+    memcpy(md32, ctx->buf, 32); // write to md
+    mem_clean(ctx, sizeof(*ctx));
+}
+
 // bitwise right rotation
 #define ror64(a, b) (((a) >> (b)) | ((a) << (64 - (b))))
 
@@ -24,6 +24,16 @@ void LWSHA224(void *md28, const void *data, size_t len);
 // double-sha-256 = sha-256(sha-256(x))
 void LWSHA256_2(void *md32, const void *data, size_t len);
 
+// incremental sha-256, for hashing data that arrives in chunks
+typedef struct {
+    uint32_t buf[8], x[16];
+    uint64_t len;
+} LWSHA256Context;
+
+void LWSHA256Init(LWSHA256Context *ctx);
+void LWSHA256Update(LWSHA256Context *ctx, const void *data, size_t len);
+void LWSHA256Final(LWSHA256Context *ctx, void *md32); // ctx is cleared and must be re-initialized before reuse
+
 void LWSHA384(void *md48, const void *data, size_t len);
 
 void LWSHA512(void *md64, const void *data, size_t len);
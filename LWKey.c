@@ -7,6 +7,7 @@
 #include "LWAddress.h"
 #include "LWBase58.h"
 #include <stdio.h>
+#include <stdlib.h>
 #include <string.h>
 #include <assert.h>
 #include <pthread.h>
@@ -84,6 +85,46 @@ int LWSecp256k1PointAdd(LWECPoint *p, const UInt256 *i)
             secp256k1_ec_pubkey_serialize(_ctx, (unsigned char *)p, &pLen, &pubkey, SECP256K1_EC_COMPRESSED));
 }
 
+// multiplies secp256k1 generator by each 256bit big endian int in i, adds ec-point p, and stores the results in points
+// all results are converted to affine coordinates together, using a single field inversion
+// returns true on success
+int LWSecp256k1PointAddList(LWECPoint points[], const LWECPoint *p, const UInt256 i[], size_t count)
+{
+    secp256k1_gej *gej = (count > 0) ? malloc(count*sizeof(*gej)) : NULL;
+    secp256k1_ge *ge = (count > 0) ? malloc(count*sizeof(*ge)) : NULL, pge;
+    secp256k1_scalar s;
+    size_t j, pLen;
+    int overflow = 0, r = 1;
+
+    assert(points != NULL || count == 0);
+    assert(p != NULL);
+    assert(i != NULL || count == 0);
+    assert(gej != NULL || count == 0);
+    assert(ge != NULL || count == 0);
+    pthread_once(&_ctx_once, _ctx_init);
+    if (! secp256k1_eckey_pubkey_parse(&pge, (const unsigned char *)p, sizeof(*p))) r = 0;
+
+    for (j = 0; r && j < count; j++) {
+        secp256k1_scalar_set_b32(&s, (const unsigned char *)&i[j], &overflow);
+        if (overflow) r = 0;
+        secp256k1_ecmult_gen(&_ctx->ecmult_gen_ctx, &gej[j], &s); // P(i)
+        secp256k1_gej_add_ge_var(&gej[j], &gej[j], &pge, NULL); // P(i) + p
+        if (secp256k1_gej_is_infinity(&gej[j])) r = 0;
+    }
+
+    if (r) secp256k1_ge_set_all_gej_var(ge, gej, count); // batch conversion to affine coordinates
+
+    for (j = 0; r && j < count; j++) {
+        pLen = sizeof(points[j]);
+        if (! secp256k1_eckey_pubkey_serialize(&ge[j], (unsigned char *)&points[j], &pLen, 1)) r = 0;
+    }
+
+    secp256k1_scalar_clear(&s);
+    if (gej) free(gej);
+    if (ge) free(ge);
+    return r;
+}
+
 // multiplies secp256k1 ec-point p by 256bit big endian int i and stores the result in p
 // returns true on success
 int LWSecp256k1PointMul(LWECPoint *p, const UInt256 *i)
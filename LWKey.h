@@ -34,6 +34,10 @@ int LWSecp256k1PointGen(LWECPoint *p, const UInt256 *i);
 // returns true on success
 int LWSecp256k1PointAdd(LWECPoint *p, const UInt256 *i);
 
+// multiplies secp256k1 generator by each 256bit big endian int in i, adds ec-point p, and stores the results in points
+// returns true on success
+int LWSecp256k1PointAddList(LWECPoint points[], const LWECPoint *p, const UInt256 i[], size_t count);
+
 // multiplies secp256k1 ec-point p by 256bit big endian int i and stores the result in p
 // returns true on success
 int LWSecp256k1PointMul(LWECPoint *p, const UInt256 *i);
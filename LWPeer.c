@@ -18,9 +18,12 @@
 #include <fcntl.h>
 #include <errno.h>
 #include <netdb.h>
+#include <poll.h>
 #include <sys/socket.h>
 #include <sys/time.h>
+#include <sys/uio.h>
 #include <netinet/in.h>	
+#include <netinet/tcp.h>
 #include <arpa/inet.h>
 
 #define HEADER_LENGTH      24
@@ -29,9 +32,22 @@
 #define ENABLED_SERVICES   0ULL  // we don't provide full blocks to remote nodes
 #define PROTOCOL_VERSION   70015
 #define MIN_PROTO_VERSION  70002 // peers earlier than this protocol version not supported (need v0.9 txFee relay rules)
+#define SENDHEADERS_VERSION 70012 // BIP130: peers at or above this protocol version can announce blocks with headers
 #define LOCAL_HOST         ((UInt128) { 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0xff, 0xff, 0x7f, 0x00, 0x00, 0x01 })
 #define CONNECT_TIMEOUT    3.0
 #define MESSAGE_TIMEOUT    10.0
+#define SEND_MAX_IOVECS    64    // upper bound on the number of buffers coalesced into a single sendmsg() call
+#define SEND_QUEUE_MAX     MAX_MSG_LENGTH // peer is disconnected if more than this many bytes are queued but unsent
+#define SEND_TIMEOUT       20.0  // peer is disconnected if it reads none of a non-empty send queue for this long
+#define BLOCK_WINDOW_MIN   50    // bounds on the number of merkleblocks requested but not yet received
+#define BLOCK_WINDOW_MAX   2000
+#define BLOCK_WINDOW_INIT  500   // window used until block throughput has been measured
+#define ARENA_CHUNK_SIZE   0x10000 // minimum size of a message handler arena chunk
+#define ARENA_MAX_RETAINED 0x200000 // arena memory kept between messages is capped at this size
+
+#ifndef MAX_KNOWN_TX_HASHES
+#define MAX_KNOWN_TX_HASHES 50000 // tx hashes remembered per peer, the oldest half is forgotten when the limit is reached
+#endif
 
 // the standard blockchain download protocol works as follows (for SPV mode):
 // - local peer sends getblocks
@@ -51,15 +67,18 @@
 // - previous two steps repeat until a header within a week of earliestKeyTime is reached (further headers are ignored)
 // - local peer sends getblocks
 // - remote peer responds with inv containing up to 500 block hashes
-// - local peer sends getdata with the block hashes
+// - local peer queues the block hashes and sends getdata for as many as fit in its block window
 // - if there were 500 hashes, local peer sends getblocks again without waiting for remote peer
 // - remote peer responds with multiple merkleblock and tx messages, followed by inv containing up to 500 block hashes
-// - previous two steps repeat until an inv with fewer than 500 block hashes is received
-// - local peer sends just getdata for the final set of fewer than 500 block hashes
-// - remote peer responds with multiple merkleblock and tx messages
+// - as each merkleblock arrives, local peer sends getdata for more queued hashes to keep the window full, and a pending
+//   getblocks is held back until fewer than a window of hashes remain queued, so the next inv arrives in time
+// - previous steps repeat until an inv with fewer than 500 block hashes is received and the queue is drained
+// - the window is sized to cover two ping round trips at the measured merkleblock arrival rate
 // - if at any point tx messages consume enough wallet addresses to drop below the bip32 chain gap limit, more addresses
 //   are generated and local peer sends filterload with an updated bloom filter
 // - after filterload is sent, getdata is sent to re-request recent blocks that may contain new tx matching the filter
+// - peers supporting BIP130 are sent sendheaders, so new blocks are announced with headers instead of inv, and local
+//   peer responds with getdata for the announced merkleblocks without waiting on a separate inv round trip
 
 typedef enum {
     inv_undefined = 0,
@@ -68,6 +87,19 @@ typedef enum {
     inv_filtered_block = 3
 } inv_type;
 
+typedef struct {
+    uint8_t header[HEADER_LENGTH];
+    uint8_t *payload;
+    size_t payloadLen;
+} LWQueuedMsg;
+
+typedef struct _LWArenaChunk {
+    struct _LWArenaChunk *next;
+    size_t size, used;
+} LWArenaChunk; // chunk data follows the struct, starting at ARENA_HEADER bytes
+
+#define ARENA_HEADER ((sizeof(LWArenaChunk) + 15) & ~(size_t)15)
+
 typedef struct {
     LWPeer peer; // superstruct on top of LWPeer
     uint32_t magicNumber;
@@ -80,11 +112,23 @@ typedef struct {
     uint32_t version, lastblock, earliestKeyTime, currentBlockHeight;
     double startTime, pingTime;
     volatile double disconnectTime, mempoolTime;
-    int sentVerack, gotVerack, sentGetaddr, sentFilter, sentGetdata, sentMempool, sentGetblocks;
+    int sentVerack, gotVerack, sentGetaddr, sentFilter, sentGetdata, sentMempool, sentGetblocks, sentSendheaders;
+    UInt256 *getheadersLocators; // locators of each getheaders request awaiting a reply, oldest first
+    size_t *getheadersLocatorCounts; // number of getheadersLocators in each request, guarded by sendLock
     UInt256 lastBlockHash;
     LWMerkleBlock *currentBlock;
-    UInt256 *currentBlockTxHashes, *knownBlockHashes, *knownTxHashes;
-    LWSet *knownTxHashSet;
+    UInt256 *currentBlockTxHashes, *knownBlockHashes, *knownTxHashes, *oldKnownTxHashes;
+    UInt256 *queuedBlockHashes, getblocksLocators[2]; // block hashes waiting for room in the window, deferred getblocks
+    size_t blocksInFlight, blockWindow;
+    double blockInterval, lastBlockTime; // smoothed seconds between merkleblocks while the window is not empty
+    int needsGetblocks;
+    double *blockRequestTimes; // getdata time for each block in flight, oldest first
+    double parseTime; // time spent parsing the message currently being handled
+    double messageTimeout; // seconds a message payload has to arrive in after its header, MESSAGE_TIMEOUT by default
+    LWPeerStats stats; // guarded by sendLock
+    LWArenaChunk *arena; // temporaries for the message currently being handled, most recent chunk first
+    size_t arenaUsed;
+    LWSet *knownTxHashSet, *oldKnownTxHashSet; // current and previous generation of at most MAX_KNOWN_TX_HASHES/2 each
     volatile int socket;
     void *info;
     void (*connected)(void *info);
@@ -104,6 +148,12 @@ typedef struct {
     void (**volatile pongCallback)(void *info, int success);
     void *volatile mempoolInfo;
     void (*volatile mempoolCallback)(void *info, int success);
+    LWQueuedMsg *sendQueue; // outbound messages waiting to be written by the peer thread
+    size_t sendOffset; // number of bytes of sendQueue[0] already written
+    size_t sendQueueLen; // total bytes in sendQueue not yet written
+    double sendProgressTime; // when the send queue last became non-empty or had any bytes written
+    int wakeFd[2], wakePending; // pipe used to wake the peer thread when a message is queued or a deadline changes
+    pthread_mutex_t sendLock;
     pthread_t thread;
 } LWPeerContext;
 
@@ -116,24 +166,212 @@ inline static int _LWPeerIsIPv4(const LWPeer *peer)
     return (peer->address.u64[0] == 0 && peer->address.u16[4] == 0 && peer->address.u16[5] == 0xffff);
 }
 
-static void _LWPeerAddKnownTxHashes(const LWPeer *peer, const UInt256 txHashes[], size_t txCount)
+// true if txHash is in either generation of known tx hashes
+static int _LWPeerKnowsTxHash(const LWPeer *peer, UInt256 txHash)
+{
+    LWPeerContext *ctx = (LWPeerContext *)peer;
+
+    return (LWSetContains(ctx->knownTxHashSet, &txHash) || LWSetContains(ctx->oldKnownTxHashSet, &txHash));
+}
+
+// returns true if txHash was added, or false if it was already known
+static int _LWPeerAddKnownTxHash(const LWPeer *peer, UInt256 txHash)
 {
     LWPeerContext *ctx = (LWPeerContext *)peer;
     UInt256 *knownTxHashes = ctx->knownTxHashes;
-    size_t i, j;
-    
-    for (i = 0; i < txCount; i++) {
-        if (! LWSetContains(ctx->knownTxHashSet, &txHashes[i])) {
-            array_add(knownTxHashes, txHashes[i]);
-            
-            if (ctx->knownTxHashes != knownTxHashes) { // check if knownTxHashes was moved to a new memory location
-                ctx->knownTxHashes = knownTxHashes;
-                LWSetClear(ctx->knownTxHashSet);
-                for (j = array_count(knownTxHashes); j > 0; j--) LWSetAdd(ctx->knownTxHashSet, &knownTxHashes[j - 1]);
-            }
-            else LWSetAdd(ctx->knownTxHashSet, &knownTxHashes[array_count(knownTxHashes) - 1]);
+    LWSet *knownTxHashSet = ctx->knownTxHashSet;
+    size_t i;
+
+    if (_LWPeerKnowsTxHash(peer, txHash)) return 0;
+
+    if (array_count(knownTxHashes) >= MAX_KNOWN_TX_HASHES/2) { // start a new generation, reusing the oldest one
+        ctx->knownTxHashes = ctx->oldKnownTxHashes;
+        ctx->knownTxHashSet = ctx->oldKnownTxHashSet;
+        ctx->oldKnownTxHashes = knownTxHashes;
+        ctx->oldKnownTxHashSet = knownTxHashSet;
+        knownTxHashes = ctx->knownTxHashes;
+        array_clear(knownTxHashes);
+        LWSetClear(ctx->knownTxHashSet);
+    }
+
+    array_add(knownTxHashes, txHash);
+
+    if (ctx->knownTxHashes != knownTxHashes) { // check if knownTxHashes was moved to a new memory location
+        ctx->knownTxHashes = knownTxHashes;
+        LWSetClear(ctx->knownTxHashSet);
+        for (i = array_count(knownTxHashes); i > 0; i--) LWSetAdd(ctx->knownTxHashSet, &knownTxHashes[i - 1]);
+    }
+    else LWSetAdd(ctx->knownTxHashSet, &knownTxHashes[array_count(knownTxHashes) - 1]);
+
+    return 1;
+}
+
+static void _LWPeerAddKnownTxHashes(const LWPeer *peer, const UInt256 txHashes[], size_t txCount)
+{
+    for (size_t i = 0; i < txCount; i++) _LWPeerAddKnownTxHash(peer, txHashes[i]);
+}
+
+// message types with their own LWPeerStats entry, the remaining entry counts all other types
+static const char *_LWPeerStatsTypes[LW_PEER_STATS_TYPES - 1] = {
+    MSG_VERSION, MSG_VERACK, MSG_ADDR, MSG_INV, MSG_GETDATA, MSG_NOTFOUND, MSG_GETBLOCKS, MSG_GETHEADERS, MSG_TX,
+    MSG_BLOCK, MSG_HEADERS, MSG_GETADDR, MSG_MEMPOOL, MSG_PING, MSG_PONG, MSG_FILTERLOAD, MSG_FILTERADD,
+    MSG_FILTERCLEAR, MSG_MERKLEBLOCK, MSG_ALERT, MSG_REJECT, MSG_FEEFILTER, MSG_SENDHEADERS
+};
+
+static LWPeerMessageStats *_LWPeerMessageStats(LWPeer *peer, const char *type)
+{
+    LWPeerContext *ctx = (LWPeerContext *)peer;
+    size_t i = 0;
+
+    while (i < LW_PEER_STATS_TYPES - 1 && strncmp(_LWPeerStatsTypes[i], type, 12) != 0) i++;
+    return &ctx->stats.messages[i];
+}
+
+static void _LWPeerHistogramAdd(uint64_t histogram[], double seconds)
+{
+    double us = seconds*1000000;
+    size_t i = 0;
+
+    while (i + 1 < LW_PEER_STATS_BUCKETS && us >= (double)(1ULL << i)) i++;
+    histogram[i]++;
+}
+
+static double _LWPeerNow(void)
+{
+    struct timeval tv;
+
+    gettimeofday(&tv, NULL);
+    return tv.tv_sec + (double)tv.tv_usec/1000000;
+}
+
+// returns 16 byte aligned memory from the peer thread's arena that is only valid until the current message has been
+// handled, anything that must outlive the message has to be copied to memory from malloc()
+static void *_LWPeerArenaAlloc(LWPeer *peer, size_t size)
+{
+    LWPeerContext *ctx = (LWPeerContext *)peer;
+    LWArenaChunk *chunk = ctx->arena;
+    uint8_t *ptr;
+
+    size = (size + 15) & ~(size_t)15;
+
+    if (! chunk || chunk->size - chunk->used < size) {
+        size_t chunkSize = (size > ARENA_CHUNK_SIZE) ? size : ARENA_CHUNK_SIZE;
+
+        if (chunk && chunkSize < chunk->size*2) chunkSize = chunk->size*2;
+        chunk = malloc(ARENA_HEADER + chunkSize);
+        assert(chunk != NULL);
+        chunk->next = ctx->arena;
+        chunk->size = chunkSize;
+        chunk->used = 0;
+        ctx->arena = chunk;
+    }
+
+    ptr = (uint8_t *)chunk + ARENA_HEADER + chunk->used;
+    chunk->used += size;
+    ctx->arenaUsed += size;
+    return ptr;
+}
+
+// releases everything allocated from the arena, if the last message needed more than one chunk they are replaced with
+// a single chunk big enough for it, so steady state message handling doesn't call malloc()
+static void _LWPeerArenaReset(LWPeer *peer)
+{
+    LWPeerContext *ctx = (LWPeerContext *)peer;
+    LWArenaChunk *chunk = ctx->arena;
+    size_t size = ctx->arenaUsed;
+
+    if (chunk && (chunk->next || chunk->size > ARENA_MAX_RETAINED)) {
+        while (chunk) {
+            ctx->arena = chunk->next;
+            free(chunk);
+            chunk = ctx->arena;
+        }
+
+        if (size > ARENA_MAX_RETAINED) size = ARENA_MAX_RETAINED;
+        if (size > ARENA_CHUNK_SIZE) _LWPeerArenaAlloc(peer, size);
+        chunk = ctx->arena;
+    }
+
+    if (chunk) chunk->used = 0;
+    ctx->arenaUsed = 0;
+}
+
+static void _LWPeerArenaFree(LWPeer *peer)
+{
+    LWPeerContext *ctx = (LWPeerContext *)peer;
+    LWArenaChunk *chunk;
+
+    while ((chunk = ctx->arena)) {
+        ctx->arena = chunk->next;
+        free(chunk);
+    }
+
+    ctx->arenaUsed = 0;
+}
+
+// sends getdata for queued block hashes to keep up to blockWindow blocks in flight, then sends any deferred getblocks
+// once fewer than blockWindow hashes remain queued
+static void _LWPeerRequestBlocks(LWPeer *peer)
+{
+    LWPeerContext *ctx = (LWPeerContext *)peer;
+    size_t count = array_count(ctx->queuedBlockHashes);
+    double now;
+
+    if (ctx->needsFilterUpdate) return; // queued blocks will be re-requested after the filter is updated
+
+    if (count > 0 && ctx->blocksInFlight <= ctx->blockWindow/2) { // refill in batches rather than one hash at a time
+        if (count > ctx->blockWindow - ctx->blocksInFlight) count = ctx->blockWindow - ctx->blocksInFlight;
+        if (ctx->blocksInFlight == 0) ctx->lastBlockTime = 0; // don't count the request round trip as throughput
+        LWPeerSendGetdata(peer, NULL, 0, ctx->queuedBlockHashes, count);
+        ctx->blocksInFlight += count;
+        now = _LWPeerNow();
+        for (size_t i = 0; i < count; i++) array_add(ctx->blockRequestTimes, now);
+        array_rm_range(ctx->queuedBlockHashes, 0, count);
+    }
+
+    if (ctx->needsGetblocks && array_count(ctx->queuedBlockHashes) < ctx->blockWindow) {
+        ctx->needsGetblocks = 0;
+        LWPeerSendGetblocks(peer, ctx->getblocksLocators, 2, UINT256_ZERO);
+    }
+}
+
+// queues block hashes to be requested as room in the block window allows
+static void _LWPeerQueueBlocks(LWPeer *peer, const UInt256 blockHashes[], size_t blockCount)
+{
+    LWPeerContext *ctx = (LWPeerContext *)peer;
+
+    array_add_array(ctx->queuedBlockHashes, blockHashes, blockCount);
+    _LWPeerRequestBlocks(peer);
+}
+
+// called when a requested block arrives or is notfound, updates the window from the measured block arrival rate
+static void _LWPeerBlockDone(LWPeer *peer)
+{
+    LWPeerContext *ctx = (LWPeerContext *)peer;
+    double now = _LWPeerNow(), window;
+
+    if (array_count(ctx->blockRequestTimes) > 0) {
+        pthread_mutex_lock(&ctx->sendLock);
+        _LWPeerHistogramAdd(ctx->stats.blockLatency, now - ctx->blockRequestTimes[0]);
+        pthread_mutex_unlock(&ctx->sendLock);
+        array_rm(ctx->blockRequestTimes, 0);
+    }
+
+    if (ctx->blocksInFlight > 1 && ctx->lastBlockTime > 0) { // only measure while more blocks were already requested
+        ctx->blockInterval = (ctx->blockInterval > 0) ? ctx->blockInterval*0.9 + (now - ctx->lastBlockTime)*0.1 :
+                             now - ctx->lastBlockTime;
+
+        if (ctx->blockInterval > 0 && ctx->pingTime < DBL_MAX) {
+            // half the window is refilled at a time, so it must hold two round trips worth of blocks to never run dry
+            window = 2*ctx->pingTime/ctx->blockInterval;
+            ctx->blockWindow = (window < BLOCK_WINDOW_MIN) ? BLOCK_WINDOW_MIN :
+                               (window > BLOCK_WINDOW_MAX) ? BLOCK_WINDOW_MAX : (size_t)window;
         }
     }
+
+    ctx->lastBlockTime = now;
+    if (ctx->blocksInFlight > 0) ctx->blocksInFlight--;
+    _LWPeerRequestBlocks(peer);
 }
 
 static void _LWPeerDidConnect(LWPeer *peer)
@@ -226,6 +464,13 @@ static int _LWPeerAcceptVerackMessage(LWPeer *peer, const uint8_t *msg, size_t m
         ctx->startTime = 0;
         peer_log(peer, "got verack in %fs", ctx->pingTime);
         ctx->gotVerack = 1;
+
+        // BIP130: ask peer to announce new blocks with headers instead of inv, saving a round trip for each new block
+        if (ctx->version >= SENDHEADERS_VERSION) {
+            LWPeerSendMessage(peer, NULL, 0, MSG_SENDHEADERS);
+            ctx->sentSendheaders = 1;
+        }
+
         _LWPeerDidConnect(peer);
     }
     
@@ -248,7 +493,7 @@ static int _LWPeerAcceptAddrMessage(LWPeer *peer, const uint8_t *msg, size_t msg
         peer_log(peer, "dropping addr message, %zu is too many addresses, max is 1000", count);
     }
     else if (ctx->sentGetaddr) { // simple anti-tarpitting tactic, don't accept unsolicited addresses
-        LWPeer peers[count], p;
+        LWPeer *peers = _LWPeerArenaAlloc(peer, count*sizeof(*peers)), p;
         size_t peersCount = 0;
         time_t now = time(NULL);
         
@@ -295,7 +540,8 @@ static int _LWPeerAcceptInvMessage(LWPeer *peer, const uint8_t *msg, size_t msgL
     }
     else {
         inv_type type;
-        const uint8_t *transactions[count], *blocks[count];
+        const uint8_t **transactions = _LWPeerArenaAlloc(peer, count*sizeof(*transactions)),
+                      **blocks = _LWPeerArenaAlloc(peer, count*sizeof(*blocks));
         size_t i, j, txCount = 0, blockCount = 0;
         
         peer_log(peer, "got inv with %zu item(s)", count);
@@ -330,7 +576,8 @@ static int _LWPeerAcceptInvMessage(LWPeer *peer, const uint8_t *msg, size_t msgL
             if (blockCount == 1 && UInt256Eq(ctx->lastBlockHash, UInt256Get(blocks[0]))) blockCount = 0;
             if (blockCount == 1) ctx->lastBlockHash = UInt256Get(blocks[0]);
 
-            UInt256 hash, blockHashes[blockCount], txHashes[txCount];
+            UInt256 hash, *blockHashes = _LWPeerArenaAlloc(peer, blockCount*sizeof(*blockHashes)),
+                    *txHashes = _LWPeerArenaAlloc(peer, txCount*sizeof(*txHashes));
 
             for (i = 0; i < blockCount; i++) {
                 blockHashes[i] = UInt256Get(blocks[i]);
@@ -347,21 +594,24 @@ static int _LWPeerAcceptInvMessage(LWPeer *peer, const uint8_t *msg, size_t msgL
             for (i = 0, j = 0; i < txCount; i++) {
                 hash = UInt256Get(transactions[i]);
                 
-                if (LWSetContains(ctx->knownTxHashSet, &hash)) {
+                if (_LWPeerKnowsTxHash(peer, hash)) {
                     if (ctx->hasTx) ctx->hasTx(ctx->info, hash);
                 }
                 else txHashes[j++] = hash;
             }
             
             _LWPeerAddKnownTxHashes(peer, txHashes, j);
-            if (j > 0 || blockCount > 0) LWPeerSendGetdata(peer, txHashes, j, blockHashes, blockCount);
+            if (j > 0) LWPeerSendGetdata(peer, txHashes, j, NULL, 0);
     
             // to improve chain download performance, if we received 500 block hashes, request the next 500 block hashes
+            // as soon as the remaining queue is short enough that the reply won't pile up behind it
             if (blockCount >= 500) {
-                UInt256 locators[] = { blockHashes[blockCount - 1], blockHashes[0] };
-            
-                LWPeerSendGetblocks(peer, locators, 2, UINT256_ZERO);
+                ctx->getblocksLocators[0] = blockHashes[blockCount - 1];
+                ctx->getblocksLocators[1] = blockHashes[0];
+                ctx->needsGetblocks = 1;
             }
+
+            if (blockCount > 0) _LWPeerQueueBlocks(peer, blockHashes, blockCount);
             
             if (txCount > 0 && ctx->mempoolCallback) {
                 peer_log(peer, "got initial mempool response");
@@ -378,10 +628,13 @@ static int _LWPeerAcceptInvMessage(LWPeer *peer, const uint8_t *msg, size_t msgL
 static int _LWPeerAcceptTxMessage(LWPeer *peer, const uint8_t *msg, size_t msgLen)
 {
     LWPeerContext *ctx = (LWPeerContext *)peer;
+    double start = _LWPeerNow();
     LWTransaction *tx = LWTransactionParse(msg, msgLen);
     UInt256 txHash;
     int r = 1;
 
+    ctx->parseTime += _LWPeerNow() - start;
+
     if (! tx) {
         peer_log(peer, "malformed tx message with length: %zu", msgLen);
         r = 0;
@@ -419,6 +672,79 @@ static int _LWPeerAcceptTxMessage(LWPeer *peer, const uint8_t *msg, size_t msgLe
     return r;
 }
 
+// BIP130: unsolicited headers after a sendheaders message announce new blocks, request them right away as merkleblocks
+static int _LWPeerAcceptHeadersAnnouncement(LWPeer *peer, const uint8_t *msg, size_t off, size_t count)
+{
+    LWPeerContext *ctx = (LWPeerContext *)peer;
+    uint32_t now = (uint32_t)time(NULL);
+    UInt256 *blockHashes = _LWPeerArenaAlloc(peer, count*sizeof(*blockHashes));
+    size_t i, blockCount = 0;
+    int r = 1;
+
+    peer_log(peer, "got %zu header(s) announcing new block(s)", count);
+
+    for (i = 0; r && i < count; i++) {
+        double start = _LWPeerNow();
+        LWMerkleBlock *block = LWMerkleBlockParse(&msg[off + 81*i], 81);
+        int isValid = LWMerkleBlockIsValid(block, now);
+
+        ctx->parseTime += _LWPeerNow() - start;
+
+        if (! isValid) {
+            peer_log(peer, "invalid block header: %s", u256hex(block->blockHash));
+            r = 0;
+        }
+        else if (! UInt256Eq(ctx->lastBlockHash, block->blockHash)) blockHashes[blockCount++] = block->blockHash;
+
+        LWMerkleBlockFree(block);
+    }
+
+    if (! ctx->sentFilter && ! ctx->sentGetblocks) blockCount = 0;
+
+    if (r && blockCount > 0) {
+        ctx->lastBlockHash = blockHashes[blockCount - 1];
+
+        // remember blockHashes in case we need to re-request them with an updated bloom filter
+        array_add_array(ctx->knownBlockHashes, blockHashes, blockCount);
+
+        while (array_count(ctx->knownBlockHashes) > MAX_GETDATA_HASHES) {
+            array_rm_range(ctx->knownBlockHashes, 0, array_count(ctx->knownBlockHashes)/3);
+        }
+
+        if (! ctx->needsFilterUpdate) _LWPeerQueueBlocks(peer, blockHashes, blockCount);
+    }
+
+    return r;
+}
+
+// true if a headers message with count headers starting at msg[off] is the reply to the oldest outstanding getheaders
+// request, in which case that request is removed, otherwise the message is an unsolicited BIP130 announcement
+static int _LWPeerIsGetheadersReply(LWPeer *peer, const uint8_t *msg, size_t off, size_t count)
+{
+    LWPeerContext *ctx = (LWPeerContext *)peer;
+    size_t i, locatorsCount;
+    int r = 0;
+
+    pthread_mutex_lock(&ctx->sendLock);
+
+    if (array_count(ctx->getheadersLocatorCounts) > 0) {
+        locatorsCount = ctx->getheadersLocatorCounts[0];
+
+        // a reply is empty, or starts right after the first locator the remote peer has in its best chain
+        for (i = 0; i < locatorsCount && ! r; i++) {
+            r = (count == 0 || UInt256Eq(UInt256Get(&msg[off + 4]), ctx->getheadersLocators[i]));
+        }
+
+        if (r) {
+            array_rm_range(ctx->getheadersLocators, 0, locatorsCount);
+            array_rm(ctx->getheadersLocatorCounts, 0);
+        }
+    }
+
+    pthread_mutex_unlock(&ctx->sendLock);
+    return r;
+}
+
 static int _LWPeerAcceptHeadersMessage(LWPeer *peer, const uint8_t *msg, size_t msgLen)
 {
     LWPeerContext *ctx = (LWPeerContext *)peer;
@@ -430,6 +756,13 @@ static int _LWPeerAcceptHeadersMessage(LWPeer *peer, const uint8_t *msg, size_t
                  LWVarIntSize(count) + 81*count, count);
         r = 0;
     }
+    else if (count > 2000) { // disconnect, since the reply can't be matched to its getheaders request anymore
+        peer_log(peer, "malformed headers message, %zu is too many headers, max is 2000", count);
+        r = 0;
+    }
+    else if (! _LWPeerIsGetheadersReply(peer, msg, off, count) && ctx->sentSendheaders) {
+        r = _LWPeerAcceptHeadersAnnouncement(peer, msg, off, count);
+    }
     else {
         peer_log(peer, "got %zu header(s)", count);
     
@@ -459,9 +792,13 @@ static int _LWPeerAcceptHeadersMessage(LWPeer *peer, const uint8_t *msg, size_t
             else LWPeerSendGetheaders(peer, locators, 2, UINT256_ZERO);
 
             for (size_t i = 0; r && i < count; i++) {
+                double start = _LWPeerNow();
                 LWMerkleBlock *block = LWMerkleBlockParse(&msg[off + 81*i], 81);
+                int isValid = LWMerkleBlockIsValid(block, (uint32_t)now);
                 
-                if (! LWMerkleBlockIsValid(block, (uint32_t)now)) {
+                ctx->parseTime += _LWPeerNow() - start;
+
+                if (! isValid) {
                     peer_log(peer, "invalid block header: %s", u256hex(block->blockHash));
                     LWMerkleBlockFree(block);
                     r = 0;
@@ -503,7 +840,8 @@ static int _LWPeerAcceptGetdataMessage(LWPeer *peer, const uint8_t *msg, size_t
         peer_log(peer, "dropping getdata message, %zu is too many items, max is %d", count, MAX_GETDATA_HASHES);
     }
     else {
-        struct inv_item { uint8_t item[36]; } *notfound = NULL;
+        uint8_t *notfound = _LWPeerArenaAlloc(peer, LWVarIntSize(count) + 36*count);
+        size_t notfoundCount = 0;
         LWTransaction *tx = NULL;
         
         peer_log(peer, "got getdata with %zu item(s)", count);
@@ -517,10 +855,12 @@ static int _LWPeerAcceptGetdataMessage(LWPeer *peer, const uint8_t *msg, size_t
                     if (ctx->requestedTx) tx = ctx->requestedTx(ctx->info, hash);
 
                     if (tx && LWTransactionSize(tx) < TX_MAX_SIZE) {
-                        uint8_t buf[LWTransactionSerialize(tx, NULL, 0)];
-                        size_t bufLen = LWTransactionSerialize(tx, buf, sizeof(buf));
-                        char txHex[bufLen*2 + 1];
+                        size_t bufLen = LWTransactionSerialize(tx, NULL, 0);
+                        uint8_t *buf = _LWPeerArenaAlloc(peer, bufLen);
+                        char *txHex = _LWPeerArenaAlloc(peer, bufLen*2 + 1);
                         
+                        bufLen = LWTransactionSerialize(tx, buf, bufLen);
+
                         for (size_t j = 0; j < bufLen; j++) {
                             sprintf(&txHex[j*2], "%02x", buf[j]);
                         }
@@ -531,26 +871,19 @@ static int _LWPeerAcceptGetdataMessage(LWPeer *peer, const uint8_t *msg, size_t
                     }
                     
                     // fall through
-                default:
-                    if (! notfound) array_new(notfound, 1);
-                    array_add(notfound, *(struct inv_item *)&msg[off]);
+                default: // items are copied after room for the largest possible count varint, which is prepended later
+                    memcpy(&notfound[LWVarIntSize(count) + 36*notfoundCount++], &msg[off], 36);
                     break;
             }
             
             off += 36;
         }
 
-        if (notfound) {
-            size_t bufLen = LWVarIntSize(array_count(notfound)) + 36*array_count(notfound), o = 0;
-            uint8_t *buf = malloc(bufLen);
-            
-            assert(buf != NULL);
-            o += LWVarIntSet(&buf[o], (o <= bufLen ? bufLen - o : 0), array_count(notfound));
-            memcpy(&buf[o], notfound, 36*array_count(notfound));
-            o += 36*array_count(notfound);
-            array_free(notfound);
-            LWPeerSendMessage(peer, buf, o, MSG_NOTFOUND);
-            free(buf);
+        if (notfoundCount > 0) {
+            size_t o = LWVarIntSize(count) - LWVarIntSize(notfoundCount);
+
+            LWVarIntSet(&notfound[o], LWVarIntSize(notfoundCount), notfoundCount);
+            LWPeerSendMessage(peer, &notfound[o], LWVarIntSize(notfoundCount) + 36*notfoundCount, MSG_NOTFOUND);
         }
     }
 
@@ -573,20 +906,20 @@ static int _LWPeerAcceptNotfoundMessage(LWPeer *peer, const uint8_t *msg, size_t
     }
     else {
         inv_type type;
-        UInt256 *txHashes, *blockHashes, hash;
+        UInt256 *txHashes = _LWPeerArenaAlloc(peer, count*sizeof(*txHashes)),
+                *blockHashes = _LWPeerArenaAlloc(peer, count*sizeof(*blockHashes)), hash;
+        size_t txCount = 0, blockCount = 0;
         
         peer_log(peer, "got notfound with %zu item(s)", count);
-        array_new(txHashes, 1);
-        array_new(blockHashes, 1);
         
         for (size_t i = 0; i < count; i++) {
             type = UInt32GetLE(&msg[off]);
             hash = UInt256Get(&msg[off + sizeof(uint32_t)]);
             
             switch (type) {
-                case inv_tx: array_add(txHashes, hash); break;
-                case inv_filtered_block: // drop through
-                case inv_block: array_add(blockHashes, hash); break;
+                case inv_tx: txHashes[txCount++] = hash; break;
+                case inv_filtered_block: _LWPeerBlockDone(peer); // fall through
+                case inv_block: blockHashes[blockCount++] = hash; break;
                 default: break;
             }
             
@@ -594,11 +927,8 @@ static int _LWPeerAcceptNotfoundMessage(LWPeer *peer, const uint8_t *msg, size_t
         }
         
         if (ctx->notfound) {
-            ctx->notfound(ctx->info, txHashes, array_count(txHashes), blockHashes, array_count(blockHashes));
+            ctx->notfound(ctx->info, txHashes, txCount, blockHashes, blockCount);
         }
-        
-        array_free(txHashes);
-        array_free(blockHashes);
     }
     
     return r;
@@ -670,14 +1000,17 @@ static int _LWPeerAcceptMerkleblockMessage(LWPeer *peer, const uint8_t *msg, siz
     // a merkleblock message, the remote node is expected to send tx messages for the tx referenced in the block. When a
     // non-tx message is received we should have all the tx in the merkleblock.
     LWPeerContext *ctx = (LWPeerContext *)peer;
+    double start = _LWPeerNow();
     LWMerkleBlock *block = LWMerkleBlockParse(msg, msgLen);
-    int r = 1;
+    int isValid = (block && LWMerkleBlockIsValid(block, (uint32_t)time(NULL))), r = 1;
   
+    ctx->parseTime += _LWPeerNow() - start;
+
     if (! block) {
         peer_log(peer, "malformed merkleblock message with length: %zu", msgLen);
         r = 0;
     }
-    else if (! LWMerkleBlockIsValid(block, (uint32_t)time(NULL))) {
+    else if (! isValid) {
         peer_log(peer, "invalid merkleblock: %s", u256hex(block->blockHash));
         LWMerkleBlockFree(block);
         block = NULL;
@@ -691,18 +1024,15 @@ static int _LWPeerAcceptMerkleblockMessage(LWPeer *peer, const uint8_t *msg, siz
     }
     else {
         size_t count = LWMerkleBlockTxHashes(block, NULL, 0);
-        UInt256 _hashes[(sizeof(UInt256)*count <= 0x1000) ? count : 0],
-                *hashes = (sizeof(UInt256)*count <= 0x1000) ? _hashes : malloc(count*sizeof(*hashes));
+        UInt256 *hashes = _LWPeerArenaAlloc(peer, count*sizeof(*hashes));
         
-        assert(hashes != NULL);
+        _LWPeerBlockDone(peer);
         count = LWMerkleBlockTxHashes(block, hashes, count);
 
         for (size_t i = count; i > 0; i--) { // reverse order for more efficient removal as tx arrive
-            if (LWSetContains(ctx->knownTxHashSet, &hashes[i - 1])) continue;
+            if (_LWPeerKnowsTxHash(peer, hashes[i - 1])) continue;
             array_add(ctx->currentBlockTxHashes, hashes[i - 1]);
         }
-
-        if (hashes != _hashes) free(hashes);
     }
 
     if (block) {
@@ -839,6 +1169,7 @@ static int _LWPeerOpenSocket(LWPeer *peer, int domain, double timeout, int *erro
         setsockopt(ctx->socket, SOL_SOCKET, SO_RCVTIMEO, &tv, sizeof(tv));
         setsockopt(ctx->socket, SOL_SOCKET, SO_SNDTIMEO, &tv, sizeof(tv));
         setsockopt(ctx->socket, SOL_SOCKET, SO_KEEPALIVE, &on, sizeof(on));
+        setsockopt(ctx->socket, IPPROTO_TCP, TCP_NODELAY, &on, sizeof(on)); // small messages are coalesced by sendQueue
 #ifdef SO_NOSIGPIPE // BSD based systems have a SO_NOSIGPIPE socket option to supress SIGPIPE signals
         setsockopt(ctx->socket, SOL_SOCKET, SO_NOSIGPIPE, &on, sizeof(on));
 #endif
@@ -894,6 +1225,175 @@ static int _LWPeerOpenSocket(LWPeer *peer, int domain, double timeout, int *erro
     return r;
 }
 
+#ifndef MSG_NOSIGNAL   // linux based systems have a MSG_NOSIGNAL send flag, useful for supressing SIGPIPE signals
+#define MSG_NOSIGNAL 0 // set to 0 if undefined (BSD has the SO_NOSIGPIPE sockopt, and windows has no signals at all)
+#endif
+
+// writes as much of the send queue as the socket will accept without blocking, gathering the headers and payloads of
+// queued messages into a single sendmsg() call, and returns an errno.h code on failure (must hold sendLock)
+static int _LWPeerFlushSendQueue(LWPeer *peer, int socket)
+{
+    LWPeerContext *ctx = (LWPeerContext *)peer;
+    struct iovec iov[SEND_MAX_IOVECS];
+    struct msghdr hdr;
+    size_t i, count, off, len, sent;
+    ssize_t n;
+    int error = 0;
+
+    while (! error && array_count(ctx->sendQueue) > 0) {
+        off = ctx->sendOffset;
+        len = 0;
+
+        for (i = 0, count = 0; i < array_count(ctx->sendQueue) && count + 2 <= SEND_MAX_IOVECS; i++) {
+            LWQueuedMsg *m = &ctx->sendQueue[i];
+
+            if (off < HEADER_LENGTH) {
+                iov[count].iov_base = &m->header[off];
+                iov[count].iov_len = HEADER_LENGTH - off;
+                len += iov[count++].iov_len;
+                off = 0;
+            }
+            else off -= HEADER_LENGTH;
+
+            if (off < m->payloadLen) {
+                iov[count].iov_base = &m->payload[off];
+                iov[count].iov_len = m->payloadLen - off;
+                len += iov[count++].iov_len;
+            }
+
+            off = 0;
+        }
+
+        memset(&hdr, 0, sizeof(hdr));
+        hdr.msg_iov = iov;
+        hdr.msg_iovlen = (int)count;
+        n = sendmsg(socket, &hdr, MSG_NOSIGNAL | MSG_DONTWAIT);
+
+        if (n < 0) {
+            if (errno != EWOULDBLOCK && errno != EAGAIN && errno != EINTR) error = errno;
+            break;
+        }
+
+        ctx->sendQueueLen -= (size_t)n;
+        if (n > 0) ctx->sendProgressTime = _LWPeerNow();
+        sent = ctx->sendOffset + (size_t)n;
+
+        for (i = 0; i < array_count(ctx->sendQueue) && sent >= HEADER_LENGTH + ctx->sendQueue[i].payloadLen; i++) {
+            sent -= HEADER_LENGTH + ctx->sendQueue[i].payloadLen;
+            if (ctx->sendQueue[i].payload) free(ctx->sendQueue[i].payload);
+        }
+
+        if (i > 0) array_rm_range(ctx->sendQueue, 0, i);
+        ctx->sendOffset = sent;
+        if ((size_t)n < len) break; // socket send buffer is full, wait for POLLOUT
+    }
+
+    return error;
+}
+
+// frees any unsent messages and closes the wakeup pipe (must hold sendLock)
+static void _LWPeerClearSendQueue(LWPeer *peer)
+{
+    LWPeerContext *ctx = (LWPeerContext *)peer;
+
+    for (size_t i = array_count(ctx->sendQueue); i > 0; i--) {
+        if (ctx->sendQueue[i - 1].payload) free(ctx->sendQueue[i - 1].payload);
+    }
+
+    array_clear(ctx->sendQueue);
+    ctx->sendOffset = 0;
+    ctx->sendQueueLen = 0;
+    if (ctx->wakeFd[0] >= 0) close(ctx->wakeFd[0]);
+    if (ctx->wakeFd[1] >= 0) close(ctx->wakeFd[1]);
+    ctx->wakeFd[0] = ctx->wakeFd[1] = -1;
+    ctx->wakePending = 0;
+}
+
+// wakes the peer thread so it flushes its send queue and recomputes its next deadline (must hold sendLock)
+static void _LWPeerWake(LWPeer *peer)
+{
+    LWPeerContext *ctx = (LWPeerContext *)peer;
+
+    if (ctx->wakeFd[1] >= 0 && ! pthread_equal(pthread_self(), ctx->thread) && ! ctx->wakePending) {
+        ctx->wakePending = 1;
+        if (write(ctx->wakeFd[1], "", 1) < 0 && errno != EAGAIN) ctx->wakePending = 0;
+    }
+}
+
+// flushes the send queue, then blocks until the socket is readable or the nearest of disconnectTime, mempoolTime, or
+// the absolute deadline, whichever comes first, returning the number of bytes read into buf; now is set to the time the
+// wait began, and error is set to ETIMEDOUT once now reaches deadline, however often the wait is cut short by
+// _LWPeerWake(), or if the send queue has made no progress for SEND_TIMEOUT
+static size_t _LWPeerRecv(LWPeer *peer, int socket, uint8_t *buf, size_t bufLen, double deadline, double *now,
+                          int *error)
+{
+    LWPeerContext *ctx = (LWPeerContext *)peer;
+    struct pollfd fds[2];
+    struct timeval tv;
+    uint8_t wake[64];
+    double wait;
+    ssize_t n = 0;
+    int count, timeout = -1;
+
+    gettimeofday(&tv, NULL);
+    *now = tv.tv_sec + (double)tv.tv_usec/1000000;
+    wait = deadline - *now;
+    if (ctx->disconnectTime - *now < wait) wait = ctx->disconnectTime - *now;
+    if (ctx->mempoolTime - *now < wait) wait = ctx->mempoolTime - *now;
+
+    pthread_mutex_lock(&ctx->sendLock);
+    *error = (*now >= deadline) ? ETIMEDOUT : _LWPeerFlushSendQueue(peer, socket);
+
+    if (! *error && array_count(ctx->sendQueue) > 0) { // peer must keep reading what we send
+        if (ctx->sendProgressTime + SEND_TIMEOUT <= *now) *error = ETIMEDOUT;
+        if (ctx->sendProgressTime + SEND_TIMEOUT - *now < wait) wait = ctx->sendProgressTime + SEND_TIMEOUT - *now;
+    }
+
+    fds[0].fd = socket;
+    fds[0].events = POLLIN | ((array_count(ctx->sendQueue) > 0) ? POLLOUT : 0);
+    fds[0].revents = 0;
+    fds[1].fd = ctx->wakeFd[0];
+    fds[1].events = POLLIN;
+    fds[1].revents = 0;
+    pthread_mutex_unlock(&ctx->sendLock);
+    if (*error) return 0;
+    if (wait < 0) wait = 0;
+    if (wait < 24*60*60) timeout = (int)(wait*1000) + ((wait > 0) ? 1 : 0); // round up so we never wake too early
+    count = poll(fds, 2, timeout);
+    if (count < 0 && errno != EINTR) *error = errno;
+
+    if (count > 0 && (fds[1].revents & POLLIN)) {
+        pthread_mutex_lock(&ctx->sendLock);
+        while (read(ctx->wakeFd[0], wake, sizeof(wake)) > 0);
+        ctx->wakePending = 0;
+        pthread_mutex_unlock(&ctx->sendLock);
+    }
+
+    if (count > 0 && (fds[0].revents & ~POLLOUT)) {
+        n = read(socket, buf, bufLen);
+        if (n == 0) *error = ECONNRESET;
+        if (n < 0 && errno != EWOULDBLOCK && errno != EINTR) *error = errno;
+    }
+
+    return (n > 0) ? (size_t)n : 0;
+}
+
+// disconnects with ETIMEDOUT once time reaches disconnectTime, and gives up waiting for a mempool response once it
+// reaches mempoolTime, the deadlines that cut short each _LWPeerRecv() wait
+static void _LWPeerCheckDeadlines(LWPeer *peer, double time, int *error)
+{
+    LWPeerContext *ctx = (LWPeerContext *)peer;
+
+    if (! *error && time >= ctx->disconnectTime) *error = ETIMEDOUT;
+
+    if (! *error && time >= ctx->mempoolTime) {
+        peer_log(peer, "done waiting for mempool response");
+        LWPeerSendPing(peer, ctx->mempoolInfo, ctx->mempoolCallback);
+        ctx->mempoolCallback = NULL;
+        ctx->mempoolTime = DBL_MAX;
+    }
+}
+
 static void *_peerThreadRoutine(void *arg)
 {
     LWPeer *peer = arg;
@@ -901,13 +1401,25 @@ static void *_peerThreadRoutine(void *arg)
     int socket, error = 0;
 
     pthread_cleanup_push(ctx->threadCleanup, ctx->info);
-    
-    if (_LWPeerOpenSocket(peer, PF_INET6, CONNECT_TIMEOUT, &error)) {
+    ctx->thread = pthread_self();
+    pthread_mutex_lock(&ctx->sendLock);
+
+    if (pipe(ctx->wakeFd) < 0) {
+        error = errno;
+        ctx->wakeFd[0] = ctx->wakeFd[1] = -1;
+    }
+    else {
+        fcntl(ctx->wakeFd[0], F_SETFL, fcntl(ctx->wakeFd[0], F_GETFL) | O_NONBLOCK);
+        fcntl(ctx->wakeFd[1], F_SETFL, fcntl(ctx->wakeFd[1], F_GETFL) | O_NONBLOCK);
+    }
+
+    pthread_mutex_unlock(&ctx->sendLock);
+
+    if (! error && _LWPeerOpenSocket(peer, PF_INET6, CONNECT_TIMEOUT, &error)) {
         struct timeval tv;
-        double time = 0, msgTimeout;
+        double time = 0;
         uint8_t header[HEADER_LENGTH], *payload = malloc(0x1000);
-        size_t len = 0, payloadLen = 0x1000;
-        ssize_t n = 0;
+        size_t n = 0, len = 0, payloadLen = 0x1000;
 
         assert(payload != NULL);
         gettimeofday(&tv, NULL);
@@ -919,20 +1431,8 @@ static void *_peerThreadRoutine(void *arg)
             socket = ctx->socket;
             
             while (socket >= 0 && ! error && len < HEADER_LENGTH) {
-                n = read(socket, &header[len], sizeof(header) - len);
-                if (n > 0) len += n;
-                if (n == 0) error = ECONNRESET;
-                if (n < 0 && errno != EWOULDBLOCK) error = errno;
-                gettimeofday(&tv, NULL);
-                time = tv.tv_sec + (double)tv.tv_usec/1000000;
-                if (! error && time >= ctx->disconnectTime) error = ETIMEDOUT;
-
-                if (! error && time >= ctx->mempoolTime) {
-                    peer_log(peer, "done waiting for mempool response");
-                    LWPeerSendPing(peer, ctx->mempoolInfo, ctx->mempoolCallback);
-                    ctx->mempoolCallback = NULL;
-                    ctx->mempoolTime = DBL_MAX;
-                }
+                len += _LWPeerRecv(peer, socket, &header[len], sizeof(header) - len, DBL_MAX, &time, &error);
+                _LWPeerCheckDeadlines(peer, time, &error);
                 
                 while (sizeof(uint32_t) <= len && UInt32GetLE(header) != ctx->magicNumber) {
                     memmove(header, &header[1], --len); // consume one byte at a time until we find the magic number
@@ -952,6 +1452,8 @@ static void *_peerThreadRoutine(void *arg)
                 const char *type = (const char *)(&header[4]);
                 uint32_t msgLen = UInt32GetLE(&header[16]);
                 uint32_t checksum = UInt32GetLE(&header[20]);
+                double deadline;
+                LWSHA256Context sha;
                 UInt256 hash;
                 
                 if (msgLen > MAX_MSG_LENGTH) { // check message length
@@ -963,17 +1465,14 @@ static void *_peerThreadRoutine(void *arg)
                     assert(payload != NULL);
                     len = 0;
                     socket = ctx->socket;
-                    msgTimeout = time + MESSAGE_TIMEOUT;
+                    deadline = _LWPeerNow() + ctx->messageTimeout; // whole payload must arrive within the timeout
+                    LWSHA256Init(&sha); // the checksum is computed as each chunk arrives, overlapping the network wait
                     
                     while (socket >= 0 && ! error && len < msgLen) {
-                        n = read(socket, &payload[len], msgLen - len);
-                        if (n > 0) len += n;
-                        if (n == 0) error = ECONNRESET;
-                        if (n < 0 && errno != EWOULDBLOCK) error = errno;
-                        gettimeofday(&tv, NULL);
-                        time = tv.tv_sec + (double)tv.tv_usec/1000000;
-                        if (n > 0) msgTimeout = time + MESSAGE_TIMEOUT;
-                        if (! error && time >= msgTimeout) error = ETIMEDOUT;
+                        n = _LWPeerRecv(peer, socket, &payload[len], msgLen - len, deadline, &time, &error);
+                        _LWPeerCheckDeadlines(peer, time, &error);
+                        LWSHA256Update(&sha, &payload[len], n);
+                        len += n;
                         socket = ctx->socket;
                     }
                     
@@ -981,14 +1480,28 @@ static void *_peerThreadRoutine(void *arg)
                         peer_log(peer, "%s", strerror(error));
                     }
                     else if (len == msgLen) {
-                        LWSHA256_2(&hash, payload, msgLen);
+                        LWSHA256Final(&sha, &hash);
+                        LWSHA256(&hash, &hash, sizeof(hash));
                         
                         if (UInt32GetLE(&hash) != checksum) { // verify checksum
                             peer_log(peer, "error reading %s, invalid checksum %x, expected %x, payload length:%"PRIu32
                                      ", SHA256_2:%s", type, UInt32GetLE(&hash), checksum, msgLen, u256hex(hash));
                             error = EPROTO;
                         }
-                        else if (! _LWPeerAcceptMessage(peer, payload, msgLen, type)) error = EPROTO;
+                        else {
+                            double start = _LWPeerNow();
+                            LWPeerMessageStats *stats = _LWPeerMessageStats(peer, type);
+
+                            ctx->parseTime = 0;
+                            if (! _LWPeerAcceptMessage(peer, payload, msgLen, type)) error = EPROTO;
+                            _LWPeerArenaReset(peer);
+                            pthread_mutex_lock(&ctx->sendLock);
+                            stats->msgsIn++;
+                            stats->bytesIn += HEADER_LENGTH + msgLen;
+                            _LWPeerHistogramAdd(ctx->stats.handlerTime, _LWPeerNow() - start);
+                            if (ctx->parseTime > 0) _LWPeerHistogramAdd(ctx->stats.parseTime, ctx->parseTime);
+                            pthread_mutex_unlock(&ctx->sendLock);
+                        }
                     }
                 }
             }
@@ -1001,6 +1514,10 @@ static void *_peerThreadRoutine(void *arg)
     ctx->socket = -1;
     ctx->status = LWPeerStatusDisconnected;
     if (socket >= 0) close(socket);
+    pthread_mutex_lock(&ctx->sendLock);
+    _LWPeerClearSendQueue(peer);
+    pthread_mutex_unlock(&ctx->sendLock);
+    _LWPeerArenaFree(peer);
     peer_log(peer, "disconnected");
     
     while (array_count(ctx->pongCallback) > 0) {
@@ -1032,11 +1549,27 @@ LWPeer *LWPeerNew(uint32_t magicNumber)
     ctx->magicNumber = magicNumber;
     array_new(ctx->useragent, 40);
     array_new(ctx->knownBlockHashes, 10);
+    array_new(ctx->queuedBlockHashes, 10);
+    array_new(ctx->blockRequestTimes, 10);
+    array_new(ctx->getheadersLocators, 10);
+    array_new(ctx->getheadersLocatorCounts, 10);
+    ctx->blockWindow = BLOCK_WINDOW_INIT;
+    ctx->messageTimeout = MESSAGE_TIMEOUT;
     array_new(ctx->currentBlockTxHashes, 10);
     array_new(ctx->knownTxHashes, 10);
+    array_new(ctx->oldKnownTxHashes, 10);
     ctx->knownTxHashSet = LWSetNew(LWTransactionHash, LWTransactionEq, 10);
+    ctx->oldKnownTxHashSet = LWSetNew(LWTransactionHash, LWTransactionEq, 10);
     array_new(ctx->pongInfo, 10);
     array_new(ctx->pongCallback, 10);
+    array_new(ctx->sendQueue, 10);
+    ctx->wakeFd[0] = ctx->wakeFd[1] = -1;
+    pthread_mutex_init(&ctx->sendLock, NULL);
+
+    for (size_t i = 0; i < LW_PEER_STATS_TYPES - 1; i++) {
+        strncpy(ctx->stats.messages[i].type, _LWPeerStatsTypes[i], sizeof(ctx->stats.messages[i].type) - 1);
+    }
+
     ctx->pingTime = DBL_MAX;
     ctx->mempoolTime = DBL_MAX;
     ctx->disconnectTime = DBL_MAX;
@@ -1127,6 +1660,12 @@ void LWPeerConnect(LWPeer *peer)
             ctx->waitingForNetwork = 0;
             gettimeofday(&tv, NULL);
             ctx->disconnectTime = tv.tv_sec + (double)tv.tv_usec/1000000 + CONNECT_TIMEOUT;
+            array_clear(ctx->queuedBlockHashes);
+            array_clear(ctx->blockRequestTimes);
+            array_clear(ctx->getheadersLocators);
+            array_clear(ctx->getheadersLocatorCounts);
+            ctx->blocksInFlight = 0;
+            ctx->needsGetblocks = 0;
 
             if (pthread_attr_init(&attr) != 0) {
                 error = ENOMEM;
@@ -1166,7 +1705,10 @@ void LWPeerScheduleDisconnect(LWPeer *peer, double seconds)
     struct timeval tv;
     
     gettimeofday(&tv, NULL);
+    pthread_mutex_lock(&ctx->sendLock);
     ctx->disconnectTime = (seconds < 0) ? DBL_MAX : tv.tv_sec + (double)tv.tv_usec/1000000 + seconds;
+    _LWPeerWake(peer); // the peer thread may be blocked waiting on the old deadline
+    pthread_mutex_unlock(&ctx->sendLock);
 }
 
 // call this when wallet addresses need to be added to bloom filter
@@ -1214,17 +1756,48 @@ double LWPeerPingTime(LWPeer *peer)
     return ((LWPeerContext *)peer)->pingTime;
 }
 
+// copies network and message handling statistics accumulated since peer was created into stats
+void LWPeerStatsSnapshot(LWPeer *peer, LWPeerStats *stats)
+{
+    LWPeerContext *ctx = (LWPeerContext *)peer;
+
+    assert(stats != NULL);
+    pthread_mutex_lock(&ctx->sendLock);
+    *stats = ctx->stats;
+    pthread_mutex_unlock(&ctx->sendLock);
+}
+
+// adds the counts in otherStats to stats
+void LWPeerStatsAdd(LWPeerStats *stats, const LWPeerStats *otherStats)
+{
+    size_t i;
+
+    assert(stats != NULL);
+    assert(otherStats != NULL);
+
+    for (i = 0; i < LW_PEER_STATS_TYPES; i++) {
+        strncpy(stats->messages[i].type, otherStats->messages[i].type, sizeof(stats->messages[i].type) - 1);
+        stats->messages[i].msgsIn += otherStats->messages[i].msgsIn;
+        stats->messages[i].bytesIn += otherStats->messages[i].bytesIn;
+        stats->messages[i].msgsOut += otherStats->messages[i].msgsOut;
+        stats->messages[i].bytesOut += otherStats->messages[i].bytesOut;
+    }
+
+    for (i = 0; i < LW_PEER_STATS_BUCKETS; i++) {
+        stats->parseTime[i] += otherStats->parseTime[i];
+        stats->handlerTime[i] += otherStats->handlerTime[i];
+        stats->blockLatency[i] += otherStats->blockLatency[i];
+    }
+}
+
 // minimum tx fee rate peer will accept
 uint64_t LWPeerFeePerKb(LWPeer *peer)
 {
     return ((LWPeerContext *)peer)->feePerKb;
 }
 
-#ifndef MSG_NOSIGNAL   // linux based systems have a MSG_NOSIGNAL send flag, useful for supressing SIGPIPE signals
-#define MSG_NOSIGNAL 0 // set to 0 if undefined (BSD has the SO_NOSIGPIPE sockopt, and windows has no signals at all)
-#endif
-
 // sends a bitcoin protocol message to peer
+// the message is queued and written to the socket by the peer thread, so the calling thread never blocks on the network
 void LWPeerSendMessage(LWPeer *peer, const uint8_t *msg, size_t msgLen, const char *type)
 {
     if (msgLen > MAX_MSG_LENGTH) {
@@ -1232,37 +1805,55 @@ void LWPeerSendMessage(LWPeer *peer, const uint8_t *msg, size_t msgLen, const ch
     }
     else {
         LWPeerContext *ctx = (LWPeerContext *)peer;
-        uint8_t buf[HEADER_LENGTH + msgLen], hash[32];
+        LWQueuedMsg m;
+        uint8_t hash[32];
         size_t off = 0;
-        ssize_t n = 0;
-        struct timeval tv;
-        int socket, error = 0;
+        int error = 0;
         
-        UInt32SetLE(&buf[off], ctx->magicNumber);
+        memset(&m, 0, sizeof(m));
+        UInt32SetLE(&m.header[off], ctx->magicNumber);
         off += sizeof(uint32_t);
-        strncpy((char *)&buf[off], type, 12);
+        strncpy((char *)&m.header[off], type, 12);
         off += 12;
-        UInt32SetLE(&buf[off], (uint32_t)msgLen);
+        UInt32SetLE(&m.header[off], (uint32_t)msgLen);
         off += sizeof(uint32_t);
         LWSHA256_2(hash, msg, msgLen);
-        memcpy(&buf[off], hash, sizeof(uint32_t));
+        memcpy(&m.header[off], hash, sizeof(uint32_t));
         off += sizeof(uint32_t);
-        memcpy(&buf[off], msg, msgLen);
+
+        if (msgLen > 0) {
+            m.payload = malloc(msgLen);
+            assert(m.payload != NULL);
+            memcpy(m.payload, msg, msgLen);
+            m.payloadLen = msgLen;
+        }
+
         peer_log(peer, "sending %s", type);
-        msgLen = 0;
-        socket = ctx->socket;
-        if (socket < 0) error = ENOTCONN;
-        
-        while (socket >= 0 && ! error && msgLen < sizeof(buf)) {
-            n = send(socket, &buf[msgLen], sizeof(buf) - msgLen, MSG_NOSIGNAL);
-            if (n >= 0) msgLen += n;
-            if (n < 0 && errno != EWOULDBLOCK) error = errno;
-            gettimeofday(&tv, NULL);
-            if (! error && tv.tv_sec + (double)tv.tv_usec/1000000 >= ctx->disconnectTime) error = ETIMEDOUT;
-            socket = ctx->socket;
+        pthread_mutex_lock(&ctx->sendLock);
+
+        if (ctx->socket < 0 || ctx->wakeFd[1] < 0) {
+            error = ENOTCONN;
         }
-        
+        else if (ctx->sendQueueLen + HEADER_LENGTH + msgLen > SEND_QUEUE_MAX) { // peer isn't reading what we send
+            error = ENOBUFS;
+        }
+        else {
+            LWPeerMessageStats *stats = _LWPeerMessageStats(peer, type);
+
+            stats->msgsOut++;
+            stats->bytesOut += HEADER_LENGTH + msgLen;
+            if (array_count(ctx->sendQueue) == 0) ctx->sendProgressTime = _LWPeerNow();
+            ctx->sendQueueLen += HEADER_LENGTH + msgLen;
+            array_add(ctx->sendQueue, m);
+            // the peer thread flushes its queue before it next waits on the socket, so messages it sends while handling
+            // a received message are coalesced, otherwise wake it up
+            _LWPeerWake(peer);
+        }
+
+        pthread_mutex_unlock(&ctx->sendLock);
+
         if (error) {
+            if (m.payload) free(m.payload);
             peer_log(peer, "%s", strerror(error));
             LWPeerDisconnect(peer);
         }
@@ -1356,6 +1947,7 @@ void LWPeerSendMempool(LWPeer *peer, const UInt256 knownTxHashes[], size_t known
 
 void LWPeerSendGetheaders(LWPeer *peer, const UInt256 locators[], size_t locatorsCount, UInt256 hashStop)
 {
+    LWPeerContext *ctx = (LWPeerContext *)peer;
     size_t i, off = 0;
     size_t msgLen = sizeof(uint32_t) + LWVarIntSize(locatorsCount) + sizeof(*locators)*locatorsCount + sizeof(hashStop);
     uint8_t msg[msgLen];
@@ -1375,6 +1967,10 @@ void LWPeerSendGetheaders(LWPeer *peer, const UInt256 locators[], size_t locator
     if (locatorsCount > 0) {
         peer_log(peer, "calling getheaders with %zu locators: [%s,%s %s]", locatorsCount, u256hex(locators[0]),
                  (locatorsCount > 2 ? " ...," : ""), (locatorsCount > 1 ? u256hex(locators[locatorsCount - 1]) : ""));
+        pthread_mutex_lock(&ctx->sendLock);
+        array_add_array(ctx->getheadersLocators, locators, locatorsCount);
+        array_add(ctx->getheadersLocatorCounts, locatorsCount);
+        pthread_mutex_unlock(&ctx->sendLock);
         LWPeerSendMessage(peer, msg, off, MSG_GETHEADERS);
     }
 }
@@ -1406,14 +2002,17 @@ void LWPeerSendGetblocks(LWPeer *peer, const UInt256 locators[], size_t locators
 
 void LWPeerSendInv(LWPeer *peer, const UInt256 txHashes[], size_t txCount)
 {
-    LWPeerContext *ctx = (LWPeerContext *)peer;
-    size_t knownCount = array_count(ctx->knownTxHashes);
+    size_t i, count = 0;
+    UInt256 hashes[(txCount > 0) ? txCount : 1];
+
+    for (i = 0; i < txCount; i++) {
+        if (_LWPeerAddKnownTxHash(peer, txHashes[i])) hashes[count++] = txHashes[i];
+    }
 
-    _LWPeerAddKnownTxHashes(peer, txHashes, txCount);
-    txCount = array_count(ctx->knownTxHashes) - knownCount;
+    txCount = count;
 
     if (txCount > 0) {
-        size_t i, off = 0, msgLen = LWVarIntSize(txCount) + (sizeof(uint32_t) + sizeof(*txHashes))*txCount;
+        size_t off = 0, msgLen = LWVarIntSize(txCount) + (sizeof(uint32_t) + sizeof(*txHashes))*txCount;
         uint8_t msg[msgLen];
         
         off += LWVarIntSet(&msg[off], (off <= msgLen ? msgLen - off : 0), txCount);
@@ -1421,7 +2020,7 @@ void LWPeerSendInv(LWPeer *peer, const UInt256 txHashes[], size_t txCount)
         for (i = 0; i < txCount; i++) {
             UInt32SetLE(&msg[off], inv_tx);
             off += sizeof(uint32_t);
-            UInt256Set(&msg[off], ctx->knownTxHashes[knownCount + i]);
+            UInt256Set(&msg[off], hashes[i]);
             off += sizeof(UInt256);
         }
 
@@ -1487,12 +2086,20 @@ void LWPeerRerequestBlocks(LWPeer *peer, UInt256 fromBlock)
 {
     LWPeerContext *ctx = (LWPeerContext *)peer;
     size_t i = array_count(ctx->knownBlockHashes);
+    double now;
     
     while (i > 0 && ! UInt256Eq(ctx->knownBlockHashes[i - 1], fromBlock)) i--;
    
     if (i > 0) {
         array_rm_range(ctx->knownBlockHashes, 0, i - 1);
         peer_log(peer, "re-requesting %zu block(s)", array_count(ctx->knownBlockHashes));
+        array_clear(ctx->queuedBlockHashes); // every queued hash is included in knownBlockHashes
+        ctx->needsGetblocks = 0;
+        ctx->blocksInFlight = array_count(ctx->knownBlockHashes);
+        ctx->lastBlockTime = 0;
+        array_clear(ctx->blockRequestTimes);
+        now = _LWPeerNow();
+        for (i = 0; i < ctx->blocksInFlight; i++) array_add(ctx->blockRequestTimes, now);
         LWPeerSendGetdata(peer, NULL, 0, ctx->knownBlockHashes, array_count(ctx->knownBlockHashes));
     }
 }
@@ -1504,14 +2111,36 @@ void LWPeerFree(LWPeer *peer)
     if (ctx->useragent) array_free(ctx->useragent);
     if (ctx->currentBlockTxHashes) array_free(ctx->currentBlockTxHashes);
     if (ctx->knownBlockHashes) array_free(ctx->knownBlockHashes);
+    if (ctx->queuedBlockHashes) array_free(ctx->queuedBlockHashes);
+    if (ctx->blockRequestTimes) array_free(ctx->blockRequestTimes);
+    if (ctx->getheadersLocators) array_free(ctx->getheadersLocators);
+    if (ctx->getheadersLocatorCounts) array_free(ctx->getheadersLocatorCounts);
+    _LWPeerArenaFree(peer);
     if (ctx->knownTxHashes) array_free(ctx->knownTxHashes);
     if (ctx->knownTxHashSet) LWSetFree(ctx->knownTxHashSet);
+    if (ctx->oldKnownTxHashes) array_free(ctx->oldKnownTxHashes);
+    if (ctx->oldKnownTxHashSet) LWSetFree(ctx->oldKnownTxHashSet);
     if (ctx->pongInfo) array_free(ctx->pongInfo);
     if (ctx->pongCallback) array_free(ctx->pongCallback);
+
+    if (ctx->sendQueue) {
+        _LWPeerClearSendQueue(peer);
+        array_free(ctx->sendQueue);
+    }
+
+    pthread_mutex_destroy(&ctx->sendLock);
     free(ctx);
 }
 
-void LWPeerAcceptMessageTest(LWPeer *peer, const uint8_t *msg, size_t msgLen, const char *type)
+int LWPeerAcceptMessageTest(LWPeer *peer, const uint8_t *msg, size_t msgLen, const char *type)
+{
+    int r = _LWPeerAcceptMessage(peer, msg, msgLen, type);
+
+    _LWPeerArenaReset(peer);
+    return r;
+}
+
+void LWPeerSetMessageTimeoutTest(LWPeer *peer, double timeout)
 {
-    _LWPeerAcceptMessage(peer, msg, msgLen, type);
+    ((LWPeerContext *)peer)->messageTimeout = timeout;
 }
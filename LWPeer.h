@@ -62,6 +62,7 @@ extern "C" {
 #define MSG_ALERT       "alert"
 #define MSG_REJECT      "reject"   // described in BIP61: https://github.com/bitcoin/bips/blob/master/bip-0061.mediawiki
 #define MSG_FEEFILTER   "feefilter"// described in BIP133 https://github.com/bitcoin/bips/blob/master/bip-0133.mediawiki
+#define MSG_SENDHEADERS "sendheaders"// described in BIP130 https://github.com/bitcoin/bips/blob/master/bip-0130.mediawiki
 
 #define REJECT_INVALID     0x10 // transaction is invalid for some reason (invalid signature, output value > input, etc)
 #define REJECT_SPENT       0x12 // an input is already spent
@@ -85,6 +86,21 @@ typedef struct {
 
 #define LW_PEER_NONE ((LWPeer) { UINT128_ZERO, 0, 0, 0, 0 })
 
+#define LW_PEER_STATS_TYPES   24 // message types tracked individually, the last entry counts unrecognized types
+#define LW_PEER_STATS_BUCKETS 24 // histogram bucket i counts samples under 2^i microseconds, the last counts the rest
+
+typedef struct {
+    char type[13]; // message type, empty for the entry counting unrecognized types
+    uint64_t msgsIn, bytesIn, msgsOut, bytesOut; // byte counts include the 24 byte message header
+} LWPeerMessageStats;
+
+typedef struct {
+    LWPeerMessageStats messages[LW_PEER_STATS_TYPES];
+    uint64_t parseTime[LW_PEER_STATS_BUCKETS]; // deserializing and validating tx, merkleblock and headers messages
+    uint64_t handlerTime[LW_PEER_STATS_BUCKETS]; // handling each received message, including callbacks to the manager
+    uint64_t blockLatency[LW_PEER_STATS_BUCKETS]; // from merkleblock getdata request to merkleblock arrival
+} LWPeerStats;
+
 // NOTE: LWPeer functions are not thread-safe
 
 // returns a newly allocated LWPeer struct that must be freed by calling LWPeerFree()
@@ -156,7 +172,13 @@ uint64_t LWPeerFeePerKb(LWPeer *peer);
 // average ping time for connected peer
 double LWPeerPingTime(LWPeer *peer);
 
-// sends a bitcoin protocol message to peer
+// copies network and message handling statistics accumulated since peer was created into stats
+void LWPeerStatsSnapshot(LWPeer *peer, LWPeerStats *stats);
+
+// adds the counts in otherStats to stats
+void LWPeerStatsAdd(LWPeerStats *stats, const LWPeerStats *otherStats);
+
+// queues a bitcoin protocol message to be sent to peer by the peer thread (does not block on the network)
 void LWPeerSendMessage(LWPeer *peer, const uint8_t *msg, size_t msgLen, const char *type);
 void LWPeerSendFilterload(LWPeer *peer, const uint8_t *filter, size_t filterLen);
 void LWPeerSendMempool(LWPeer *peer, const UInt256 knownTxHashes[], size_t knownTxCount, void *info,
@@ -160,6 +160,12 @@ struct LWPeerManagerStruct {
     LWTxPeerList *txRelays, *txRequests;
     LWPublishedTx *publishedTx;
     UInt256 *publishedTxHashes;
+    LWTransaction **syncTxs; // wallet tx relayed by syncTxPeer during sync, registered in a batch with their block
+    LWPeer syncTxPeer;
+    int verifyTx, verifyThreadCount; // verify relayed wallet tx signatures on a worker thread before registering them
+    LWTransaction **verifyTxs; // relayed wallet tx waiting for signature verification
+    LWPeer *verifyTxPeers; // peer that relayed each tx in verifyTxs
+    LWPeerStats stats; // totals from peers that have disconnected
     void *info;
     void (*syncStarted)(void *info);
     void (*syncStopped)(void *info, int error);
@@ -185,20 +191,6 @@ static void _LWPeerManagerPeerMisbehavin(LWPeerManager *manager, LWPeer *peer)
     LWPeerDisconnect(peer);
 }
 
-static void _LWPeerManagerSyncStopped(LWPeerManager *manager)
-{
-    manager->syncStartHeight = 0;
-
-    if (manager->downloadPeer) {
-        // don't cancel timeout if there's a pending tx publish callback
-        for (size_t i = array_count(manager->publishedTx); i > 0; i--) {
-            if (manager->publishedTx[i - 1].callback != NULL) return;
-        }
-
-        LWPeerScheduleDisconnect(manager->downloadPeer, -1); // cancel sync timeout
-    }
-}
-
 // adds transaction to list of tx to be published, along with any unconfirmed inputs
 static void _LWPeerManagerAddTxToPublishList(LWPeerManager *manager, LWTransaction *tx, void *info,
                                              void (*callback)(void *, int))
@@ -257,8 +249,8 @@ static void _LWPeerManagerLoadBloomFilter(LWPeerManager *manager, LWPeer *peer)
     manager->filterUpdateHeight = manager->lastBlock->height;
     manager->fpRate = BLOOM_REDUCED_FALSEPOSITIVE_RATE;
 
-    size_t addrsCount = LWWalletAllAddrs(manager->wallet, NULL, 0);
-    LWAddress *addrs = malloc(addrsCount*sizeof(*addrs));
+    size_t addrsCount = LWWalletAllScriptHashes(manager->wallet, NULL, 0);
+    LWScriptHash *addrs = malloc(addrsCount*sizeof(*addrs));
     size_t utxosCount = LWWalletUTXOs(manager->wallet, NULL, 0);
     LWUTXO *utxos = malloc(utxosCount*sizeof(*utxos));
     uint32_t blockHeight = (manager->lastBlock->height > 100) ? manager->lastBlock->height - 100 : 0;
@@ -269,19 +261,15 @@ static void _LWPeerManagerLoadBloomFilter(LWPeerManager *manager, LWPeer *peer)
     assert(addrs != NULL);
     assert(utxos != NULL);
     assert(transactions != NULL);
-    addrsCount = LWWalletAllAddrs(manager->wallet, addrs, addrsCount);
+    addrsCount = LWWalletAllScriptHashes(manager->wallet, addrs, addrsCount);
     utxosCount = LWWalletUTXOs(manager->wallet, utxos, utxosCount);
     txCount = LWWalletTxUnconfirmedBefore(manager->wallet, transactions, txCount, blockHeight);
     filter = LWBloomFilterNew(manager->fpRate, addrsCount + utxosCount + txCount + 100, (uint32_t)LWPeerHash(peer),
                               BLOOM_UPDATE_ALL); // BUG: XXX txCount not the same as number of spent wallet outputs
 
     for (size_t i = 0; i < addrsCount; i++) { // add addresses to watch for tx receiveing money to the wallet
-        UInt160 hash = UINT160_ZERO;
-
-        LWAddressHash160(&hash, addrs[i].s);
-
-        if (! UInt160IsZero(hash) && ! LWBloomFilterContainsData(filter, hash.u8, sizeof(hash))) {
-            LWBloomFilterInsertData(filter, hash.u8, sizeof(hash));
+        if (addrs[i].len > 0 && ! LWBloomFilterContainsData(filter, addrs[i].hash, addrs[i].len)) {
+            LWBloomFilterInsertData(filter, addrs[i].hash, addrs[i].len);
         }
     }
 
@@ -304,7 +292,7 @@ static void _LWPeerManagerLoadBloomFilter(LWPeerManager *manager, LWPeer *peer)
             uint8_t o[sizeof(UInt256) + sizeof(uint32_t)];
 
             if (tx && input->index < tx->outCount &&
-                LWWalletContainsAddress(manager->wallet, tx->outputs[input->index].address)) {
+                LWWalletContainsScriptHash(manager->wallet, &tx->outputs[input->index].address)) {
                 UInt256Set(o, input->txHash);
                 UInt32SetLE(&o[sizeof(UInt256)], input->index);
                 if (! LWBloomFilterContainsData(filter, o, sizeof(o))) LWBloomFilterInsertData(filter, o,sizeof(o));
@@ -426,6 +414,87 @@ static void _LWPeerManagerUpdateFilter(LWPeerManager *manager)
     }
 }
 
+// the transaction likely consumed one or more wallet addresses, so check that at least the next <gap limit> unused
+// addresses are still matched by the bloom filter
+static void _LWPeerManagerCheckFilter(LWPeerManager *manager)
+{
+    LWScriptHash addrs[SEQUENCE_GAP_LIMIT_EXTERNAL + SEQUENCE_GAP_LIMIT_INTERNAL];
+
+    if (manager->bloomFilter == NULL) return; // bloom filter is already being updated
+    LWWalletUnusedScriptHashes(manager->wallet, addrs, SEQUENCE_GAP_LIMIT_EXTERNAL, 0);
+    LWWalletUnusedScriptHashes(manager->wallet, addrs + SEQUENCE_GAP_LIMIT_EXTERNAL, SEQUENCE_GAP_LIMIT_INTERNAL, 1);
+
+    for (size_t i = 0; i < SEQUENCE_GAP_LIMIT_EXTERNAL + SEQUENCE_GAP_LIMIT_INTERNAL; i++) {
+        if (addrs[i].len == 0 || LWBloomFilterContainsData(manager->bloomFilter, addrs[i].hash, addrs[i].len)) continue;
+        if (manager->bloomFilter) LWBloomFilterFree(manager->bloomFilter);
+        manager->bloomFilter = NULL; // reset bloom filter so it's recreated with new wallet addresses
+        _LWPeerManagerUpdateFilter(manager);
+        break;
+    }
+}
+
+// true if tx is associated with the wallet, or spends a wallet output of a tx waiting in syncTxs
+static int _LWPeerManagerIsSyncWalletTx(LWPeerManager *manager, const LWTransaction *tx)
+{
+    LWTransaction *t;
+    uint32_t n;
+
+    if (LWWalletContainsTransaction(manager->wallet, tx)) return 1;
+
+    for (size_t i = 0; i < tx->inCount; i++) {
+        n = tx->inputs[i].index;
+
+        for (size_t j = array_count(manager->syncTxs); j > 0; j--) {
+            t = manager->syncTxs[j - 1];
+            if (! UInt256Eq(t->txHash, tx->inputs[i].txHash)) continue;
+            if (n < t->outCount && LWWalletContainsScriptHash(manager->wallet, &t->outputs[n].address)) return 1;
+            break;
+        }
+    }
+
+    return 0;
+}
+
+// registers the wallet tx relayed during sync with a single wallet update, instead of one update per tx
+static void _LWPeerManagerRegisterSyncTxs(LWPeerManager *manager)
+{
+    size_t count = array_count(manager->syncTxs);
+    LWTransaction *tx;
+
+    if (count == 0) return;
+    LWWalletRegisterTransactions(manager->wallet, manager->syncTxs, count);
+
+    for (size_t i = 0; i < count; i++) {
+        tx = LWWalletTransactionForHash(manager->wallet, manager->syncTxs[i]->txHash);
+        if (tx != manager->syncTxs[i]) LWTransactionFree(manager->syncTxs[i]); // not added, or a duplicate
+        if (! tx) continue;
+
+        if (LWWalletAmountSentByTx(manager->wallet, tx) > 0 && LWWalletTransactionIsValid(manager->wallet, tx)) {
+            _LWPeerManagerAddTxToPublishList(manager, tx, NULL, NULL); // add valid send tx to mempool
+        }
+
+        _LWTxPeerListRemovePeer(manager->txRequests, tx->txHash, &manager->syncTxPeer);
+    }
+
+    array_clear(manager->syncTxs);
+    _LWPeerManagerCheckFilter(manager);
+}
+
+static void _LWPeerManagerSyncStopped(LWPeerManager *manager)
+{
+    _LWPeerManagerRegisterSyncTxs(manager);
+    manager->syncStartHeight = 0;
+
+    if (manager->downloadPeer) {
+        // don't cancel timeout if there's a pending tx publish callback
+        for (size_t i = array_count(manager->publishedTx); i > 0; i--) {
+            if (manager->publishedTx[i - 1].callback != NULL) return;
+        }
+
+        LWPeerScheduleDisconnect(manager->downloadPeer, -1); // cancel sync timeout
+    }
+}
+
 static void _LWPeerManagerUpdateTx(LWPeerManager *manager, const UInt256 txHashes[], size_t txCount,
                                    uint32_t blockHeight, uint32_t timestamp)
 {
@@ -811,6 +880,7 @@ static void _peerDisconnected(void *info, int error)
     LWPeer *peer = ((LWPeerCallbackInfo *)info)->peer;
     LWPeerManager *manager = ((LWPeerCallbackInfo *)info)->manager;
     LWTxPeerList *peerList;
+    LWPeerStats stats;
     int willSave = 0, willReconnect = 0, txError = 0;
     size_t txCount = 0;
 
@@ -845,6 +915,7 @@ static void _peerDisconnected(void *info, int error)
     }
 
     if (peer == manager->downloadPeer) { // download peer disconnected
+        _LWPeerManagerRegisterSyncTxs(manager);
         manager->isConnected = 0;
         manager->downloadPeer = NULL;
         if (manager->connectFailureCount > MAX_CONNECT_FAILURES) manager->connectFailureCount = MAX_CONNECT_FAILURES;
@@ -880,6 +951,8 @@ static void _peerDisconnected(void *info, int error)
         break;
     }
 
+    LWPeerStatsSnapshot(peer, &stats);
+    LWPeerStatsAdd(&manager->stats, &stats);
     LWPeerFree(peer);
     pthread_mutex_unlock(&manager->lock);
 
@@ -923,13 +996,186 @@ static void _peerRelayedPeers(void *info, const LWPeer peers[], size_t peersCoun
         manager->savePeers) manager->savePeers(manager->info, 1, save, peersCount);
 }
 
+// registers a relayed tx with the wallet if it belongs there, and keeps track of the peers that relay it
+// relayCount is the number of peers already known to have relayed tx, must be called with manager->lock held
+static void _LWPeerManagerRelayedTx(LWPeerManager *manager, LWPeer *peer, LWTransaction *tx, size_t relayCount)
+{
+    int isWalletTx = 0;
+
+    if (manager->syncStartHeight == 0 || LWWalletContainsTransaction(manager->wallet, tx)) {
+        isWalletTx = LWWalletRegisterTransaction(manager->wallet, tx);
+        if (isWalletTx) tx = LWWalletTransactionForHash(manager->wallet, tx->txHash);
+    }
+    else {
+        LWTransactionFree(tx);
+        tx = NULL;
+    }
+
+    if (tx && isWalletTx) {
+        // reschedule sync timeout
+        if (manager->syncStartHeight > 0 && peer == manager->downloadPeer) {
+            LWPeerScheduleDisconnect(peer, PROTOCOL_TIMEOUT);
+        }
+
+        if (LWWalletAmountSentByTx(manager->wallet, tx) > 0 && LWWalletTransactionIsValid(manager->wallet, tx)) {
+            _LWPeerManagerAddTxToPublishList(manager, tx, NULL, NULL); // add valid send tx to mempool
+        }
+
+        // keep track of how many peers have or relay a tx, this indicates how likely the tx is to confirm
+        // (we only need to track this after syncing is complete)
+        if (manager->syncStartHeight == 0) relayCount = _LWTxPeerListAddPeer(&manager->txRelays, tx->txHash, peer);
+
+        _LWTxPeerListRemovePeer(manager->txRequests, tx->txHash, peer);
+        _LWPeerManagerCheckFilter(manager);
+    }
+
+    // set timestamp when tx is verified
+    if (tx && relayCount >= manager->maxConnectCount && tx->blockHeight == TX_UNCONFIRMED && tx->timestamp == 0) {
+        _LWPeerManagerUpdateTx(manager, &tx->txHash, 1, TX_UNCONFIRMED, (uint32_t)time(NULL));
+    }
+}
+
+// sets output to the output that input would spend if its scriptSig is standard, such as the pay-to-pubkey-hash output
+// for the pubkey a signature is paired with, so a forged signature is caught even if the spent output isn't known
+static void _LWPeerManagerScriptSigOutput(const LWTxInput *input, LWTxOutput *output)
+{
+    LWScriptHash sh;
+    LWAddress addr;
+
+    if (LWScriptHashFromScriptSig(&sh, input->signature, input->sigLen) &&
+        LWScriptHashAddress(addr.s, sizeof(addr.s), &sh) > 0) LWTxOutputSetAddress(output, addr.s);
+}
+
+// checks the signatures of a relayed tx, inputs that spend wallet outputs against the script and amount of the output,
+// and any other input against the output its scriptSig implies, returns 1 if every signature is valid, 0 if any is
+// invalid, -1 if an input spending a wallet output can't be verified, or -2 if only inputs spending other outputs can't
+static int _LWPeerManagerVerifyTx(LWPeerManager *manager, const LWTransaction *tx)
+{
+    LWTxOutput *outputs = malloc((tx->inCount + 1)*sizeof(*outputs));
+    int *verified = malloc((tx->inCount + 1)*sizeof(*verified)), *isWallet = malloc((tx->inCount + 1)*sizeof(int));
+    int r;
+    size_t i, unverified = 0, walletUnverified = 0;
+
+    assert(outputs != NULL && verified != NULL && isWallet != NULL);
+    LWWalletSpentOutputs(manager->wallet, tx, outputs);
+
+    for (i = 0; i < tx->inCount; i++) {
+        isWallet[i] = (outputs[i].script != NULL);
+        if (! isWallet[i]) _LWPeerManagerScriptSigOutput(&tx->inputs[i], &outputs[i]);
+    }
+
+    r = LWTransactionVerify(tx, outputs, verified);
+
+    for (i = 0; i < tx->inCount; i++) {
+        if (! verified[i]) unverified++;
+        if (! verified[i] && isWallet[i]) walletUnverified++;
+        LWTxOutputSetScript(&outputs[i], NULL, 0);
+    }
+
+    free(outputs);
+    free(verified);
+    free(isWallet);
+    return (! r) ? 0 : (walletUnverified > 0) ? -1 : (unverified > 0) ? -2 : 1;
+}
+
+// registers a tx that was queued for verification if its signatures checked out, or else frees it, peer is the copy
+// of the peer that relayed it that was queued with it, must be called with manager->lock held
+// a tx with inputs that can't be verified, none of which spend wallet outputs, is registered once enough peers relay it
+static void _LWPeerManagerVerifiedTx(LWPeerManager *manager, LWPeer *peer, LWTransaction *tx, int valid)
+{
+    LWPeer *p = NULL;
+    size_t relayCount = 0;
+
+    // only a peer that is still connected can be passed to the LWPeer functions, otherwise use the copy
+    for (size_t i = array_count(manager->connectedPeers); ! p && i > 0; i--) {
+        if (LWPeerEq(manager->connectedPeers[i - 1], peer)) p = manager->connectedPeers[i - 1];
+    }
+
+    if (valid == -2) relayCount = _LWTxPeerListAddPeer(&manager->txRelays, tx->txHash, peer);
+
+    if (valid > 0 || (valid == -2 && relayCount >= manager->maxConnectCount)) {
+        _LWPeerManagerRelayedTx(manager, (p) ? p : peer, tx, relayCount);
+    }
+    else {
+        if (p && valid == 0) peer_log(p, "relayed tx with invalid signature: %s", u256hex(tx->txHash));
+        if (p && valid == -1) peer_log(p, "relayed tx with unverifiable wallet input: %s", u256hex(tx->txHash));
+        if (p && valid == -2) peer_log(p, "relayed tx with unverifiable input, waiting for more peers to relay it: %s",
+                                       u256hex(tx->txHash));
+        LWTransactionFree(tx);
+    }
+}
+
+// verifies queued relayed tx until the queue is empty, taking the whole queue each pass and verifying it with
+// manager->lock released, must be called with manager->lock held
+static void _LWPeerManagerVerifyQueuedTxs(LWPeerManager *manager)
+{
+    LWTransaction **txs = NULL;
+    LWPeer *peers = NULL;
+    int *valid = NULL;
+    size_t i, count;
+
+    while ((count = array_count(manager->verifyTxs)) > 0) {
+        txs = realloc(txs, count*sizeof(*txs));
+        peers = realloc(peers, count*sizeof(*peers));
+        valid = realloc(valid, count*sizeof(*valid));
+        assert(txs != NULL && peers != NULL && valid != NULL);
+        memcpy(txs, manager->verifyTxs, count*sizeof(*txs));
+        memcpy(peers, manager->verifyTxPeers, count*sizeof(*peers));
+        array_clear(manager->verifyTxs);
+        array_clear(manager->verifyTxPeers);
+        pthread_mutex_unlock(&manager->lock);
+        for (i = 0; i < count; i++) valid[i] = _LWPeerManagerVerifyTx(manager, txs[i]);
+        pthread_mutex_lock(&manager->lock);
+        for (i = 0; i < count; i++) _LWPeerManagerVerifiedTx(manager, &peers[i], txs[i], valid[i]);
+    }
+
+    if (txs) free(txs);
+    if (peers) free(peers);
+    if (valid) free(valid);
+}
+
+static void *_verifyTxThreadRoutine(void *arg)
+{
+    LWPeerManager *manager = arg;
+
+    pthread_cleanup_push(manager->threadCleanup, manager->info);
+    pthread_mutex_lock(&manager->lock);
+    _LWPeerManagerVerifyQueuedTxs(manager);
+    manager->verifyThreadCount--;
+    pthread_mutex_unlock(&manager->lock);
+    pthread_cleanup_pop(1);
+    return NULL;
+}
+
+// starts a detached thread to verify queued relayed tx, unless one is already running, must be called with
+// manager->lock held
+static void _LWPeerManagerStartVerifyThread(LWPeerManager *manager)
+{
+    pthread_t thread;
+    pthread_attr_t attr;
+
+    if (manager->verifyThreadCount > 0) return;
+
+    if (pthread_attr_init(&attr) == 0 && pthread_attr_setdetachstate(&attr, PTHREAD_CREATE_DETACHED) == 0 &&
+        pthread_create(&thread, &attr, _verifyTxThreadRoutine, manager) == 0) manager->verifyThreadCount++;
+    else { // verify on the calling thread if a worker can't be started
+        for (size_t i = 0; i < array_count(manager->verifyTxs); i++) {
+            _LWPeerManagerVerifiedTx(manager, &manager->verifyTxPeers[i], manager->verifyTxs[i],
+                                     _LWPeerManagerVerifyTx(manager, manager->verifyTxs[i]));
+        }
+
+        array_clear(manager->verifyTxs);
+        array_clear(manager->verifyTxPeers);
+    }
+}
+
 static void _peerRelayedTx(void *info, LWTransaction *tx)
 {
     LWPeer *peer = ((LWPeerCallbackInfo *)info)->peer;
     LWPeerManager *manager = ((LWPeerCallbackInfo *)info)->manager;
     void *txInfo = NULL;
     void (*txCallback)(void *, int) = NULL;
-    int isWalletTx = 0, hasPendingCallbacks = 0;
+    int hasPendingCallbacks = 0;
     size_t relayCount = 0;
 
     pthread_mutex_lock(&manager->lock);
@@ -951,55 +1197,30 @@ static void _peerRelayedTx(void *info, LWTransaction *tx)
         LWPeerScheduleDisconnect(peer, -1); // cancel publish tx timeout
     }
 
-    if (manager->syncStartHeight == 0 || LWWalletContainsTransaction(manager->wallet, tx)) {
-        isWalletTx = LWWalletRegisterTransaction(manager->wallet, tx);
-        if (isWalletTx) tx = LWWalletTransactionForHash(manager->wallet, tx->txHash);
-    }
-    else {
-        LWTransactionFree(tx);
-        tx = NULL;
-    }
-
-    if (tx && isWalletTx) {
-        // reschedule sync timeout
-        if (manager->syncStartHeight > 0 && peer == manager->downloadPeer) {
-            LWPeerScheduleDisconnect(peer, PROTOCOL_TIMEOUT);
+    if (manager->syncStartHeight > 0 && peer == manager->downloadPeer && ! txCallback) {
+        // wallet tx from the download peer belong to the block being synced, so register them together with it
+        if (array_count(manager->syncTxs) > 0 && ! LWPeerEq(&manager->syncTxPeer, peer)) {
+            _LWPeerManagerRegisterSyncTxs(manager);
         }
 
-        if (LWWalletAmountSentByTx(manager->wallet, tx) > 0 && LWWalletTransactionIsValid(manager->wallet, tx)) {
-            _LWPeerManagerAddTxToPublishList(manager, tx, NULL, NULL); // add valid send tx to mempool
+        if (_LWPeerManagerIsSyncWalletTx(manager, tx)) {
+            manager->syncTxPeer = *peer;
+            array_add(manager->syncTxs, tx);
+            LWPeerScheduleDisconnect(peer, PROTOCOL_TIMEOUT); // reschedule sync timeout
         }
+        else LWTransactionFree(tx);
 
-        // keep track of how many peers have or relay a tx, this indicates how likely the tx is to confirm
-        // (we only need to track this after syncing is complete)
-        if (manager->syncStartHeight == 0) relayCount = _LWTxPeerListAddPeer(&manager->txRelays, tx->txHash, peer);
-
-        _LWTxPeerListRemovePeer(manager->txRequests, tx->txHash, peer);
-
-        if (manager->bloomFilter != NULL) { // check if bloom filter is already being updated
-            LWAddress addrs[SEQUENCE_GAP_LIMIT_EXTERNAL + SEQUENCE_GAP_LIMIT_INTERNAL];
-            UInt160 hash;
-
-            // the transaction likely consumed one or more wallet addresses, so check that at least the next <gap limit>
-            // unused addresses are still matched by the bloom filter
-            LWWalletUnusedAddrs(manager->wallet, addrs, SEQUENCE_GAP_LIMIT_EXTERNAL, 0);
-            LWWalletUnusedAddrs(manager->wallet, addrs + SEQUENCE_GAP_LIMIT_EXTERNAL, SEQUENCE_GAP_LIMIT_INTERNAL, 1);
-
-            for (size_t i = 0; i < SEQUENCE_GAP_LIMIT_EXTERNAL + SEQUENCE_GAP_LIMIT_INTERNAL; i++) {
-                if (! LWAddressHash160(&hash, addrs[i].s) ||
-                    LWBloomFilterContainsData(manager->bloomFilter, hash.u8, sizeof(hash))) continue;
-                if (manager->bloomFilter) LWBloomFilterFree(manager->bloomFilter);
-                manager->bloomFilter = NULL; // reset bloom filter so it's recreated with new wallet addresses
-                _LWPeerManagerUpdateFilter(manager);
-                break;
-            }
-        }
+        tx = NULL;
     }
-
-    // set timestamp when tx is verified
-    if (tx && relayCount >= manager->maxConnectCount && tx->blockHeight == TX_UNCONFIRMED && tx->timestamp == 0) {
-        _LWPeerManagerUpdateTx(manager, &tx->txHash, 1, TX_UNCONFIRMED, (uint32_t)time(NULL));
+    else if (manager->verifyTx && manager->syncStartHeight == 0 && ! txCallback &&
+             ! LWWalletTransactionForHash(manager->wallet, tx->txHash) &&
+             LWWalletContainsTransaction(manager->wallet, tx)) {
+        // new wallet tx are registered by the verifier thread once their signatures check out
+        array_add(manager->verifyTxs, tx);
+        array_add(manager->verifyTxPeers, *peer);
+        _LWPeerManagerStartVerifyThread(manager);
     }
+    else _LWPeerManagerRelayedTx(manager, peer, tx, relayCount);
 
     pthread_mutex_unlock(&manager->lock);
     if (txCallback) txCallback(txInfo, 0);
@@ -1162,6 +1383,7 @@ static void _peerRelayedBlock(void *info, LWMerkleBlock *block)
     assert(txHashes != NULL);
     txCount = LWMerkleBlockTxHashes(block, txHashes, txCount);
     pthread_mutex_lock(&manager->lock);
+    _LWPeerManagerRegisterSyncTxs(manager); // the block's wallet tx were relayed before it
     prev = LWSetGet(manager->blocks, &block->prevBlock);
 
     if (prev) {
@@ -1563,6 +1785,9 @@ LWPeerManager *LWPeerManagerNew(const LWChainParams *params, LWWallet *wallet, u
     array_new(manager->txRequests, 10);
     array_new(manager->publishedTx, 10);
     array_new(manager->publishedTxHashes, 10);
+    array_new(manager->syncTxs, 10);
+    array_new(manager->verifyTxs, 10);
+    array_new(manager->verifyTxPeers, 10);
     pthread_mutex_init(&manager->lock, NULL);
     manager->threadCleanup = _dummyThreadCleanup;
     return manager;
@@ -1612,6 +1837,17 @@ void LWPeerManagerSetFixedPeer(LWPeerManager *manager, UInt128 address, uint16_t
     pthread_mutex_unlock(&manager->lock);
 }
 
+// if verify is true, signatures of newly relayed wallet tx are checked on a worker thread before the tx is registered,
+// against the script and amount of each wallet output the tx spends, and any tx with an invalid signature, or with an
+// input spending a wallet output that can't be verified, is dropped (see LWTransactionVerify())
+void LWPeerManagerSetVerifyTx(LWPeerManager *manager, int verify)
+{
+    assert(manager != NULL);
+    pthread_mutex_lock(&manager->lock);
+    manager->verifyTx = verify;
+    pthread_mutex_unlock(&manager->lock);
+}
+
 uint16_t LWPeerManagerStandardPort(LWPeerManager *manager)
 {
     assert(manager != NULL);
@@ -1716,12 +1952,13 @@ void LWPeerManagerConnect(LWPeerManager *manager)
 void LWPeerManagerDisconnect(LWPeerManager *manager)
 {
     struct timespec ts;
-    size_t peerCount, dnsThreadCount;
+    size_t peerCount, dnsThreadCount, verifyThreadCount;
 
     assert(manager != NULL);
     pthread_mutex_lock(&manager->lock);
     peerCount = array_count(manager->connectedPeers);
     dnsThreadCount = manager->dnsThreadCount;
+    verifyThreadCount = manager->verifyThreadCount;
 
     for (size_t i = peerCount; i > 0; i--) {
         manager->connectFailureCount = MAX_CONNECT_FAILURES; // prevent futher automatic reconnect attempts
@@ -1732,11 +1969,12 @@ void LWPeerManagerDisconnect(LWPeerManager *manager)
     ts.tv_sec = 0;
     ts.tv_nsec = 1;
 
-    while (peerCount > 0 || dnsThreadCount > 0) {
+    while (peerCount > 0 || dnsThreadCount > 0 || verifyThreadCount > 0) {
         nanosleep(&ts, NULL); // pthread_yield() isn't POSIX standard :(
         pthread_mutex_lock(&manager->lock);
         peerCount = array_count(manager->connectedPeers);
         dnsThreadCount = manager->dnsThreadCount;
+        verifyThreadCount = manager->verifyThreadCount;
         pthread_mutex_unlock(&manager->lock);
     }
 }
@@ -1852,6 +2090,24 @@ size_t LWPeerManagerPeerCount(LWPeerManager *manager)
     return count;
 }
 
+// network and message handling statistics summed over every peer connection made by manager
+void LWPeerManagerStats(LWPeerManager *manager, LWPeerStats *stats)
+{
+    LWPeerStats peerStats;
+
+    assert(manager != NULL);
+    assert(stats != NULL);
+    pthread_mutex_lock(&manager->lock);
+    *stats = manager->stats;
+
+    for (size_t i = array_count(manager->connectedPeers); i > 0; i--) {
+        LWPeerStatsSnapshot(manager->connectedPeers[i - 1], &peerStats);
+        LWPeerStatsAdd(stats, &peerStats);
+    }
+
+    pthread_mutex_unlock(&manager->lock);
+}
+
 // description of the peer most recently used to sync blockchain data
 const char *LWPeerManagerDownloadPeerName(LWPeerManager *manager)
 {
@@ -1970,13 +2226,32 @@ void LWPeerManagerFree(LWPeerManager *manager)
     LWSetApply(manager->orphans, NULL, _setApplyFreeBlock);
     LWSetFree(manager->orphans);
     LWSetFree(manager->checkpoints);
-    for (size_t i = array_count(manager->txRelays); i > 0; i--) free(manager->txRelays[i - 1].peers);
+    for (size_t i = array_count(manager->txRelays); i > 0; i--) array_free(manager->txRelays[i - 1].peers);
     array_free(manager->txRelays);
-    for (size_t i = array_count(manager->txRequests); i > 0; i--) free(manager->txRequests[i - 1].peers);
+    for (size_t i = array_count(manager->txRequests); i > 0; i--) array_free(manager->txRequests[i - 1].peers);
     array_free(manager->txRequests);
     array_free(manager->publishedTx);
     array_free(manager->publishedTxHashes);
+    for (size_t i = array_count(manager->syncTxs); i > 0; i--) LWTransactionFree(manager->syncTxs[i - 1]);
+    array_free(manager->syncTxs);
+    for (size_t i = array_count(manager->verifyTxs); i > 0; i--) LWTransactionFree(manager->verifyTxs[i - 1]);
+    array_free(manager->verifyTxs);
+    array_free(manager->verifyTxPeers);
     pthread_mutex_unlock(&manager->lock);
     pthread_mutex_destroy(&manager->lock);
     free(manager);
 }
+
+void LWPeerManagerRelayedTxTest(LWPeerManager *manager, LWPeer *peer, LWTransaction *tx)
+{
+    LWPeerCallbackInfo info = { peer, manager, UINT256_ZERO };
+
+    pthread_mutex_lock(&manager->lock);
+    manager->verifyThreadCount++; // keeps a worker thread from starting, so tx is verified below on this thread
+    pthread_mutex_unlock(&manager->lock);
+    _peerRelayedTx(&info, tx);
+    pthread_mutex_lock(&manager->lock);
+    _LWPeerManagerVerifyQueuedTxs(manager);
+    manager->verifyThreadCount--;
+    pthread_mutex_unlock(&manager->lock);
+}
@@ -49,6 +49,12 @@ void LWPeerManagerSetCallbacks(LWPeerManager *manager, void *info,
 // set address to UINT128_ZERO to revert to default behavior
 void LWPeerManagerSetFixedPeer(LWPeerManager *manager, UInt128 address, uint16_t port);
 
+// if verify is true, signatures of newly relayed wallet tx are checked on a worker thread before the tx is registered,
+// against the script and amount of each wallet output the tx spends, or the output a standard scriptSig implies for any
+// other input, and any tx with an invalid signature, or with an input spending a wallet output that can't be verified,
+// is dropped (see LWTransactionVerify()), a tx with other unverifiable inputs waits until enough peers relay it
+void LWPeerManagerSetVerifyTx(LWPeerManager *manager, int verify);
+
 // current connect status
 LWPeerStatus LWPeerManagerConnectStatus(LWPeerManager *manager);
 
@@ -81,6 +87,9 @@ double LWPeerManagerSyncProgress(LWPeerManager *manager, uint32_t startHeight);
 // returns the number of currently connected peers
 size_t LWPeerManagerPeerCount(LWPeerManager *manager);
 
+// network and message handling statistics summed over every peer connection made by manager
+void LWPeerManagerStats(LWPeerManager *manager, LWPeerStats *stats);
+
 // description of the peer most recently used to sync blockchain data
 const char *LWPeerManagerDownloadPeerName(LWPeerManager *manager);
 
@@ -0,0 +1,56 @@
+//
+//  LWThread.h
+//  https://github.com/litecoin-foundation/litewallet-core#readme#OpenSourceLink
+
+#ifndef LWThread_h
+#define LWThread_h
+
+#include <stddef.h>
+#include <stdint.h>
+#include <pthread.h>
+#include <unistd.h>
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+// number of threads to split count items across, with at least batchMin items per thread, at most maxThreads, and no
+// more than the number of online cpus
+inline static size_t LWThreadCount(size_t count, size_t batchMin, size_t maxThreads)
+{
+    long cpus = sysconf(_SC_NPROCESSORS_ONLN);
+    size_t threadCount = count/batchMin;
+
+    if (threadCount > maxThreads) threadCount = maxThreads;
+    if (cpus > 0 && threadCount > (size_t)cpus) threadCount = (size_t)cpus;
+    return (threadCount > 0) ? threadCount : 1;
+}
+
+// calls routine on each of the batchCount structs of batchSize bytes in batches, all but the first on worker threads
+// the calling thread runs the first batch, and any batch whose thread failed to start, before waiting on the workers
+inline static void LWThreadRunBatches(void *(*routine)(void *), void *batches, size_t batchSize, size_t batchCount)
+{
+    pthread_t threads[(batchCount > 0) ? batchCount : 1];
+    int started[(batchCount > 0) ? batchCount : 1];
+    size_t i;
+
+    for (i = 1; i < batchCount; i++) {
+        started[i] = (pthread_create(&threads[i], NULL, routine, (uint8_t *)batches + i*batchSize) == 0);
+    }
+
+    if (batchCount > 0) routine(batches);
+
+    for (i = 1; i < batchCount; i++) {
+        if (! started[i]) routine((uint8_t *)batches + i*batchSize);
+    }
+
+    for (i = 1; i < batchCount; i++) {
+        if (started[i]) pthread_join(threads[i], NULL);
+    }
+}
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif // LWThread_h
@@ -6,11 +6,12 @@
 #include "LWKey.h"
 #include "LWAddress.h"
 #include "LWArray.h"
+#include "LWSet.h"
+#include "LWThread.h"
 #include <stdlib.h>
 #include <inttypes.h>
 #include <limits.h>
 #include <time.h>
-#include <unistd.h>
 
 #define TX_VERSION           0x00000001
 #define TX_LOCKTIME          0x00000000
@@ -20,6 +21,8 @@
 #define SIGHASH_ANYONECANPAY 0x80 // let other people add inputs, I don't care where the rest of the bitcoins come from
 #define SIGHASH_FORKID       0x40 // use BIP143 digest method (for b-cash/b-gold signatures)
 
+#define TX_PACKED            SIZE_MAX // array capacity marking an array packed into its tx allocation, not freed alone
+
 // returns a random number less than upperBound, for non-cryptographic use only
 uint32_t LWRand(uint32_t upperBound)
 {
@@ -38,17 +41,42 @@ uint32_t LWRand(uint32_t upperBound)
     return r % upperBound;
 }
 
+// frees array, unless it's packed into a tx allocation and is freed along with the tx
+static void _LWTxArrayFree(void *array)
+{
+    if (array && array_capacity(array) != TX_PACKED) array_free(array);
+}
+
+// bytes taken up in a tx allocation by a packed array of len bytes, including its header and alignment padding
+inline static size_t _LWTxPackedLen(size_t len)
+{
+    return sizeof(size_t)*2 + (len + sizeof(size_t) - 1)/sizeof(size_t)*sizeof(size_t);
+}
+
+// lays out an array of count items at *off in the tx allocation block, copying them from items if not NULL
+// the array has an LWArray header, so array_count() works on it, and is marked as packed so it isn't freed alone
+static void *_LWTxPack(uint8_t *block, size_t *off, const void *items, size_t count, size_t itemSize)
+{
+    size_t *header = (size_t *)&block[*off];
+    
+    header[0] = TX_PACKED;
+    header[1] = count;
+    if (items && count > 0) memcpy(&header[2], items, count*itemSize);
+    *off += _LWTxPackedLen(count*itemSize);
+    return &header[2];
+}
+
 void LWTxInputSetAddress(LWTxInput *input, const char *address)
 {
     assert(input != NULL);
     assert(address == NULL || LWAddressIsValid(address));
-    if (input->script) array_free(input->script);
+    _LWTxArrayFree(input->script);
     input->script = NULL;
     input->scriptLen = 0;
-    memset(input->address, 0, sizeof(input->address));
+    input->address = LW_SCRIPT_HASH_NONE;
 
     if (address) {
-        strncpy(input->address, address, sizeof(input->address) - 1);
+        LWScriptHashFromAddress(&input->address, address);
         input->scriptLen = LWAddressScriptPubKey(NULL, 0, address);
         array_new(input->script, input->scriptLen);
         array_set_count(input->script, input->scriptLen);
@@ -60,16 +88,16 @@ void LWTxInputSetScript(LWTxInput *input, const uint8_t *script, size_t scriptLe
 {
     assert(input != NULL);
     assert(script != NULL || scriptLen == 0);
-    if (input->script) array_free(input->script);
+    _LWTxArrayFree(input->script);
     input->script = NULL;
     input->scriptLen = 0;
-    memset(input->address, 0, sizeof(input->address));
+    input->address = LW_SCRIPT_HASH_NONE;
     
     if (script) {
         input->scriptLen = scriptLen;
         array_new(input->script, scriptLen);
         array_add_array(input->script, script, scriptLen);
-        LWAddressFromScriptPubKey(input->address, sizeof(input->address), script, scriptLen);
+        LWScriptHashFromScriptPubKey(&input->address, script, scriptLen);
     }
 }
 
@@ -77,7 +105,7 @@ void LWTxInputSetSignature(LWTxInput *input, const uint8_t *signature, size_t si
 {
     assert(input != NULL);
     assert(signature != NULL || sigLen == 0);
-    if (input->signature) array_free(input->signature);
+    _LWTxArrayFree(input->signature);
     input->signature = NULL;
     input->sigLen = 0;
     
@@ -85,7 +113,22 @@ void LWTxInputSetSignature(LWTxInput *input, const uint8_t *signature, size_t si
         input->sigLen = sigLen;
         array_new(input->signature, sigLen);
         array_add_array(input->signature, signature, sigLen);
-        if (! input->address[0]) LWAddressFromScriptSig(input->address, sizeof(input->address), signature, sigLen);
+        if (input->address.type == SCRIPT_HASH_NONE) LWScriptHashFromScriptSig(&input->address, signature, sigLen);
+    }
+}
+
+void LWTxInputSetWitness(LWTxInput *input, const uint8_t *witness, size_t witLen)
+{
+    assert(input != NULL);
+    assert(witness != NULL || witLen == 0);
+    _LWTxArrayFree(input->witness);
+    input->witness = NULL;
+    input->witLen = 0;
+    
+    if (witness) { // the whole stack is kept serialized in a single allocation
+        input->witLen = witLen;
+        array_new(input->witness, witLen);
+        array_add_array(input->witness, witness, witLen);
     }
 }
 
@@ -115,13 +158,13 @@ void LWTxOutputSetAddress(LWTxOutput *output, const char *address)
 {
     assert(output != NULL);
     assert(address == NULL || LWAddressIsValid(address));
-    if (output->script) array_free(output->script);
+    _LWTxArrayFree(output->script);
     output->script = NULL;
     output->scriptLen = 0;
-    memset(output->address, 0, sizeof(output->address));
+    output->address = LW_SCRIPT_HASH_NONE;
 
     if (address) {
-        strncpy(output->address, address, sizeof(output->address) - 1);
+        LWScriptHashFromAddress(&output->address, address);
         output->scriptLen = LWAddressScriptPubKey(NULL, 0, address);
         array_new(output->script, output->scriptLen);
         array_set_count(output->script, output->scriptLen);
@@ -132,16 +175,16 @@ void LWTxOutputSetAddress(LWTxOutput *output, const char *address)
 void LWTxOutputSetScript(LWTxOutput *output, const uint8_t *script, size_t scriptLen)
 {
     assert(output != NULL);
-    if (output->script) array_free(output->script);
+    _LWTxArrayFree(output->script);
     output->script = NULL;
     output->scriptLen = 0;
-    memset(output->address, 0, sizeof(output->address));
+    output->address = LW_SCRIPT_HASH_NONE;
 
     if (script) {
         output->scriptLen = scriptLen;
         array_new(output->script, scriptLen);
         array_add_array(output->script, script, scriptLen);
-        LWAddressFromScriptPubKey(output->address, sizeof(output->address), script, scriptLen);
+        LWScriptHashFromScriptPubKey(&output->address, script, scriptLen);
     }
 }
 
@@ -162,40 +205,85 @@ static size_t _LWTransactionOutputData(const LWTransaction *tx, uint8_t *data, s
     return (! data || off <= dataLen) ? off : 0;
 }
 
+// BIP143 hashPrevouts, double-sha256 of all input outpoints
+static UInt256 _LWTransactionPrevoutsHash(const LWTransaction *tx)
+{
+    uint8_t buf[(sizeof(UInt256) + sizeof(uint32_t))*tx->inCount + 1];
+    UInt256 md;
+    
+    for (size_t i = 0; i < tx->inCount; i++) {
+        UInt256Set(&buf[(sizeof(UInt256) + sizeof(uint32_t))*i], tx->inputs[i].txHash);
+        UInt32SetLE(&buf[(sizeof(UInt256) + sizeof(uint32_t))*i + sizeof(UInt256)], tx->inputs[i].index);
+    }
+    
+    LWSHA256_2(&md, buf, sizeof(buf) - 1);
+    return md;
+}
+
+// BIP143 hashSequence, double-sha256 of all input sequence numbers
+static UInt256 _LWTransactionSequenceHash(const LWTransaction *tx)
+{
+    uint8_t buf[sizeof(uint32_t)*tx->inCount + 1];
+    UInt256 md;
+    
+    for (size_t i = 0; i < tx->inCount; i++) UInt32SetLE(&buf[sizeof(uint32_t)*i], tx->inputs[i].sequence);
+    LWSHA256_2(&md, buf, sizeof(buf) - 1);
+    return md;
+}
+
+// BIP143 hashOutputs, double-sha256 of all serialized outputs
+static UInt256 _LWTransactionOutputsHash(const LWTransaction *tx)
+{
+    size_t bufLen = _LWTransactionOutputData(tx, NULL, 0, SIZE_MAX);
+    uint8_t _buf[(bufLen <= 0x1000) ? bufLen : 1], *buf = (bufLen <= 0x1000) ? _buf : malloc(bufLen);
+    UInt256 md;
+    
+    assert(buf != NULL);
+    bufLen = _LWTransactionOutputData(tx, buf, bufLen, SIZE_MAX);
+    LWSHA256_2(&md, buf, bufLen);
+    if (buf != _buf) free(buf);
+    return md;
+}
+
+// BIP143 digests that are the same in the signature preimage of every input of a tx
+typedef struct {
+    UInt256 prevouts, sequence, outputs;
+} LWWitnessHashes;
+
+// computes the BIP143 digests of tx, so each is only hashed once for all inputs signed
+static LWWitnessHashes _LWTransactionWitnessHashes(const LWTransaction *tx)
+{
+    return (LWWitnessHashes) { _LWTransactionPrevoutsHash(tx), _LWTransactionSequenceHash(tx),
+                               _LWTransactionOutputsHash(tx) };
+}
+
 // writes the BIP143 witness program data that needs to be hashed and signed for the tx input at index
 // https://github.com/bitcoin/bips/blob/master/bip-0143.mediawiki
+// hashes are the digests from _LWTransactionWitnessHashes(), or NULL to compute them for this input alone
 // an index of SIZE_MAX will write the entire signed transaction
 // returns number of bytes written, or total len needed if data is NULL
 static size_t _LWTransactionWitnessData(const LWTransaction *tx, uint8_t *data, size_t dataLen, size_t index,
-                                        int hashType)
+                                        int hashType, const LWWitnessHashes *hashes)
 {
     LWTxInput input;
     int anyoneCanPay = (hashType & SIGHASH_ANYONECANPAY), sigHash = (hashType & 0x1f);
-    size_t i, off = 0;
+    size_t off = 0;
     
     if (index >= tx->inCount) return 0;
     if (data && off + sizeof(uint32_t) <= dataLen) UInt32SetLE(&data[off], tx->version); // tx version
     off += sizeof(uint32_t);
     
-    if (! anyoneCanPay) {
-        uint8_t buf[(sizeof(UInt256) + sizeof(uint32_t))*tx->inCount];
-        
-        for (i = 0; i < tx->inCount; i++) {
-            UInt256Set(&buf[(sizeof(UInt256) + sizeof(uint32_t))*i], tx->inputs[i].txHash);
-            UInt32SetLE(&buf[(sizeof(UInt256) + sizeof(uint32_t))*i + sizeof(UInt256)], tx->inputs[i].index);
-        }
-        
-        if (data && off + sizeof(UInt256) <= dataLen) LWSHA256_2(&data[off], buf, sizeof(buf)); // inputs hash
+    if (! anyoneCanPay && data && off + sizeof(UInt256) <= dataLen) { // inputs hash
+        UInt256Set(&data[off], (hashes) ? hashes->prevouts : _LWTransactionPrevoutsHash(tx));
     }
     else if (data && off + sizeof(UInt256) <= dataLen) UInt256Set(&data[off], UINT256_ZERO); // anyone-can-pay
     
     off += sizeof(UInt256);
     
     if (! anyoneCanPay && sigHash != SIGHASH_SINGLE && sigHash != SIGHASH_NONE) {
-        uint8_t buf[sizeof(uint32_t)*tx->inCount];
-        
-        for (i = 0; i < tx->inCount; i++) UInt32SetLE(&buf[sizeof(uint32_t)*i], tx->inputs[i].sequence);
-        if (data && off + sizeof(UInt256) <= dataLen) LWSHA256_2(&data[off], buf, sizeof(buf)); // sequence hash
+        if (data && off + sizeof(UInt256) <= dataLen) { // sequence hash
+            UInt256Set(&data[off], (hashes) ? hashes->sequence : _LWTransactionSequenceHash(tx));
+        }
     }
     else if (data && off + sizeof(UInt256) <= dataLen) UInt256Set(&data[off], UINT256_ZERO);
     
@@ -206,12 +294,9 @@ static size_t _LWTransactionWitnessData(const LWTransaction *tx, uint8_t *data,
     off += _LWTxInputData(&input, (data ? &data[off] : NULL), (off <= dataLen ? dataLen - off : 0));
     
     if (sigHash != SIGHASH_SINGLE && sigHash != SIGHASH_NONE) {
-        size_t bufLen = _LWTransactionOutputData(tx, NULL, 0, SIZE_MAX);
-        uint8_t _buf[(bufLen <= 0x1000) ? bufLen : 0], *buf = (bufLen <= 0x1000) ? _buf : malloc(bufLen);
-        
-        bufLen = _LWTransactionOutputData(tx, buf, bufLen, SIZE_MAX);
-        if (data && off + sizeof(UInt256) <= dataLen) LWSHA256_2(&data[off], buf, bufLen); // SIGHASH_ALL outputs hash
-        if (buf != _buf) free(buf);
+        if (data && off + sizeof(UInt256) <= dataLen) { // SIGHASH_ALL outputs hash
+            UInt256Set(&data[off], (hashes) ? hashes->outputs : _LWTransactionOutputsHash(tx));
+        }
     }
     else if (sigHash == SIGHASH_SINGLE && index < tx->outCount) {
         uint8_t buf[_LWTransactionOutputData(tx, NULL, 0, index)];
@@ -229,20 +314,37 @@ static size_t _LWTransactionWitnessData(const LWTransaction *tx, uint8_t *data,
     return (! data || off <= dataLen) ? off : 0;
 }
 
+// true if any input of tx has a witness
+static int _LWTransactionHasWitness(const LWTransaction *tx)
+{
+    for (size_t i = 0; i < tx->inCount; i++) {
+        if (tx->inputs[i].witness) return 1;
+    }
+    
+    return 0;
+}
+
 // writes the data that needs to be hashed and signed for the tx input at index
-// an index of SIZE_MAX will write the entire signed transaction
+// an index of SIZE_MAX will write the entire signed transaction, in the BIP144 witness format if any input has a
+// witness, unless hashType is 0, which leaves out witness data to give the serialization txHash is computed from
 // returns number of bytes written, or total dataLen needed if data is NULL
 static size_t _LWTransactionData(const LWTransaction *tx, uint8_t *data, size_t dataLen, size_t index, int hashType)
 {
     LWTxInput input;
-    int anyoneCanPay = (hashType & SIGHASH_ANYONECANPAY), sigHash = (hashType & 0x1f);
+    int anyoneCanPay = (hashType & SIGHASH_ANYONECANPAY), sigHash = (hashType & 0x1f),
+        witnessFlag = (index == SIZE_MAX && hashType != 0 && _LWTransactionHasWitness(tx));
     size_t i, off = 0;
     
-    if (hashType & SIGHASH_FORKID) return _LWTransactionWitnessData(tx, data, dataLen, index, hashType);
+    if (hashType & SIGHASH_FORKID) return _LWTransactionWitnessData(tx, data, dataLen, index, hashType, NULL);
     if (anyoneCanPay && index >= tx->inCount) return 0;
     if (data && off + sizeof(uint32_t) <= dataLen) UInt32SetLE(&data[off], tx->version); // tx version
     off += sizeof(uint32_t);
     
+    if (witnessFlag) { // BIP144 marker and flag
+        if (data && off + 2 <= dataLen) data[off] = 0x00, data[off + 1] = 0x01;
+        off += 2;
+    }
+    
     if (! anyoneCanPay) {
         off += LWVarIntSet((data ? &data[off] : NULL), (off <= dataLen ? dataLen - off : 0), tx->inCount);
         
@@ -290,6 +392,16 @@ static size_t _LWTransactionData(const LWTransaction *tx, uint8_t *data, size_t
     }
     else off += LWVarIntSet((data ? &data[off] : NULL), (off <= dataLen ? dataLen - off : 0), 0); //SIGHASH_NONE outputs
     
+    for (i = 0; witnessFlag && i < tx->inCount; i++) { // witnesses, an empty stack for inputs without one
+        input = tx->inputs[i];
+        
+        if (input.witness) {
+            if (data && off + input.witLen <= dataLen) memcpy(&data[off], input.witness, input.witLen);
+            off += input.witLen;
+        }
+        else off += LWVarIntSet((data ? &data[off] : NULL), (off <= dataLen ? dataLen - off : 0), 0);
+    }
+    
     if (data && off + sizeof(uint32_t) <= dataLen) UInt32SetLE(&data[off], tx->lockTime); // locktime
     off += sizeof(uint32_t);
     
@@ -301,6 +413,35 @@ static size_t _LWTransactionData(const LWTransaction *tx, uint8_t *data, size_t
     return (! data || off <= dataLen) ? off : 0;
 }
 
+// size of input in bytes if signed, or estimated size assuming a compact pubkey sig
+inline static size_t _LWTxInputSize(const LWTxInput *input)
+{
+    if (! input->signature) return TX_INPUT_SIZE;
+    return sizeof(UInt256) + sizeof(uint32_t) + LWVarIntSize(input->sigLen) + input->sigLen + sizeof(uint32_t);
+}
+
+inline static size_t _LWTxOutputSize(const LWTxOutput *output)
+{
+    return sizeof(uint64_t) + LWVarIntSize(output->scriptLen) + output->scriptLen;
+}
+
+// adds up the size and weight of tx from scratch, for when the running totals can't be kept
+static void _LWTransactionSetSize(LWTransaction *tx)
+{
+    size_t size = 8 + LWVarIntSize(tx->inCount) + LWVarIntSize(tx->outCount), witSize = 0;
+    
+    for (size_t i = 0; i < tx->inCount; i++) size += _LWTxInputSize(&tx->inputs[i]);
+    for (size_t i = 0; i < tx->outCount; i++) size += _LWTxOutputSize(&tx->outputs[i]);
+    if (_LWTransactionHasWitness(tx)) witSize = 2; // marker and flag
+
+    for (size_t i = 0; witSize > 0 && i < tx->inCount; i++) { // witness stacks, an empty stack for inputs without one
+        witSize += (tx->inputs[i].witness) ? tx->inputs[i].witLen : 1;
+    }
+
+    tx->size = size + witSize;
+    tx->weight = size*4 + witSize;
+}
+
 // returns a newly allocated empty transaction that must be freed by calling LWTransactionFree()
 LWTransaction *LWTransactionNew(void)
 {
@@ -310,34 +451,75 @@ LWTransaction *LWTransactionNew(void)
     tx->version = TX_VERSION;
     array_new(tx->inputs, 1);
     array_new(tx->outputs, 2);
+    _LWTransactionSetSize(tx);
     tx->lockTime = TX_LOCKTIME;
     tx->blockHeight = TX_UNCONFIRMED;
     return tx;
 }
 
+// moves any packed inputs and outputs arrays of tx to their own allocations, so they can grow
+// scripts, signatures and witnesses stay where they are, and are freed along with tx
+static void _LWTransactionUnpack(LWTransaction *tx)
+{
+    LWTxInput *inputs = tx->inputs;
+    LWTxOutput *outputs = tx->outputs;
+    
+    if (array_capacity(inputs) == TX_PACKED) {
+        array_new(tx->inputs, tx->inCount + 1);
+        memcpy(tx->inputs, inputs, tx->inCount*sizeof(*inputs));
+        array_count(tx->inputs) = tx->inCount;
+    }
+    
+    if (array_capacity(outputs) == TX_PACKED) {
+        array_new(tx->outputs, tx->outCount + 2);
+        memcpy(tx->outputs, outputs, tx->outCount*sizeof(*outputs));
+        array_count(tx->outputs) = tx->outCount;
+    }
+}
+
 // returns a deep copy of tx and that must be freed by calling LWTransactionFree()
+// the copy is packed into a single allocation, with its inputs and outputs followed by all their scripts, signatures
+// and witnesses, which are copied as is along with the input and output addresses instead of being parsed again
 LWTransaction *LWTransactionCopy(const LWTransaction *tx)
 {
-    LWTransaction *cpy = LWTransactionNew();
-    LWTxInput *inputs = cpy->inputs;
-    LWTxOutput *outputs = cpy->outputs;
+    LWTransaction *cpy;
+    uint8_t *block;
+    size_t i, off = sizeof(*tx), len = off;
     
     assert(tx != NULL);
+    len += _LWTxPackedLen(tx->inCount*sizeof(*tx->inputs)) + _LWTxPackedLen(tx->outCount*sizeof(*tx->outputs));
+    
+    for (i = 0; i < tx->inCount; i++) {
+        if (tx->inputs[i].script) len += _LWTxPackedLen(tx->inputs[i].scriptLen);
+        if (tx->inputs[i].signature) len += _LWTxPackedLen(tx->inputs[i].sigLen);
+        if (tx->inputs[i].witness) len += _LWTxPackedLen(tx->inputs[i].witLen);
+    }
+    
+    for (i = 0; i < tx->outCount; i++) {
+        if (tx->outputs[i].script) len += _LWTxPackedLen(tx->outputs[i].scriptLen);
+    }
+    
+    block = malloc(len);
+    assert(block != NULL);
+    cpy = (LWTransaction *)block;
     *cpy = *tx;
-    cpy->inputs = inputs;
-    cpy->outputs = outputs;
-    cpy->inCount = cpy->outCount = 0;
-
-    for (size_t i = 0; i < tx->inCount; i++) {
-        LWTransactionAddInput(cpy, tx->inputs[i].txHash, tx->inputs[i].index, tx->inputs[i].amount,
-                              tx->inputs[i].script, tx->inputs[i].scriptLen,
-                              tx->inputs[i].signature, tx->inputs[i].sigLen, tx->inputs[i].sequence);
+    cpy->inputs = _LWTxPack(block, &off, tx->inputs, tx->inCount, sizeof(*tx->inputs));
+    cpy->outputs = _LWTxPack(block, &off, tx->outputs, tx->outCount, sizeof(*tx->outputs));
+    
+    for (i = 0; i < tx->inCount; i++) { // point the copied inputs at their own copies of each script
+        LWTxInput *input = &cpy->inputs[i];
+        
+        if (input->script) input->script = _LWTxPack(block, &off, input->script, input->scriptLen, 1);
+        if (input->signature) input->signature = _LWTxPack(block, &off, input->signature, input->sigLen, 1);
+        if (input->witness) input->witness = _LWTxPack(block, &off, input->witness, input->witLen, 1);
     }
     
-    for (size_t i = 0; i < tx->outCount; i++) {
-        LWTransactionAddOutput(cpy, tx->outputs[i].amount, tx->outputs[i].script, tx->outputs[i].scriptLen);
+    for (i = 0; i < tx->outCount; i++) {
+        LWTxOutput *output = &cpy->outputs[i];
+        
+        if (output->script) output->script = _LWTxPack(block, &off, output->script, output->scriptLen, 1);
     }
-
+    
     return cpy;
 }
 
@@ -345,70 +527,84 @@ LWTransaction *LWTransactionCopy(const LWTransaction *tx)
 // retruns a transaction that must be freed by calling LWTransactionFree()
 LWTransaction *LWTransactionParse(const uint8_t *buf, size_t bufLen)
 {
+    LWTransactionView view;
+    
     assert(buf != NULL || bufLen == 0);
-    if (! buf) return NULL;
+    return (buf && LWTransactionViewParse(&view, buf, bufLen)) ? LWTransactionViewTransaction(&view) : NULL;
+}
+
+#define TX_PARSE_BATCH_MIN 64 // minimum number of txs to parse per worker thread
+#define TX_PARSE_THREADS   8
+
+typedef struct {
+    LWTransaction **txs;
+    const uint8_t *buf;
+    const size_t *offs, *lens; // offset and length in buf of each tx in the batch
+    size_t count;
+} LWParseBatch;
+
+// parses a batch of txs, each is hashed and has its addresses derived on the worker thread
+static void *_LWTransactionParseBatch(void *info)
+{
+    LWParseBatch *batch = info;
     
-    int isSigned = 1;
-    size_t i, off = 0, sLen = 0, len = 0;
-    LWTransaction *tx = LWTransactionNew();
-    LWTxInput *input;
-    LWTxOutput *output;
+    for (size_t i = 0; i < batch->count; i++) {
+        batch->txs[i] = LWTransactionParse(&batch->buf[batch->offs[i]], batch->lens[i]);
+    }
     
-    tx->version = (off + sizeof(uint32_t) <= bufLen) ? UInt32GetLE(&buf[off]) : 0;
-    off += sizeof(uint32_t);
-    tx->inCount = (size_t)LWVarInt(&buf[off], (off <= bufLen ? bufLen - off : 0), &len);
-    off += len;
-    array_set_count(tx->inputs, tx->inCount);
+    return NULL;
+}
+
+// buf must contain a sequence of serialized txs, each prefixed with its length as a varint, such as for wallet load
+// txs are parsed across worker threads and written to txs in order, with NULL for any that are malformed
+// returns the number of txs in buf, or txsCount needed if txs is NULL, each tx must be freed with LWTransactionFree()
+// returns 0 and leaves txs unset if buf ends with a truncated tx or length prefix
+size_t LWTransactionParseMany(LWTransaction *txs[], size_t txsCount, const uint8_t *buf, size_t bufLen)
+{
+    size_t i, off = 0, len = 0, txLen, count = 0, n, threadCount, *offs = NULL, *lens = NULL;
     
-    for (i = 0; off <= bufLen && i < tx->inCount; i++) {
-        input = &tx->inputs[i];
-        input->txHash = (off + sizeof(UInt256) <= bufLen) ? UInt256Get(&buf[off]) : UINT256_ZERO;
-        off += sizeof(UInt256);
-        input->index = (off + sizeof(uint32_t) <= bufLen) ? UInt32GetLE(&buf[off]) : 0;
-        off += sizeof(uint32_t);
-        sLen = (size_t)LWVarInt(&buf[off], (off <= bufLen ? bufLen - off : 0), &len);
-        off += len;
+    assert(txs != NULL || txsCount == 0);
+    assert(buf != NULL || bufLen == 0);
+    
+    while (buf && off < bufLen) { // only the length prefixes are read up front, to find where each tx starts
+        txLen = (size_t)LWVarInt(&buf[off], bufLen - off, &len);
+        if (len > bufLen - off || txLen > bufLen - off - len) break; // truncated, nothing is parsed
         
-        if (off + sLen <= bufLen && LWAddressFromScriptPubKey(NULL, 0, &buf[off], sLen) > 0) {
-            LWTxInputSetScript(input, &buf[off], sLen);
-            input->amount = (off + sLen + sizeof(uint64_t) <= bufLen) ? UInt64GetLE(&buf[off + sLen]) : 0;
-            off += sizeof(uint64_t);
-            isSigned = 0;
+        if (txs && count < txsCount) {
+            if (! offs) {
+                array_new(offs, 64);
+                array_new(lens, 64);
+            }
+            
+            array_add(offs, off + len);
+            array_add(lens, txLen);
         }
-        else if (off + sLen <= bufLen) LWTxInputSetSignature(input, &buf[off], sLen);
         
-        off += sLen;
-        input->sequence = (off + sizeof(uint32_t) <= bufLen) ? UInt32GetLE(&buf[off]) : 0;
-        off += sizeof(uint32_t);
+        off += len + txLen;
+        count++;
     }
     
-    tx->outCount = (size_t)LWVarInt(&buf[off], (off <= bufLen ? bufLen - off : 0), &len);
-    off += len;
-    array_set_count(tx->outputs, tx->outCount);
+    if (off < bufLen) count = 0;
+    n = (offs && count > 0) ? array_count(offs) : 0;
+    threadCount = LWThreadCount(n, TX_PARSE_BATCH_MIN, TX_PARSE_THREADS);
     
-    for (i = 0; off <= bufLen && i < tx->outCount; i++) {
-        output = &tx->outputs[i];
-        output->amount = (off + sizeof(uint64_t) <= bufLen) ? UInt64GetLE(&buf[off]) : 0;
-        off += sizeof(uint64_t);
-        sLen = (size_t)LWVarInt(&buf[off], (off <= bufLen ? bufLen - off : 0), &len);
-        off += len;
-        if (off + sLen <= bufLen) LWTxOutputSetScript(output, &buf[off], sLen);
-        off += sLen;
-    }
-    
-    tx->lockTime = (off + sizeof(uint32_t) <= bufLen) ? UInt32GetLE(&buf[off]) : 0;
-    off += sizeof(uint32_t);
+    LWParseBatch batches[threadCount];
     
-    if (tx->inCount == 0 || off > bufLen) {
-        LWTransactionFree(tx);
-        tx = NULL;
+    for (i = 0, off = 0; n > 0 && i < threadCount; i++) { // parse txs across worker threads
+        len = n/threadCount + (i < n % threadCount ? 1 : 0);
+        batches[i] = (LWParseBatch) { &txs[off], buf, &offs[off], &lens[off], len };
+        off += batches[i].count;
     }
-    else if (isSigned) LWSHA256_2(&tx->txHash, buf, off);
     
-    return tx;
+    if (n > 0) LWThreadRunBatches(_LWTransactionParseBatch, batches, sizeof(*batches), threadCount);
+    
+    if (offs) array_free(offs);
+    if (lens) array_free(lens);
+    return count;
 }
 
 // returns number of bytes written to buf, or total bufLen needed if buf is NULL
+// tx is written in the BIP144 witness format if any input has a witness
 // (tx->blockHeight and tx->timestamp are not serialized)
 size_t LWTransactionSerialize(const LWTransaction *tx, uint8_t *buf, size_t bufLen)
 {
@@ -421,7 +617,8 @@ void LWTransactionAddInput(LWTransaction *tx, UInt256 txHash, uint32_t index, ui
                            const uint8_t *script, size_t scriptLen, const uint8_t *signature, size_t sigLen,
                            uint32_t sequence)
 {
-    LWTxInput input = { txHash, index, "", amount, NULL, 0, NULL, 0, sequence };
+    LWTxInput input = { txHash, index, LW_SCRIPT_HASH_NONE, amount, NULL, 0, NULL, 0, NULL, 0, sequence };
+    size_t size, witSize;
 
     assert(tx != NULL);
     assert(! UInt256IsZero(txHash));
@@ -431,23 +628,33 @@ void LWTransactionAddInput(LWTransaction *tx, UInt256 txHash, uint32_t index, ui
     if (tx) {
         if (script) LWTxInputSetScript(&input, script, scriptLen);
         if (signature) LWTxInputSetSignature(&input, signature, sigLen);
+        _LWTransactionUnpack(tx);
         array_add(tx->inputs, input);
         tx->inCount = array_count(tx->inputs);
+        size = _LWTxInputSize(&input) + LWVarIntSize(tx->inCount) - LWVarIntSize(tx->inCount - 1);
+        witSize = (tx->weight < tx->size*4) ? 1 : 0; // an empty witness stack, if tx has witness data
+        tx->size += size + witSize;
+        tx->weight += size*4 + witSize;
     }
 }
 
 // adds an output to tx
 void LWTransactionAddOutput(LWTransaction *tx, uint64_t amount, const uint8_t *script, size_t scriptLen)
 {
-    LWTxOutput output = { "", amount, NULL, 0 };
+    LWTxOutput output = { LW_SCRIPT_HASH_NONE, amount, NULL, 0 };
+    size_t size;
     
     assert(tx != NULL);
     assert(script != NULL || scriptLen == 0);
     
     if (tx) {
         LWTxOutputSetScript(&output, script, scriptLen);
+        _LWTransactionUnpack(tx);
         array_add(tx->outputs, output);
         tx->outCount = array_count(tx->outputs);
+        size = _LWTxOutputSize(&output) + LWVarIntSize(tx->outCount) - LWVarIntSize(tx->outCount - 1);
+        tx->size += size;
+        tx->weight += size*4;
     }
 }
 
@@ -468,36 +675,26 @@ void LWTransactionShuffleOutputs(LWTransaction *tx)
     }
 }
 
-// size in bytes if signed, or estimated size assuming compact pubkey sigs
+// size in bytes if signed, or estimated size assuming compact pubkey sigs, including any witness data
+// inputs and outputs must be changed with the LWTransaction functions to keep the size current
 size_t LWTransactionSize(const LWTransaction *tx)
 {
-    LWTxInput *input;
-    size_t size;
+    assert(tx != NULL);
+    return (tx) ? tx->size : 0;
+}
 
+// BIP141 virtual size, the weight divided by 4 and rounded up, same as LWTransactionSize() without witness data
+size_t LWTransactionVSize(const LWTransaction *tx)
+{
     assert(tx != NULL);
-    size = (tx) ? 8 + LWVarIntSize(tx->inCount) + LWVarIntSize(tx->outCount) : 0;
-    
-    for (size_t i = 0; tx && i < tx->inCount; i++) {
-        input = &tx->inputs[i];
-        
-        if (input->signature) {
-            size += sizeof(UInt256) + sizeof(uint32_t) + LWVarIntSize(input->sigLen) + input->sigLen + sizeof(uint32_t);
-        }
-        else size += TX_INPUT_SIZE;
-    }
-    
-    for (size_t i = 0; tx && i < tx->outCount; i++) {
-        size += sizeof(uint64_t) + LWVarIntSize(tx->outputs[i].scriptLen) + tx->outputs[i].scriptLen;
-    }
-    
-    return size;
+    return (tx) ? (tx->weight + 3)/4 : 0;
 }
 
 // minimum transaction fee needed for tx to relay across the bitcoin network
 uint64_t LWTransactionStandardFee(const LWTransaction *tx)
 {
     assert(tx != NULL);
-    return ((LWTransactionSize(tx) + 999)/1000)*TX_FEE_PER_KB;
+    return ((LWTransactionVSize(tx) + 999)/1000)*TX_FEE_PER_KB;
 }
 
 // checks if all signatures exist, but does not verify them
@@ -512,68 +709,388 @@ int LWTransactionIsSigned(const LWTransaction *tx)
     return (tx) ? 1 : 0;
 }
 
+#define TX_SIGN_BATCH_MIN 16 // minimum number of inputs to sign per worker thread
+#define TX_SIGN_THREADS   8
+
+// serializes tx once with all input scripts empty, each legacy SIGHASH_ALL preimage is this with one script spliced in
+// writes the offset of each input's empty script to inOff, and returns the number of bytes written to data
+static size_t _LWTransactionEmptyScriptsData(const LWTransaction *tx, uint8_t *data, size_t dataLen, size_t inOff[])
+{
+    size_t off = 0;
+    
+    UInt32SetLE(&data[off], tx->version);
+    off += sizeof(uint32_t);
+    off += LWVarIntSet(&data[off], dataLen - off, tx->inCount);
+    
+    for (size_t i = 0; i < tx->inCount; i++) {
+        LWTxInput input = tx->inputs[i];
+        
+        input.sigLen = 0;
+        input.amount = 0;
+        inOff[i] = off + sizeof(UInt256) + sizeof(uint32_t);
+        off += _LWTxInputData(&input, &data[off], dataLen - off);
+    }
+    
+    off += LWVarIntSet(&data[off], dataLen - off, tx->outCount);
+    off += _LWTransactionOutputData(tx, &data[off], dataLen - off, SIZE_MAX);
+    UInt32SetLE(&data[off], tx->lockTime);
+    return off + sizeof(uint32_t);
+}
+
+// writes to buf the legacy preimage for the input whose empty script is at inOff in data, with script spliced in and
+// hashType appended, buf must have room for dataLen + LWVarIntSize(scriptLen) - 1 + scriptLen + sizeof(uint32_t)
+static size_t _LWTransactionSpliceData(uint8_t *buf, const uint8_t *data, size_t dataLen, size_t inOff,
+                                       const uint8_t *script, size_t scriptLen, int hashType)
+{
+    size_t i = inOff;
+    
+    memcpy(buf, data, i);
+    i += LWVarIntSet(&buf[i], LWVarIntSize(scriptLen), scriptLen);
+    memcpy(&buf[i], script, scriptLen);
+    i += scriptLen;
+    memcpy(&buf[i], &data[inOff + 1], dataLen - (inOff + 1));
+    i += dataLen - (inOff + 1);
+    UInt32SetLE(&buf[i], (uint32_t)hashType);
+    return i + sizeof(uint32_t);
+}
+
+typedef struct {
+    UInt160 hash; // hash160 of pubKey, for looking up the key that an input script pays to
+    const LWKey *key;
+    uint8_t pubKey[65];
+    size_t pkLen;
+} LWSignKey;
+
+inline static size_t _LWSignKeyHash(const void *key)
+{
+    return (size_t)((const LWSignKey *)key)->hash.u32[0];
+}
+
+inline static int _LWSignKeyEq(const void *key, const void *otherKey)
+{
+    return UInt160Eq(((const LWSignKey *)key)->hash, ((const LWSignKey *)otherKey)->hash);
+}
+
+typedef struct {
+    const LWTransaction *tx;
+    int hashType;
+    const LWWitnessHashes *witnessHashes; // BIP143 digests shared by all SIGHASH_FORKID preimages
+    const uint8_t *data; // tx serialized with empty input scripts, shared by all legacy SIGHASH_ALL preimages
+    size_t dataLen;
+    const size_t *inOff; // offset in data of the empty script of each input
+    const size_t *indexes; // inputs to sign
+    const LWSignKey **keys; // key for each input in indexes
+    const int *pkh; // true for each pay-to-pubkey-hash input in indexes, the rest are pay-to-pubkey
+    uint8_t (*scripts)[1 + 73 + 1 + 65]; // resulting scriptSig for each input in indexes
+    size_t *scriptLens, count;
+} LWSignBatch;
+
+// signs a batch of inputs, writing the resulting scriptSigs to batch->scripts
+static void *_LWTransactionSignBatch(void *info)
+{
+    LWSignBatch *batch = info;
+    const LWTransaction *tx = batch->tx;
+    size_t j, dataLen, bufLen = 0, scriptLen;
+    uint8_t *buf = NULL, sig[73];
+    UInt256 md;
+
+    for (j = 0; j < batch->count; j++) {
+        const LWTxInput *input = &tx->inputs[batch->indexes[j]];
+        const LWSignKey *key = batch->keys[j];
+        size_t sigLen;
+
+        if (batch->hashType & SIGHASH_FORKID) {
+            dataLen = _LWTransactionWitnessData(tx, NULL, 0, batch->indexes[j], batch->hashType, batch->witnessHashes);
+        }
+        else dataLen = batch->dataLen + LWVarIntSize(input->scriptLen) - 1 + input->scriptLen + sizeof(uint32_t);
+
+        if (dataLen > bufLen) buf = realloc(buf, (bufLen = dataLen));
+        assert(buf != NULL);
+
+        if (batch->hashType & SIGHASH_FORKID) {
+            dataLen = _LWTransactionWitnessData(tx, buf, bufLen, batch->indexes[j], batch->hashType,
+                                                batch->witnessHashes);
+        }
+        else { // splice the input's script into the shared serialization, and append the hash type
+            _LWTransactionSpliceData(buf, batch->data, batch->dataLen, batch->inOff[batch->indexes[j]], input->script,
+                                     input->scriptLen, batch->hashType);
+        }
+
+        LWSHA256_2(&md, buf, dataLen);
+        sigLen = LWKeySign(key->key, sig, sizeof(sig) - 1, md);
+        sig[sigLen++] = (uint8_t)batch->hashType;
+        scriptLen = LWScriptPushData(batch->scripts[j], sizeof(batch->scripts[j]), sig, sigLen);
+
+        if (batch->pkh[j]) { // pay-to-pubkey-hash
+            scriptLen += LWScriptPushData(&batch->scripts[j][scriptLen], sizeof(batch->scripts[j]) - scriptLen,
+                                          key->pubKey, key->pkLen);
+        }
+
+        batch->scriptLens[j] = scriptLen;
+    }
+
+    if (buf) free(buf);
+    return NULL;
+}
+
 // adds signatures to any inputs with NULL signatures that can be signed with any keys
 // forkId is 0 for bitcoin, 0x40 for b-cash, 0x4f for b-gold
 // returns true if tx is signed
 int LWTransactionSign(LWTransaction *tx, int forkId, LWKey keys[], size_t keysCount)
 {
-    LWAddress addrs[keysCount], address;
-    size_t i, j;
-    
+    LWSignKey signKeys[keysCount], *k;
+    LWSet *keySet = LWSetNew(_LWSignKeyHash, _LWSignKeyEq, keysCount);
+    size_t i, j, count = 0, threadCount, off = 0, len;
+    int hashType = forkId | SIGHASH_ALL, r = 0;
+
     assert(tx != NULL);
     assert(keys != NULL || keysCount == 0);
-    
+
     for (i = 0; tx && i < keysCount; i++) {
-        if (! LWKeyAddress(&keys[i], addrs[i].s, sizeof(addrs[i]))) addrs[i] = LW_ADDRESS_NONE;
+        signKeys[i].key = &keys[i];
+        signKeys[i].hash = LWKeyHash160(&keys[i]);
+        signKeys[i].pkLen = LWKeyPubKey(&keys[i], signKeys[i].pubKey, sizeof(signKeys[i].pubKey));
+        if (! UInt160IsZero(signKeys[i].hash) && ! LWSetContains(keySet, &signKeys[i])) LWSetAdd(keySet, &signKeys[i]);
     }
-    
-    for (i = 0; tx && i < tx->inCount; i++) {
-        LWTxInput *input = &tx->inputs[i];
-        
-        if (! LWAddressFromScriptPubKey(address.s, sizeof(address), input->script, input->scriptLen)) continue;
-        j = 0;
-        while (j < keysCount && ! LWAddressEq(&addrs[j], &address)) j++;
-        if (j >= keysCount) continue;
-        
-        const uint8_t *elems[LWScriptElements(NULL, 0, input->script, input->scriptLen)];
+
+    size_t inCount = (tx) ? tx->inCount : 0, indexes[inCount + 1], inOff[inCount + 1], scriptLens[inCount + 1];
+    const LWSignKey *inKeys[inCount + 1];
+    int pkh[inCount + 1];
+
+    for (i = 0; i < inCount; i++) { // match inputs to keys by the hash160 their scripts pay to
+        const LWTxInput *input = &tx->inputs[i];
+        const uint8_t *elems[LWScriptElements(NULL, 0, input->script, input->scriptLen)], *d;
         size_t elemsCount = LWScriptElements(elems, sizeof(elems)/sizeof(*elems), input->script, input->scriptLen);
-        uint8_t pubKey[LWKeyPubKey(&keys[j], NULL, 0)];
-        size_t pkLen = LWKeyPubKey(&keys[j], pubKey, sizeof(pubKey));
-        uint8_t sig[73], script[1 + sizeof(sig) + 1 + sizeof(pubKey)];
-        size_t sigLen, scriptLen;
-        UInt256 md = UINT256_ZERO;
-        
-        if (elemsCount >= 2 && *elems[elemsCount - 2] == OP_EQUALVERIFY) { // pay-to-pubkey-hash
-            uint8_t data[_LWTransactionData(tx, NULL, 0, i, forkId | SIGHASH_ALL)];
-            size_t dataLen = _LWTransactionData(tx, data, sizeof(data), i, forkId | SIGHASH_ALL);
-            
-            LWSHA256_2(&md, data, dataLen);
-            sigLen = LWKeySign(&keys[j], sig, sizeof(sig) - 1, md);
-            sig[sigLen++] = forkId | SIGHASH_ALL;
-            scriptLen = LWScriptPushData(script, sizeof(script), sig, sigLen);
-            scriptLen += LWScriptPushData(&script[scriptLen], sizeof(script) - scriptLen, pubKey, pkLen);
-            LWTxInputSetSignature(input, script, scriptLen);
+        LWSignKey key;
+
+        if (elemsCount == 5 && *elems[0] == OP_DUP && *elems[1] == OP_HASH160 && *elems[2] == 20 &&
+            *elems[3] == OP_EQUALVERIFY && *elems[4] == OP_CHECKSIG) { // pay-to-pubkey-hash
+            key.hash = UInt160Get(LWScriptData(elems[2], &len));
+            pkh[count] = 1;
         }
-        else { // pay-to-pubkey
-            uint8_t data[_LWTransactionData(tx, NULL, 0, i, forkId | SIGHASH_ALL)];
-            size_t dataLen = _LWTransactionData(tx, data, sizeof(data), i, forkId | SIGHASH_ALL);
-            
-            LWSHA256_2(&md, data, dataLen);
-            sigLen = LWKeySign(&keys[j], sig, sizeof(sig) - 1, md);
-            sig[sigLen++] = forkId | SIGHASH_ALL;
-            scriptLen = LWScriptPushData(script, sizeof(script), sig, sigLen);
-            LWTxInputSetSignature(input, script, scriptLen);
+        else if (elemsCount == 2 && (*elems[0] == 65 || *elems[0] == 33) && *elems[1] == OP_CHECKSIG) { // pay-to-pubkey
+            d = LWScriptData(elems[0], &len);
+            LWHash160(&key.hash, d, len);
+            pkh[count] = 0;
         }
+        else continue;
+
+        k = LWSetGet(keySet, &key);
+        if (! k) continue;
+        inKeys[count] = k;
+        indexes[count++] = i;
     }
-    
+
+    LWSetFree(keySet);
+
+    // compute the BIP143 digests once, before any worker threads, for all inputs to share
+    LWWitnessHashes witnessHashes = (count > 0 && (hashType & SIGHASH_FORKID)) ? _LWTransactionWitnessHashes(tx) :
+                                    (LWWitnessHashes) { UINT256_ZERO, UINT256_ZERO, UINT256_ZERO };
+
+    // serialize tx once with all input scripts empty, each legacy preimage is this with one script spliced in
+    size_t dataLen = (count > 0 && ! (hashType & SIGHASH_FORKID)) ? _LWTransactionData(tx, NULL, 0, SIZE_MAX, 0) : 0;
+    uint8_t *data = (dataLen > 0) ? malloc(dataLen) : NULL;
+
+    if (data) dataLen = _LWTransactionEmptyScriptsData(tx, data, dataLen, inOff);
+
+    uint8_t (*scripts)[1 + 73 + 1 + 65] = (count > 0) ? malloc(count*sizeof(*scripts)) : NULL;
+    LWSignBatch batches[TX_SIGN_THREADS];
+
+    assert(scripts != NULL || count == 0);
+    threadCount = LWThreadCount(count, TX_SIGN_BATCH_MIN, TX_SIGN_THREADS);
+
+    for (i = 0, off = 0; i < threadCount; i++) { // sign inputs across worker threads
+        len = count/threadCount + (i < count % threadCount ? 1 : 0);
+        batches[i] = (LWSignBatch) { tx, hashType, &witnessHashes, data, dataLen, inOff, &indexes[off], &inKeys[off],
+                                     &pkh[off], &scripts[off], &scriptLens[off], len };
+        off += batches[i].count;
+    }
+
+    LWThreadRunBatches(_LWTransactionSignBatch, batches, sizeof(*batches), threadCount);
+
+    for (j = 0; j < count; j++) LWTxInputSetSignature(&tx->inputs[indexes[j]], scripts[j], scriptLens[j]);
+
+    // recompute the size from scratch, since signatures or witnesses may have been set directly on inputs before
+    if (tx) _LWTransactionSetSize(tx);
+
+    if (scripts) free(scripts);
+    if (data) free(data);
+    mem_clean(signKeys, sizeof(signKeys));
+
     if (tx && LWTransactionIsSigned(tx)) {
-        uint8_t data[_LWTransactionData(tx, NULL, 0, SIZE_MAX, 0)];
-        size_t len = _LWTransactionData(tx, data, sizeof(data), SIZE_MAX, 0);
+        uint8_t _data[_LWTransactionData(tx, NULL, 0, SIZE_MAX, 0)];
+        size_t len = _LWTransactionData(tx, _data, sizeof(_data), SIZE_MAX, 0);
+        
+        LWSHA256_2(&tx->txHash, _data, len);
+        tx->wtxHash = tx->txHash;
+        
+        if (_LWTransactionHasWitness(tx)) {
+            uint8_t wData[_LWTransactionData(tx, NULL, 0, SIZE_MAX, SIGHASH_ALL)];
+            
+            len = _LWTransactionData(tx, wData, sizeof(wData), SIZE_MAX, SIGHASH_ALL);
+            LWSHA256_2(&tx->wtxHash, wData, len);
+        }
         
-        LWSHA256_2(&tx->txHash, data, len);
-        return 1;
+        r = 1;
     }
-    else return 0;
+
+    return r;
+}
+
+#define TX_VERIFY_BATCH_MIN 16 // minimum number of inputs to verify per worker thread
+#define TX_VERIFY_THREADS   8
+
+typedef struct {
+    size_t index;
+    const uint8_t *sig, *pubKey;
+    size_t sigLen, pkLen;
+    int verified;
+} LWVerifyInput;
+
+typedef struct {
+    const LWTransaction *tx;
+    const LWTxOutput *prevOutputs; // output spent by each input of tx
+    const LWWitnessHashes *witnessHashes; // BIP143 digests shared by all SIGHASH_FORKID preimages
+    const uint8_t *data; // tx serialized with empty input scripts, shared by all legacy SIGHASH_ALL preimages
+    size_t dataLen;
+    const size_t *inOff; // offset in data of the empty script of each input
+    LWVerifyInput *inputs; // inputs to verify
+    size_t count;
+    int valid; // set to false if any signature in the batch fails to verify
+} LWVerifyBatch;
+
+// verifies a batch of input signatures against the previous output script and amount of each input
+static void *_LWTransactionVerifyBatch(void *info)
+{
+    LWVerifyBatch *batch = info;
+    const LWTransaction *tx = batch->tx;
+    LWTransaction t = *tx;
+    LWTxInput *inputs = NULL;
+    LWVerifyInput *in;
+    const LWTxOutput *prev;
+    size_t j, dataLen, bufLen = 0;
+    uint8_t *buf = NULL;
+    LWKey key;
+    UInt256 md;
+    int hashType;
+
+    for (j = 0; batch->valid && j < batch->count; j++) {
+        in = &batch->inputs[j];
+        prev = &batch->prevOutputs[in->index];
+        hashType = in->sig[in->sigLen - 1];
+
+        if (hashType == SIGHASH_ALL) {
+            dataLen = batch->dataLen + LWVarIntSize(prev->scriptLen) - 1 + prev->scriptLen + sizeof(uint32_t);
+        }
+        else { // other hash types serialize a shallow copy of tx with the previous output set on the input
+            if (! inputs) inputs = malloc(tx->inCount*sizeof(*inputs));
+            assert(inputs != NULL);
+            memcpy(inputs, tx->inputs, tx->inCount*sizeof(*inputs));
+            inputs[in->index].script = prev->script;
+            inputs[in->index].scriptLen = prev->scriptLen;
+            inputs[in->index].amount = prev->amount;
+            t.inputs = inputs;
+
+            if (hashType & SIGHASH_FORKID) {
+                dataLen = _LWTransactionWitnessData(&t, NULL, 0, in->index, hashType, batch->witnessHashes);
+            }
+            else dataLen = _LWTransactionData(&t, NULL, 0, in->index, hashType);
+        }
+
+        if (dataLen > bufLen) buf = realloc(buf, (bufLen = dataLen));
+        assert(buf != NULL);
+
+        if (hashType == SIGHASH_ALL) {
+            _LWTransactionSpliceData(buf, batch->data, batch->dataLen, batch->inOff[in->index], prev->script,
+                                     prev->scriptLen, hashType);
+        }
+        else if (hashType & SIGHASH_FORKID) {
+            dataLen = _LWTransactionWitnessData(&t, buf, bufLen, in->index, hashType, batch->witnessHashes);
+        }
+        else dataLen = _LWTransactionData(&t, buf, bufLen, in->index, hashType);
+
+        LWSHA256_2(&md, buf, dataLen);
+        in->verified = (LWKeySetPubKey(&key, in->pubKey, in->pkLen) && LWKeyVerify(&key, md, in->sig, in->sigLen - 1));
+        if (! in->verified) batch->valid = 0;
+        LWKeyClean(&key);
+    }
+
+    if (inputs) free(inputs);
+    if (buf) free(buf);
+    return NULL;
+}
+
+// verifies the signature of each input against prevOutputs, the tx->inCount outputs spent by the inputs of tx
+// an input is unverifiable if its previous output script is NULL (not known) or is not pay-to-pubkey-hash or
+// pay-to-pubkey, or if its signature uses SIGHASH_SINGLE without a matching output
+// verified may be NULL, or else is set to true for each input with a valid signature, and false for the rest
+// returns false if any signature is invalid, unverifiable inputs are not counted as invalid
+int LWTransactionVerify(const LWTransaction *tx, const LWTxOutput prevOutputs[], int verified[])
+{
+    size_t i, count = 0, threadCount, off = 0, len, sigLen, pkLen, inCount = (tx) ? tx->inCount : 0,
+           inOff[inCount + 1];
+    LWVerifyInput inputs[inCount + 1];
+    int r = 1, witness = 0;
+
+    assert(tx != NULL);
+    assert(prevOutputs != NULL || inCount == 0);
+
+    for (i = 0; i < inCount; i++) { // select inputs with a known previous output of a standard type
+        const LWTxInput *input = &tx->inputs[i];
+        const LWTxOutput *prev = &prevOutputs[i];
+        const uint8_t *elems[5], *sigElems[2], *sig = NULL, *pubKey = NULL;
+        size_t elemsCount = LWScriptElements(elems, 5, prev->script, prev->scriptLen),
+               sigElemsCount = LWScriptElements(sigElems, 2, input->signature, input->sigLen);
+        UInt160 hash;
+
+        if (verified) verified[i] = 0;
+
+        if (elemsCount == 5 && *elems[0] == OP_DUP && *elems[1] == OP_HASH160 && *elems[2] == 20 &&
+            *elems[3] == OP_EQUALVERIFY && *elems[4] == OP_CHECKSIG) { // pay-to-pubkey-hash
+            if (sigElemsCount == 2 && *sigElems[1] <= OP_PUSHDATA4) pubKey = LWScriptData(sigElems[1], &pkLen);
+            if (pubKey) LWHash160(&hash, pubKey, pkLen);
+            if (pubKey && ! UInt160Eq(hash, UInt160Get(LWScriptData(elems[2], &len)))) pubKey = NULL;
+        }
+        else if (elemsCount == 2 && (*elems[0] == 65 || *elems[0] == 33) && *elems[1] == OP_CHECKSIG) { // pay-to-pubkey
+            if (sigElemsCount == 1) pubKey = LWScriptData(elems[0], &pkLen);
+        }
+        else continue; // previous output isn't known, or is of a type that can't be verified
+
+        if (sigElemsCount >= 1 && *sigElems[0] <= OP_PUSHDATA4) sig = LWScriptData(sigElems[0], &sigLen);
+
+        if (! sig || ! pubKey || sigLen < 9 || sigLen > 73) r = 0; // malformed scriptSig, or pubKey doesn't match
+        else if ((sig[sigLen - 1] & 0x1f) == SIGHASH_SINGLE && i >= tx->outCount) continue;
+        else {
+            if (sig[sigLen - 1] & SIGHASH_FORKID) witness = 1;
+            inputs[count++] = (LWVerifyInput) { i, sig, pubKey, sigLen, pkLen, 0 };
+        }
+    }
+
+    // compute the BIP143 digests once, and serialize tx once with all input scripts empty, each legacy SIGHASH_ALL
+    // preimage is this with one script spliced in
+    LWWitnessHashes witnessHashes = (witness) ? _LWTransactionWitnessHashes(tx) :
+                                    (LWWitnessHashes) { UINT256_ZERO, UINT256_ZERO, UINT256_ZERO };
+    size_t dataLen = (r && count > 0) ? _LWTransactionData(tx, NULL, 0, SIZE_MAX, 0) : 0;
+    uint8_t *data = (dataLen > 0) ? malloc(dataLen) : NULL;
+    LWVerifyBatch batches[TX_VERIFY_THREADS];
+
+    assert(data != NULL || dataLen == 0);
+    if (data) dataLen = _LWTransactionEmptyScriptsData(tx, data, dataLen, inOff);
+    if (! r) count = 0;
+    threadCount = LWThreadCount(count, TX_VERIFY_BATCH_MIN, TX_VERIFY_THREADS);
+
+    for (i = 0; i < threadCount; i++) { // verify inputs across worker threads
+        len = count/threadCount + (i < count % threadCount ? 1 : 0);
+        batches[i] = (LWVerifyBatch) { tx, prevOutputs, &witnessHashes, data, dataLen, inOff, &inputs[off], len, 1 };
+        off += batches[i].count;
+    }
+
+    LWThreadRunBatches(_LWTransactionVerifyBatch, batches, sizeof(*batches), threadCount);
+    for (i = 0; r && i < threadCount; i++) r = batches[i].valid;
+
+    for (i = 0; verified && i < count; i++) verified[inputs[i].index] = inputs[i].verified;
+    if (data) free(data);
+    return r;
 }
 
 // true if tx meets IsStandard() rules: https://bitcoin.org/en/developer-guide#standard-transactions
@@ -595,14 +1112,274 @@ void LWTransactionFree(LWTransaction *tx)
         for (size_t i = 0; i < tx->inCount; i++) {
             LWTxInputSetScript(&tx->inputs[i], NULL, 0);
             LWTxInputSetSignature(&tx->inputs[i], NULL, 0);
+            LWTxInputSetWitness(&tx->inputs[i], NULL, 0);
         }
 
         for (size_t i = 0; i < tx->outCount; i++) {
             LWTxOutputSetScript(&tx->outputs[i], NULL, 0);
         }
 
-        array_free(tx->outputs);
-        array_free(tx->inputs);
-        free(tx);
+        _LWTxArrayFree(tx->outputs);
+        _LWTxArrayFree(tx->inputs);
+        free(tx); // a packed tx is a single allocation starting with tx itself
+    }
+}
+
+// reads the serialized tx input at off into input
+// returns the offset following the input, which is past bufLen if the input is truncated
+static size_t _LWTxInputViewRead(const uint8_t *buf, size_t bufLen, size_t off, LWTxInputView *input)
+{
+    LWScriptHash sh;
+    size_t sLen, len = 0;
+    
+    *input = (LWTxInputView) { UINT256_ZERO, 0, 0, NULL, 0, NULL, 0, NULL, 0, 0 };
+    input->txHash = (off + sizeof(UInt256) <= bufLen) ? UInt256Get(&buf[off]) : UINT256_ZERO;
+    off += sizeof(UInt256);
+    input->index = (off + sizeof(uint32_t) <= bufLen) ? UInt32GetLE(&buf[off]) : 0;
+    off += sizeof(uint32_t);
+    sLen = (size_t)LWVarInt(&buf[off], (off <= bufLen ? bufLen - off : 0), &len);
+    off += len;
+    if (off > bufLen || sLen > bufLen - off) return bufLen + 1;
+    
+    if (LWScriptHashFromScriptPubKey(&sh, &buf[off], sLen)) { // unsigned tx includes the previous output script
+        input->script = &buf[off];
+        input->scriptLen = sLen;
+        input->amount = (off + sLen + sizeof(uint64_t) <= bufLen) ? UInt64GetLE(&buf[off + sLen]) : 0;
+        off += sizeof(uint64_t);
+    }
+    else {
+        input->signature = &buf[off];
+        input->sigLen = sLen;
+    }
+    
+    off += sLen;
+    input->sequence = (off + sizeof(uint32_t) <= bufLen) ? UInt32GetLE(&buf[off]) : 0;
+    off += sizeof(uint32_t);
+    return off;
+}
+
+// reads the serialized tx output at off into output
+// returns the offset following the output, which is past bufLen if the output is truncated
+static size_t _LWTxOutputViewRead(const uint8_t *buf, size_t bufLen, size_t off, LWTxOutputView *output)
+{
+    size_t sLen, len = 0;
+    
+    *output = (LWTxOutputView) { 0, NULL, 0 };
+    output->amount = (off + sizeof(uint64_t) <= bufLen) ? UInt64GetLE(&buf[off]) : 0;
+    off += sizeof(uint64_t);
+    sLen = (size_t)LWVarInt(&buf[off], (off <= bufLen ? bufLen - off : 0), &len);
+    off += len;
+    if (off > bufLen || sLen > bufLen - off) return bufLen + 1;
+    output->script = &buf[off];
+    output->scriptLen = sLen;
+    return off + sLen;
+}
+
+// reads the serialized witness stack at off, and writes its length to witLen
+// returns the offset following the witness, which is past bufLen if the witness is truncated
+static size_t _LWTxWitnessViewRead(const uint8_t *buf, size_t bufLen, size_t off, size_t *witLen)
+{
+    size_t i, count, iLen, start = off, len = 0;
+    
+    count = (size_t)LWVarInt(&buf[off], (off <= bufLen ? bufLen - off : 0), &len);
+    off += len;
+    
+    for (i = 0; off <= bufLen && i < count; i++) {
+        iLen = (size_t)LWVarInt(&buf[off], (off <= bufLen ? bufLen - off : 0), &len);
+        off += len;
+        if (off > bufLen || iLen > bufLen - off) return bufLen + 1;
+        off += iLen;
+    }
+    
+    *witLen = off - start;
+    return off;
+}
+
+// parses the serialized tx at the start of buf into view, without allocating memory or deriving any addresses
+// returns true if buf contains a well formed tx
+int LWTransactionViewParse(LWTransactionView *view, const uint8_t *buf, size_t bufLen)
+{
+    LWTxInputView input;
+    LWTxOutputView output;
+    LWSHA256Context ctx;
+    size_t i, off = 0, len = 0, witLen;
+    int isSigned = 1, witnessFlag = 0;
+    
+    assert(view != NULL);
+    assert(buf != NULL || bufLen == 0);
+    if (! view || ! buf) return 0;
+    
+    memset(view, 0, sizeof(*view));
+    view->buf = buf;
+    view->version = (off + sizeof(uint32_t) <= bufLen) ? UInt32GetLE(&buf[off]) : 0;
+    off += sizeof(uint32_t);
+    
+    if (off + 2 <= bufLen && buf[off] == 0x00 && buf[off + 1] == 0x01) { // BIP144 marker and flag
+        witnessFlag = 1;
+        off += 2;
+    }
+    
+    view->inCount = (size_t)LWVarInt(&buf[off], (off <= bufLen ? bufLen - off : 0), &len);
+    off += len;
+    view->inOff = view->inNext = off;
+    
+    for (i = 0; off <= bufLen && i < view->inCount; i++) {
+        off = _LWTxInputViewRead(buf, bufLen, off, &input);
+        if (input.script) isSigned = 0;
+    }
+    
+    view->outCount = (size_t)LWVarInt(&buf[off], (off <= bufLen ? bufLen - off : 0), &len);
+    off += len;
+    view->outOff = view->outNext = off;
+    
+    for (i = 0; off <= bufLen && i < view->outCount; i++) {
+        off = _LWTxOutputViewRead(buf, bufLen, off, &output);
+    }
+    
+    if (witnessFlag) view->witOff = view->witNext = off;
+    
+    for (i = 0; witnessFlag && off <= bufLen && i < view->inCount; i++) {
+        off = _LWTxWitnessViewRead(buf, bufLen, off, &witLen);
+    }
+    
+    view->lockTime = (off + sizeof(uint32_t) <= bufLen) ? UInt32GetLE(&buf[off]) : 0;
+    off += sizeof(uint32_t);
+    if (view->inCount == 0 || off > bufLen) return 0;
+    view->len = off;
+    
+    if (isSigned && witnessFlag) { // txHash leaves out the marker, flag and witnesses, so hash around them in place
+        LWSHA256_2(&view->wtxHash, buf, off);
+        LWSHA256Init(&ctx);
+        LWSHA256Update(&ctx, buf, sizeof(uint32_t));
+        LWSHA256Update(&ctx, &buf[sizeof(uint32_t) + 2], view->witOff - (sizeof(uint32_t) + 2));
+        LWSHA256Update(&ctx, &buf[off - sizeof(uint32_t)], sizeof(uint32_t));
+        LWSHA256Final(&ctx, &view->txHash);
+        LWSHA256(&view->txHash, &view->txHash, sizeof(view->txHash));
+    }
+    else if (isSigned) {
+        LWSHA256_2(&view->txHash, buf, off);
+        view->wtxHash = view->txHash;
+    }
+    
+    return 1;
+}
+
+// sets input to the tx input at index, with script and signature pointing into the view's buffer
+// inputs are read fastest in order, since view keeps track of where the next one starts
+// returns true on success, or false if index is out of range
+int LWTransactionViewInput(LWTransactionView *view, size_t index, LWTxInputView *input)
+{
+    assert(view != NULL);
+    assert(input != NULL);
+    if (! view || ! input || index >= view->inCount) return 0;
+    if (index < view->inIndex) { // start over from the first input
+        view->inIndex = 0, view->inNext = view->inOff, view->witNext = view->witOff;
+    }
+    
+    while (view->inIndex <= index) { // each input's witness is read along with it
+        view->inNext = _LWTxInputViewRead(view->buf, view->len, view->inNext, input);
+        
+        if (view->witOff > 0) {
+            input->witness = &view->buf[view->witNext];
+            view->witNext = _LWTxWitnessViewRead(view->buf, view->len, view->witNext, &input->witLen);
+        }
+        
+        view->inIndex++;
+    }
+    
+    return 1;
+}
+
+// sets output to the tx output at index, with script pointing into the view's buffer
+// returns true on success, or false if index is out of range
+int LWTransactionViewOutput(LWTransactionView *view, size_t index, LWTxOutputView *output)
+{
+    assert(view != NULL);
+    assert(output != NULL);
+    if (! view || ! output || index >= view->outCount) return 0;
+    if (index < view->outIndex) view->outIndex = 0, view->outNext = view->outOff; // start over from the first output
+    
+    while (view->outIndex <= index) {
+        view->outNext = _LWTxOutputViewRead(view->buf, view->len, view->outNext, output);
+        view->outIndex++;
     }
+    
+    return 1;
+}
+
+// returns a transaction built from view that must be freed by calling LWTransactionFree()
+// the transaction is packed into a single allocation, the same as one returned by LWTransactionCopy()
+LWTransaction *LWTransactionViewTransaction(const LWTransactionView *view)
+{
+    LWTransaction *tx;
+    LWTransactionView v;
+    LWTxInputView in;
+    LWTxOutputView out;
+    uint8_t *block;
+    size_t i, off = sizeof(*tx), len = off;
+    
+    assert(view != NULL);
+    v = *view;
+    len += _LWTxPackedLen(v.inCount*sizeof(*tx->inputs)) + _LWTxPackedLen(v.outCount*sizeof(*tx->outputs));
+    
+    for (i = 0; LWTransactionViewInput(&v, i, &in); i++) { // size up the allocation first
+        if (in.script) len += _LWTxPackedLen(in.scriptLen);
+        if (in.signature) len += _LWTxPackedLen(in.sigLen);
+        if (in.witness) len += _LWTxPackedLen(in.witLen);
+    }
+    
+    for (i = 0; LWTransactionViewOutput(&v, i, &out); i++) len += _LWTxPackedLen(out.scriptLen);
+    block = calloc(1, len);
+    assert(block != NULL);
+    tx = (LWTransaction *)block;
+    tx->version = v.version;
+    tx->inputs = _LWTxPack(block, &off, NULL, v.inCount, sizeof(*tx->inputs));
+    tx->inCount = v.inCount;
+    tx->outputs = _LWTxPack(block, &off, NULL, v.outCount, sizeof(*tx->outputs));
+    tx->outCount = v.outCount;
+    
+    for (i = 0; LWTransactionViewInput(&v, i, &in); i++) {
+        LWTxInput *input = &tx->inputs[i];
+        
+        input->txHash = in.txHash;
+        input->index = in.index;
+        input->amount = in.amount;
+        
+        if (in.script) {
+            input->script = _LWTxPack(block, &off, in.script, in.scriptLen, 1);
+            input->scriptLen = in.scriptLen;
+            LWScriptHashFromScriptPubKey(&input->address, in.script, in.scriptLen);
+        }
+        
+        if (in.signature) {
+            input->signature = _LWTxPack(block, &off, in.signature, in.sigLen, 1);
+            input->sigLen = in.sigLen;
+            if (input->address.type == SCRIPT_HASH_NONE) {
+                LWScriptHashFromScriptSig(&input->address, in.signature, in.sigLen);
+            }
+        }
+        
+        if (in.witness) {
+            input->witness = _LWTxPack(block, &off, in.witness, in.witLen, 1);
+            input->witLen = in.witLen;
+        }
+        
+        input->sequence = in.sequence;
+    }
+    
+    for (i = 0; LWTransactionViewOutput(&v, i, &out); i++) {
+        LWTxOutput *output = &tx->outputs[i];
+        
+        output->amount = out.amount;
+        output->script = _LWTxPack(block, &off, out.script, out.scriptLen, 1);
+        output->scriptLen = out.scriptLen;
+        LWScriptHashFromScriptPubKey(&output->address, out.script, out.scriptLen);
+    }
+    
+    tx->lockTime = v.lockTime;
+    tx->blockHeight = TX_UNCONFIRMED;
+    tx->txHash = v.txHash;
+    tx->wtxHash = v.wtxHash;
+    _LWTransactionSetSize(tx);
+    return tx;
 }
@@ -6,6 +6,7 @@
 #define LWTransaction_h
 
 #include "LWKey.h"
+#include "LWAddress.h"
 #include "LWInt.h"
 #include <stddef.h>
 #include <inttypes.h>
@@ -37,27 +38,30 @@ uint32_t LWRand(uint32_t upperBound);
 typedef struct {
     UInt256 txHash;
     uint32_t index;
-    char address[75];
+    LWScriptHash address; // what the input spends from, use LWScriptHashAddress() for the address string
     uint64_t amount;
     uint8_t *script;
     size_t scriptLen;
     uint8_t *signature;
     size_t sigLen;
+    uint8_t *witness; // BIP144 serialized witness stack, an item count followed by each item's varint length and data
+    size_t witLen;
     uint32_t sequence;
 } LWTxInput;
 
 void LWTxInputSetAddress(LWTxInput *input, const char *address);
 void LWTxInputSetScript(LWTxInput *input, const uint8_t *script, size_t scriptLen);
 void LWTxInputSetSignature(LWTxInput *input, const uint8_t *signature, size_t sigLen);
+void LWTxInputSetWitness(LWTxInput *input, const uint8_t *witness, size_t witLen);
 
 typedef struct {
-    char address[75];
+    LWScriptHash address; // what the output pays to, use LWScriptHashAddress() for the address string
     uint64_t amount;
     uint8_t *script;
     size_t scriptLen;
 } LWTxOutput;
 
-#define LW_TX_OUTPUT_NONE ((LWTxOutput) { "", 0, NULL, 0 })
+#define LW_TX_OUTPUT_NONE ((LWTxOutput) { { SCRIPT_HASH_NONE, 0, 0, { 0 } }, 0, NULL, 0 })
 
 // when creating a LWTxOutput struct outside of a LWTransaction, set address or script to NULL when done to free memory
 void LWTxOutputSetAddress(LWTxOutput *output, const char *address);
@@ -65,11 +69,14 @@ void LWTxOutputSetScript(LWTxOutput *output, const uint8_t *script, size_t scrip
 
 typedef struct {
     UInt256 txHash;
+    UInt256 wtxHash; // BIP141 hash including witness data, same as txHash if tx has no witness data
     uint32_t version;
     LWTxInput *inputs;
     size_t inCount;
     LWTxOutput *outputs;
     size_t outCount;
+    size_t size; // running LWTransactionSize() total, kept current by the LWTransaction functions that change tx
+    size_t weight; // running BIP141 weight, four times the size without witness data, plus the witness data size
     uint32_t lockTime;
     uint32_t blockHeight;
     uint32_t timestamp; // time interval since unix epoch
@@ -79,13 +86,22 @@ typedef struct {
 LWTransaction *LWTransactionNew(void);
 
 // returns a deep copy of tx and that must be freed by calling LWTransactionFree()
+// the copy is packed into a single allocation, like a tx returned by LWTransactionParse()
 LWTransaction *LWTransactionCopy(const LWTransaction *tx);
 
-// buf must contain a serialized tx
+// buf must contain a serialized tx, in either the legacy or the BIP144 witness format
 // retruns a transaction that must be freed by calling LWTransactionFree()
+// the transaction is packed into a single allocation, holding tx along with all its inputs, outputs and scripts
 LWTransaction *LWTransactionParse(const uint8_t *buf, size_t bufLen);
 
+// buf must contain a sequence of serialized txs, each prefixed with its length as a varint, such as for wallet load
+// txs are parsed across worker threads and written to txs in order, with NULL for any that are malformed
+// returns the number of txs in buf, or txsCount needed if txs is NULL, each tx must be freed with LWTransactionFree()
+// returns 0 and leaves txs unset if buf ends with a truncated tx or length prefix
+size_t LWTransactionParseMany(LWTransaction *txs[], size_t txsCount, const uint8_t *buf, size_t bufLen);
+
 // returns number of bytes written to buf, or total bufLen needed if buf is NULL
+// tx is written in the BIP144 witness format if any input has a witness
 // (tx->blockHeight and tx->timestamp are not serialized)
 size_t LWTransactionSerialize(const LWTransaction *tx, uint8_t *buf, size_t bufLen);
 
@@ -100,9 +116,14 @@ void LWTransactionAddOutput(LWTransaction *tx, uint64_t amount, const uint8_t *s
 // shuffles order of tx outputs
 void LWTransactionShuffleOutputs(LWTransaction *tx);
 
-// size in bytes if signed, or estimated size assuming compact pubkey sigs
+// size in bytes if signed, or estimated size assuming compact pubkey sigs, including any witness data
+// inputs and outputs must be changed with the LWTransaction functions to keep the size current, LWTransactionSign()
+// recomputes it after any input signatures or witnesses are set directly
 size_t LWTransactionSize(const LWTransaction *tx);
 
+// BIP141 virtual size, the weight divided by 4 and rounded up, same as LWTransactionSize() without witness data
+size_t LWTransactionVSize(const LWTransaction *tx);
+
 // minimum transaction fee needed for tx to relay across the bitcoin network
 uint64_t LWTransactionStandardFee(const LWTransaction *tx);
 
@@ -114,6 +135,13 @@ int LWTransactionIsSigned(const LWTransaction *tx);
 // returns true if tx is signed
 int LWTransactionSign(LWTransaction *tx, int forkId, LWKey keys[], size_t keysCount);
 
+// verifies the signature of each input against prevOutputs, the tx->inCount outputs spent by the inputs of tx, giving
+// the script and amount (needed for BIP143 signatures) of each, with a NULL script for any that isn't known
+// inputs spending unknown or non-standard outputs are unverifiable, and verified may be NULL, or else is set to true
+// for each input with a valid signature and false for the rest, so that unverifiable inputs can be told apart
+// returns false if any signature is invalid, unverifiable inputs are not counted as invalid
+int LWTransactionVerify(const LWTransaction *tx, const LWTxOutput prevOutputs[], int verified[]);
+
 // true if tx meets IsStandard() rules: https://bitcoin.org/en/developer-guide#standard-transactions
 int LWTransactionIsStandard(const LWTransaction *tx);
 
@@ -132,6 +160,55 @@ inline static int LWTransactionEq(const void *tx, const void *otherTx)
 // frees memory allocated for tx
 void LWTransactionFree(LWTransaction *tx);
 
+// read-only view of a serialized tx that points into the buffer it was parsed from, instead of copying it
+typedef struct {
+    const uint8_t *buf; // serialized tx, must remain unchanged for as long as the view is used
+    size_t len; // length of the serialized tx, which may be less than the length of the buffer it was parsed from
+    UInt256 txHash; // UINT256_ZERO if tx is unsigned
+    UInt256 wtxHash; // same as txHash if tx has no witness data
+    uint32_t version;
+    size_t inCount;
+    size_t outCount;
+    uint32_t lockTime;
+    size_t inOff, outOff, witOff; // offsets in buf of the first input, output and witness, witOff is 0 if none
+    size_t inIndex, inNext, outIndex, outNext, witNext; // index and offset of the next input and output to be read
+} LWTransactionView;
+
+typedef struct {
+    UInt256 txHash;
+    uint32_t index;
+    uint64_t amount; // only included in unsigned tx
+    const uint8_t *script; // only included in unsigned tx
+    size_t scriptLen;
+    const uint8_t *signature;
+    size_t sigLen;
+    const uint8_t *witness; // NULL if tx has no witness data
+    size_t witLen;
+    uint32_t sequence;
+} LWTxInputView;
+
+typedef struct {
+    uint64_t amount;
+    const uint8_t *script;
+    size_t scriptLen;
+} LWTxOutputView;
+
+// parses the serialized tx at the start of buf into view, without allocating memory or deriving any addresses
+// returns true if buf contains a well formed tx
+int LWTransactionViewParse(LWTransactionView *view, const uint8_t *buf, size_t bufLen);
+
+// sets input to the tx input at index, with script, signature and witness pointing into the view's buffer
+// inputs are read fastest in order, since view keeps track of where the next one starts
+// returns true on success, or false if index is out of range
+int LWTransactionViewInput(LWTransactionView *view, size_t index, LWTxInputView *input);
+
+// sets output to the tx output at index, with script pointing into the view's buffer
+// returns true on success, or false if index is out of range
+int LWTransactionViewOutput(LWTransactionView *view, size_t index, LWTxOutputView *output);
+
+// returns a transaction built from view that must be freed by calling LWTransactionFree()
+LWTransaction *LWTransactionViewTransaction(const LWTransactionView *view);
+
 #ifdef __cplusplus
 }
 #endif
@@ -7,19 +7,29 @@
 #include "LWAddress.h"
 #include "LWArray.h"
 #include <stdlib.h>
+#include <string.h>
 #include <inttypes.h>
 #include <limits.h>
 #include <float.h>
 #include <pthread.h>
 #include <assert.h>
 
+typedef struct LWBalanceUndoStruct LWBalanceUndo;
+
 struct LWWalletStruct {
     uint64_t balance, totalSent, totalReceived, feePerKb, *balanceHist;
+    LWBalanceUndo *balanceUndo; // parallel to balanceHist, used to rewind balance state to the first changed tx
+    size_t lockedIndex; // position of first tx that is pending due to lockTime, or SIZE_MAX
+    size_t balanceBase; // number of txs loaded from a saved wallet state, which have no undo data
+    size_t balanceInternal, balanceExternal; // address chain lengths that balance state was last updated with
     uint32_t blockHeight;
     LWUTXO *utxos;
+    LWSet *utxoSet; // points into utxos, giving the position of each unspent output without a scan
     LWTransaction **transactions;
     LWMasterPubKey masterPubKey;
+    LWMasterPubKey internalChainKey, externalChainKey; // extended public keys for N(m/0H/chain), derived once
     LWAddress *internalChain, *externalChain;
+    LWScriptHash *internalHashes, *externalHashes; // binary form of each chain address, which allAddrs points into
     LWSet *allTx, *invalidTx, *pendingTx, *spentOutputs, *usedAddrs, *allAddrs;
     void *callbackInfo;
     void (*balanceChanged)(void *info, uint64_t balance);
@@ -37,16 +47,19 @@ inline static uint64_t _txFee(uint64_t feePerKb, size_t size)
     return (fee > standardFee) ? fee : standardFee;
 }
 
-// chain position of first tx output address that appears in chain
-inline static size_t _txChainIndex(const LWTransaction *tx, const LWAddress *addrChain)
+// chain position of last tx output address that appears in chain, found through allAddrs which points into the chains
+inline static size_t _txChainIndex(LWWallet *wallet, const LWTransaction *tx, const LWScriptHash *addrChain)
 {
-    for (size_t i = array_count(addrChain); i > 0; i--) {
-        for (size_t j = 0; j < tx->outCount; j++) {
-            if (LWAddressEq(tx->outputs[j].address, &addrChain[i - 1])) return i - 1;
-        }
+    const LWScriptHash *addr;
+    size_t i = SIZE_MAX;
+
+    for (size_t j = 0; j < tx->outCount; j++) {
+        addr = LWSetGet(wallet->allAddrs, &tx->outputs[j].address);
+        if (! addr || addr < addrChain || addr >= addrChain + array_count(addrChain)) continue;
+        if (i == SIZE_MAX || (size_t)(addr - addrChain) > i) i = (size_t)(addr - addrChain);
     }
-    
-    return SIZE_MAX;
+
+    return i;
 }
 
 inline static int _LWWalletTxIsAscending(LWWallet *wallet, const LWTransaction *tx1, const LWTransaction *tx2)
@@ -76,26 +89,72 @@ inline static int _LWWalletTxCompare(LWWallet *wallet, const LWTransaction *tx1,
 
     if (_LWWalletTxIsAscending(wallet, tx1, tx2)) return 1;
     if (_LWWalletTxIsAscending(wallet, tx2, tx1)) return -1;
-    i = _txChainIndex(tx1, wallet->internalChain);
-    j = _txChainIndex(tx2, (i == SIZE_MAX) ? wallet->externalChain : wallet->internalChain);
-    if (i == SIZE_MAX && j != SIZE_MAX) i = _txChainIndex((LWTransaction *)tx1, wallet->externalChain);
+    i = _txChainIndex(wallet, tx1, wallet->internalHashes);
+    j = _txChainIndex(wallet, tx2, (i == SIZE_MAX) ? wallet->externalHashes : wallet->internalHashes);
+    if (i == SIZE_MAX && j != SIZE_MAX) i = _txChainIndex(wallet, tx1, wallet->externalHashes);
     if (i != SIZE_MAX && j != SIZE_MAX && i != j) return (i > j) ? 1 : -1;
     return 0;
 }
 
 // inserts tx into wallet->transactions, keeping wallet->transactions sorted by date, oldest first (insertion sort)
-inline static void _LWWalletInsertTx(LWWallet *wallet, LWTransaction *tx)
+// returns the position tx was inserted at
+inline static size_t _LWWalletInsertTx(LWWallet *wallet, LWTransaction *tx)
 {
-    size_t i = array_count(wallet->transactions);
-    
-    array_set_count(wallet->transactions, i + 1);
-    
-    while (i > 0 && _LWWalletTxCompare(wallet, wallet->transactions[i - 1], tx) > 0) {
-        wallet->transactions[i] = wallet->transactions[i - 1];
-        i--;
+    size_t i = 0, j = array_count(wallet->transactions), k;
+
+    // wallet->transactions is sorted by blockHeight, so binary search past any txs in later blocks, which always
+    // compare greater, and only run the full comparison against txs in the same block
+    while (i < j) {
+        k = i + (j - i)/2;
+        if (wallet->transactions[k]->blockHeight > tx->blockHeight) j = k;
+        else i = k + 1;
+    }
+
+    while (i > 0 && wallet->transactions[i - 1]->blockHeight == tx->blockHeight &&
+           _LWWalletTxCompare(wallet, wallet->transactions[i - 1], tx) > 0) i--;
+    array_insert(wallet->transactions, i, tx);
+    return i;
+}
+
+typedef struct {
+    LWTransaction *tx;
+    size_t n;
+} LWTxPos;
+
+inline static int _LWTxPosCompare(const void *pos1, const void *pos2)
+{
+    const LWTxPos *p1 = pos1, *p2 = pos2;
+
+    if (p1->tx->blockHeight != p2->tx->blockHeight) return (p1->tx->blockHeight > p2->tx->blockHeight) ? 1 : -1;
+    return (p1->n > p2->n) ? 1 : (p1->n < p2->n) ? -1 : 0;
+}
+
+// sorts txs appended to wallet->transactions in one pass, giving the same order as calling _LWWalletInsertTx() on
+// each of them in turn: a stable sort by blockHeight, followed by an insertion sort within each block
+static void _LWWalletSortTxs(LWWallet *wallet)
+{
+    size_t i, j, k, count = array_count(wallet->transactions);
+    LWTxPos *pos = malloc(count*sizeof(*pos) + 1);
+    LWTransaction *tx;
+
+    assert(pos != NULL);
+    for (i = 0; i < count; i++) pos[i] = (LWTxPos) { wallet->transactions[i], i };
+    qsort(pos, count, sizeof(*pos), _LWTxPosCompare);
+    for (i = 0; i < count; i++) wallet->transactions[i] = pos[i].tx;
+    free(pos);
+
+    for (i = 0; i < count; i = j) {
+        for (j = i + 1; j < count; j++) {
+            tx = wallet->transactions[j];
+            if (tx->blockHeight != wallet->transactions[i]->blockHeight) break;
+
+            for (k = j; k > i && _LWWalletTxCompare(wallet, wallet->transactions[k - 1], tx) > 0; k--) {
+                wallet->transactions[k] = wallet->transactions[k - 1];
+            }
+
+            wallet->transactions[k] = tx;
+        }
     }
-    
-    wallet->transactions[i] = tx;
 }
 
 // non-threadsafe version of LWWalletContainsTransaction()
@@ -104,14 +163,14 @@ static int _LWWalletContainsTx(LWWallet *wallet, const LWTransaction *tx)
     int r = 0;
     
     for (size_t i = 0; ! r && i < tx->outCount; i++) {
-        if (LWSetContains(wallet->allAddrs, tx->outputs[i].address)) r = 1;
+        if (LWSetContains(wallet->allAddrs, &tx->outputs[i].address)) r = 1;
     }
     
     for (size_t i = 0; ! r && i < tx->inCount; i++) {
         LWTransaction *t = LWSetGet(wallet->allTx, &tx->inputs[i].txHash);
         uint32_t n = tx->inputs[i].index;
         
-        if (t && n < t->outCount && LWSetContains(wallet->allAddrs, t->outputs[n].address)) r = 1;
+        if (t && n < t->outCount && LWSetContains(wallet->allAddrs, &t->outputs[n].address)) r = 1;
     }
     
     return r;
@@ -122,146 +181,637 @@ static int _LWWalletContainsTx(LWWallet *wallet, const LWTransaction *tx)
 //    int r = 0;
 //    
 //    for (size_t i = 0; ! r && i < tx->inCount; i++) {
-//        if (LWSetContains(wallet->allAddrs, tx->inputs[i].address)) r = 1;
+//        if (LWSetContains(wallet->allAddrs, &tx->inputs[i].address)) r = 1;
 //    }
 //    
 //    return r;
 //}
 
-static void _LWWalletUpdateBalance(LWWallet *wallet)
+#define WALLET_STATE_VERSION 2
+
+#define TX_STATUS_VALID   0
+#define TX_STATUS_INVALID 1
+#define TX_STATUS_PENDING 2
+
+// journal entry recording how a tx changed the wallet balance state, so the change can be undone
+struct LWBalanceUndoStruct {
+    LWTransaction *tx;
+    uint64_t totalSent, totalReceived; // wallet totals before tx was applied
+    int status;
+    size_t utxosAdded, removedCount; // number of utxos appended by tx, and number removed
+    struct { size_t index; LWUTXO utxo; } *removed; // utxos removed from wallet->utxos, in the order they were removed
+    uint8_t *added; // per input, true if it was added to spentOutputs, followed by the same per output for usedAddrs
+};
+
+// rebuilds utxoSet after wallet->utxos has been moved to a new memory location or replaced
+static void _LWWalletIndexUTXOs(LWWallet *wallet)
 {
-    int isInvalid, isPending;
-    uint64_t balance = 0, prevBalance = 0;
-    time_t now = time(NULL);
-    size_t i, j;
-    LWTransaction *tx, *t;
-    
-    array_clear(wallet->utxos);
-    array_clear(wallet->balanceHist);
-    LWSetClear(wallet->spentOutputs);
-    LWSetClear(wallet->invalidTx);
-    LWSetClear(wallet->pendingTx);
-    LWSetClear(wallet->usedAddrs);
-    wallet->totalSent = 0;
-    wallet->totalReceived = 0;
-
-    for (i = 0; i < array_count(wallet->transactions); i++) {
-        tx = wallet->transactions[i];
-
-        // check if any inputs are invalid or already spent
-        if (tx->blockHeight == TX_UNCONFIRMED) {
-            for (j = 0, isInvalid = 0; ! isInvalid && j < tx->inCount; j++) {
-                if (LWSetContains(wallet->spentOutputs, &tx->inputs[j]) ||
-                    LWSetContains(wallet->invalidTx, &tx->inputs[j].txHash)) isInvalid = 1;
-            }
-        
-            if (isInvalid) {
-                LWSetAdd(wallet->invalidTx, tx);
-                array_add(wallet->balanceHist, balance);
-                continue;
-            }
+    LWSetClear(wallet->utxoSet);
+    for (size_t i = 0; i < array_count(wallet->utxos); i++) LWSetAdd(wallet->utxoSet, &wallet->utxos[i]);
+}
+
+// appends utxo to wallet->utxos
+static void _LWWalletAddUTXO(LWWallet *wallet, LWUTXO utxo)
+{
+    LWUTXO *utxos = wallet->utxos;
+
+    array_add(wallet->utxos, utxo);
+    if (wallet->utxos != utxos) _LWWalletIndexUTXOs(wallet); // was utxos moved to a new memory location?
+    else LWSetAdd(wallet->utxoSet, &wallet->utxos[array_count(wallet->utxos) - 1]);
+}
+
+// removes the utxo at index i from wallet->utxos by moving the last utxo into its place
+static void _LWWalletRemoveUTXO(LWWallet *wallet, size_t i)
+{
+    size_t last = array_count(wallet->utxos) - 1;
+
+    LWSetRemove(wallet->utxoSet, &wallet->utxos[i]);
+
+    if (i < last) {
+        LWSetRemove(wallet->utxoSet, &wallet->utxos[last]);
+        wallet->utxos[i] = wallet->utxos[last];
+        LWSetAdd(wallet->utxoSet, &wallet->utxos[i]);
+    }
+
+    array_rm_last(wallet->utxos);
+}
+
+// puts utxo back at index i, moving the utxo there to the end, the exact inverse of _LWWalletRemoveUTXO()
+static void _LWWalletRestoreUTXO(LWWallet *wallet, size_t i, LWUTXO utxo)
+{
+    LWUTXO moved = utxo;
+
+    if (i < array_count(wallet->utxos)) {
+        moved = wallet->utxos[i];
+        LWSetRemove(wallet->utxoSet, &wallet->utxos[i]);
+        wallet->utxos[i] = utxo;
+        LWSetAdd(wallet->utxoSet, &wallet->utxos[i]);
+    }
+
+    _LWWalletAddUTXO(wallet, moved);
+}
+
+// removes the wallet utxo spent by input, if present, recording its position in undo, returns the amount removed
+static uint64_t _LWWalletSpendUTXO(LWWallet *wallet, LWBalanceUndo *undo, const LWTxInput *input)
+{
+    LWTransaction *t = LWSetGet(wallet->allTx, &input->txHash);
+    uint32_t n = input->index;
+    LWUTXO *o;
+
+    if (! t || n >= t->outCount) return 0;
+    o = LWSetGet(wallet->utxoSet, &((LWUTXO) { input->txHash, n }));
+    if (! o) return 0;
+    undo->removed[undo->removedCount].index = (size_t)(o - wallet->utxos);
+    undo->removed[undo->removedCount++].utxo = *o;
+    _LWWalletRemoveUTXO(wallet, (size_t)(o - wallet->utxos));
+    return t->outputs[n].amount;
+}
+
+// applies the next tx in wallet->transactions to the wallet balance state
+static void _LWWalletApplyTx(LWWallet *wallet, time_t now)
+{
+    size_t i, j, n = array_count(wallet->balanceUndo), removedMax;
+    LWTransaction *tx = wallet->transactions[n];
+    LWBalanceUndo undo = { tx, wallet->totalSent, wallet->totalReceived, TX_STATUS_VALID, 0, 0, NULL, NULL };
+    uint64_t balance = wallet->balance;
+    int isLocked = 0, isPending = 0;
+
+    // check if any inputs are invalid or already spent
+    if (tx->blockHeight == TX_UNCONFIRMED) {
+        for (j = 0; undo.status == TX_STATUS_VALID && j < tx->inCount; j++) {
+            if (LWSetContains(wallet->spentOutputs, &tx->inputs[j]) ||
+                LWSetContains(wallet->invalidTx, &tx->inputs[j].txHash)) undo.status = TX_STATUS_INVALID;
         }
+    }
+
+    if (undo.status == TX_STATUS_INVALID) {
+        LWSetAdd(wallet->invalidTx, tx);
+        array_add(wallet->balanceUndo, undo);
+        array_add(wallet->balanceHist, balance);
+        return;
+    }
+
+    // outputs spent by pending txs are only removed from the UTXO set by the next valid tx, so leave room for those
+    for (i = n, removedMax = tx->inCount; i > 0 && wallet->balanceUndo[i - 1].status != TX_STATUS_VALID; i--) {
+        if (wallet->balanceUndo[i - 1].status != TX_STATUS_PENDING) continue;
+        removedMax += wallet->balanceUndo[i - 1].tx->inCount;
+    }
+
+    undo.removed = malloc(removedMax*sizeof(*undo.removed) + tx->inCount + tx->outCount + 1);
+    assert(undo.removed != NULL);
+    undo.added = (uint8_t *)&undo.removed[removedMax];
+    memset(undo.added, 0, tx->inCount + tx->outCount);
+
+    // add inputs to spent output set
+    for (j = 0; j < tx->inCount; j++) {
+        if (LWSetContains(wallet->spentOutputs, &tx->inputs[j])) continue;
+        LWSetAdd(wallet->spentOutputs, &tx->inputs[j]);
+        undo.added[j] = 1;
+    }
+
+    // check if tx is pending
+    if (tx->blockHeight == TX_UNCONFIRMED) {
+        if (LWTransactionSize(tx) > TX_MAX_SIZE) undo.status = TX_STATUS_PENDING; // check tx size is under TX_MAX_SIZE
 
-        // add inputs to spent output set
-        for (j = 0; j < tx->inCount; j++) {
-            LWSetAdd(wallet->spentOutputs, &tx->inputs[j]);
+        for (j = 0; undo.status == TX_STATUS_VALID && j < tx->outCount; j++) {
+            if (tx->outputs[j].amount < TX_MIN_OUTPUT_AMOUNT) undo.status = TX_STATUS_PENDING; // check for dust
         }
 
-        // check if tx is pending
-        if (tx->blockHeight == TX_UNCONFIRMED) {
-            isPending = (LWTransactionSize(tx) > TX_MAX_SIZE) ? 1 : 0; // check tx size is under TX_MAX_SIZE
-            
-            for (j = 0; ! isPending && j < tx->outCount; j++) {
-                if (tx->outputs[j].amount < TX_MIN_OUTPUT_AMOUNT) isPending = 1; // check that no outputs are dust
-            }
+        for (j = 0; undo.status == TX_STATUS_VALID && j < tx->inCount; j++) {
+            if (tx->inputs[j].sequence < UINT32_MAX - 1) undo.status = TX_STATUS_PENDING; // check for replace-by-fee
+            if (tx->inputs[j].sequence < UINT32_MAX && tx->lockTime < TX_MAX_LOCK_HEIGHT &&
+                tx->lockTime > wallet->blockHeight + 1) isLocked = 1; // future lockTime
+            if (tx->inputs[j].sequence < UINT32_MAX && tx->lockTime > now) isLocked = 1; // future lockTime
+            if (LWSetContains(wallet->pendingTx, &tx->inputs[j].txHash)) isPending = 1; // check for pending inputs
+            if (isLocked || isPending) undo.status = TX_STATUS_PENDING;
+            // TODO: XXX handle BIP68 check lock time verify rules
+        }
 
-            for (j = 0; ! isPending && j < tx->inCount; j++) {
-                if (tx->inputs[j].sequence < UINT32_MAX - 1) isPending = 1; // check for replace-by-fee
-                if (tx->inputs[j].sequence < UINT32_MAX && tx->lockTime < TX_MAX_LOCK_HEIGHT &&
-                    tx->lockTime > wallet->blockHeight + 1) isPending = 1; // future lockTime
-                if (tx->inputs[j].sequence < UINT32_MAX && tx->lockTime > now) isPending = 1; // future lockTime
-                if (LWSetContains(wallet->pendingTx, &tx->inputs[j].txHash)) isPending = 1; // check for pending inputs
-                // TODO: XXX handle BIP68 check lock time verify rules
-            }
-            
-            if (isPending) {
-                LWSetAdd(wallet->pendingTx, tx);
-                array_add(wallet->balanceHist, balance);
-                continue;
-            }
+        if (undo.status == TX_STATUS_PENDING) {
+            LWSetAdd(wallet->pendingTx, tx);
+            if (isLocked && n < wallet->lockedIndex) wallet->lockedIndex = n; // must be rechecked as time passes
+            array_add(wallet->balanceUndo, undo);
+            array_add(wallet->balanceHist, balance);
+            return;
+        }
+    }
+
+    // remove outputs spent by tx, or by pending txs since the last valid tx, from the UTXO set
+    for (i = n; i > 0 && wallet->balanceUndo[i - 1].status != TX_STATUS_VALID; i--) {
+        if (wallet->balanceUndo[i - 1].status != TX_STATUS_PENDING) continue;
+
+        for (j = 0; j < wallet->balanceUndo[i - 1].tx->inCount; j++) {
+            balance -= _LWWalletSpendUTXO(wallet, &undo, &wallet->balanceUndo[i - 1].tx->inputs[j]);
+        }
+    }
+
+    for (j = 0; j < tx->inCount; j++) {
+        balance -= _LWWalletSpendUTXO(wallet, &undo, &tx->inputs[j]);
+    }
+
+    // add outputs to UTXO set, unless they were already spent by a previous tx
+    // TODO: don't add outputs below TX_MIN_OUTPUT_AMOUNT
+    // TODO: don't add coin generation outputs < 100 blocks deep
+    // NOTE: balance/UTXOs will then need to be recalculated when last block changes
+    for (j = 0; j < tx->outCount; j++) {
+        if (tx->outputs[j].address.type == SCRIPT_HASH_NONE) continue;
+
+        if (! LWSetContains(wallet->usedAddrs, &tx->outputs[j].address)) {
+            LWSetAdd(wallet->usedAddrs, &tx->outputs[j].address);
+            undo.added[tx->inCount + j] = 1;
+        }
+
+        if (LWSetContains(wallet->allAddrs, &tx->outputs[j].address) &&
+            ! LWSetContains(wallet->spentOutputs, &((LWUTXO) { tx->txHash, (uint32_t)j }))) {
+            _LWWalletAddUTXO(wallet, ((LWUTXO) { tx->txHash, (uint32_t)j }));
+            balance += tx->outputs[j].amount;
+            undo.utxosAdded++;
+        }
+    }
+
+    if (wallet->balance < balance) wallet->totalReceived += balance - wallet->balance;
+    if (balance < wallet->balance) wallet->totalSent += wallet->balance - balance;
+    wallet->balance = balance;
+    array_add(wallet->balanceUndo, undo);
+    array_add(wallet->balanceHist, balance);
+}
+
+// reverts the last tx applied to the wallet balance state
+static void _LWWalletUndoTx(LWWallet *wallet)
+{
+    LWBalanceUndo *undo = &wallet->balanceUndo[array_count(wallet->balanceUndo) - 1];
+    LWTransaction *tx = undo->tx;
+    size_t j;
+
+    if (undo->status == TX_STATUS_INVALID) LWSetRemove(wallet->invalidTx, tx);
+    if (undo->status == TX_STATUS_PENDING) LWSetRemove(wallet->pendingTx, tx);
+
+    if (undo->status == TX_STATUS_VALID) {
+        for (j = undo->utxosAdded; j > 0; j--) _LWWalletRemoveUTXO(wallet, array_count(wallet->utxos) - 1);
+
+        for (j = undo->removedCount; j > 0; j--) {
+            _LWWalletRestoreUTXO(wallet, undo->removed[j - 1].index, undo->removed[j - 1].utxo);
         }
 
-        // add outputs to UTXO set
-        // TODO: don't add outputs below TX_MIN_OUTPUT_AMOUNT
-        // TODO: don't add coin generation outputs < 100 blocks deep
-        // NOTE: balance/UTXOs will then need to be recalculated when last block changes
         for (j = 0; j < tx->outCount; j++) {
-            if (tx->outputs[j].address[0] != '\0') {
-                LWSetAdd(wallet->usedAddrs, tx->outputs[j].address);
-                
-                if (LWSetContains(wallet->allAddrs, tx->outputs[j].address)) {
-                    array_add(wallet->utxos, ((LWUTXO) { tx->txHash, (uint32_t)j }));
-                    balance += tx->outputs[j].amount;
-                }
+            if (undo->added[tx->inCount + j]) LWSetRemove(wallet->usedAddrs, &tx->outputs[j].address);
+        }
+    }
+
+    for (j = 0; undo->added && j < tx->inCount; j++) {
+        if (undo->added[j]) LWSetRemove(wallet->spentOutputs, &tx->inputs[j]);
+    }
+
+    wallet->totalSent = undo->totalSent;
+    wallet->totalReceived = undo->totalReceived;
+    if (undo->removed) free(undo->removed);
+    array_rm_last(wallet->balanceUndo);
+    array_rm_last(wallet->balanceHist);
+    wallet->balance = (array_count(wallet->balanceHist) > 0) ?
+                      wallet->balanceHist[array_count(wallet->balanceHist) - 1] : 0;
+}
+
+// updates the wallet balance state after wallet->transactions changed at or after index i, by undoing txs back to i
+// and re-applying only the txs that follow, this gives the same result as replaying every tx from the beginning
+static void _LWWalletUpdateBalance(LWWallet *wallet, size_t i)
+{
+    time_t now = time(NULL);
+    size_t j, k;
+    LWSet *addrs;
+
+    // txs that were pending due to lockTime must be rechecked against the current block height and time
+    if (wallet->lockedIndex < i) i = wallet->lockedIndex;
+
+    // outputs to newly generated addresses must be added to the UTXO set
+    if (wallet->balanceInternal < array_count(wallet->internalChain) ||
+        wallet->balanceExternal < array_count(wallet->externalChain)) {
+        addrs = LWSetNew(LWScriptHashHash, LWScriptHashEq, 100);
+
+        for (j = wallet->balanceInternal; j < array_count(wallet->internalHashes); j++) {
+            LWSetAdd(addrs, &wallet->internalHashes[j]);
+        }
+
+        for (j = wallet->balanceExternal; j < array_count(wallet->externalHashes); j++) {
+            LWSetAdd(addrs, &wallet->externalHashes[j]);
+        }
+
+        for (j = 0; j < i && j < array_count(wallet->balanceUndo); j++) {
+            for (k = 0; k < wallet->balanceUndo[j].tx->outCount; k++) {
+                if (LWSetContains(addrs, &wallet->balanceUndo[j].tx->outputs[k].address)) break;
             }
+
+            if (k < wallet->balanceUndo[j].tx->outCount) i = j;
         }
 
-        // transaction ordering is not guaranteed, so check the entire UTXO set against the entire spent output set
-        for (j = array_count(wallet->utxos); j > 0; j--) {
-            if (! LWSetContains(wallet->spentOutputs, &wallet->utxos[j - 1])) continue;
-            t = LWSetGet(wallet->allTx, &wallet->utxos[j - 1].hash);
-            balance -= t->outputs[wallet->utxos[j - 1].n].amount;
-            array_rm(wallet->utxos, j - 1);
+        LWSetFree(addrs);
+        wallet->balanceInternal = array_count(wallet->internalChain);
+        wallet->balanceExternal = array_count(wallet->externalChain);
+    }
+
+    if (i < wallet->balanceBase) { // txs loaded from a saved wallet state can't be undone, so rebuild from the start
+        for (j = array_count(wallet->balanceUndo); j > 0; j--) {
+            if (wallet->balanceUndo[j - 1].removed) free(wallet->balanceUndo[j - 1].removed);
         }
-        
-        if (prevBalance < balance) wallet->totalReceived += balance - prevBalance;
-        if (balance < prevBalance) wallet->totalSent += prevBalance - balance;
-        array_add(wallet->balanceHist, balance);
-        prevBalance = balance;
+
+        array_clear(wallet->balanceUndo);
+        array_clear(wallet->balanceHist);
+        array_clear(wallet->utxos);
+        LWSetClear(wallet->utxoSet);
+        LWSetClear(wallet->spentOutputs);
+        LWSetClear(wallet->invalidTx);
+        LWSetClear(wallet->pendingTx);
+        LWSetClear(wallet->usedAddrs);
+        wallet->balance = wallet->totalSent = wallet->totalReceived = 0;
+        wallet->balanceBase = 0;
+        i = 0;
     }
 
+    while (array_count(wallet->balanceUndo) > i) _LWWalletUndoTx(wallet);
+    if (wallet->lockedIndex >= i) wallet->lockedIndex = SIZE_MAX;
+
+    while (array_count(wallet->balanceUndo) < array_count(wallet->transactions)) _LWWalletApplyTx(wallet, now);
     assert(array_count(wallet->balanceHist) == array_count(wallet->transactions));
-    wallet->balance = balance;
 }
 
 // allocates and populates a LWWallet struct which must be freed by calling LWWalletFree()
 LWWallet *LWWalletNew(LWTransaction *transactions[], size_t txCount, LWMasterPubKey mpk)
+{
+    return LWWalletNewWithState(transactions, txCount, mpk, NULL, 0);
+}
+
+// appends the next n addresses of the chain derived from chainKey to addrChain and hashChain, as a single batch
+// returns the number of addresses appended, which is less than n if derivation failed
+static size_t _LWWalletDeriveAddrs(LWAddress **addrChain, LWScriptHash **hashChain, LWMasterPubKey chainKey, size_t n)
+{
+    LWECPoint *pubKeys;
+    size_t k;
+
+    if (n == 0) return 0;
+    pubKeys = malloc(n*sizeof(*pubKeys));
+    assert(pubKeys != NULL);
+    if (LWBIP32ChildPubKeyList(pubKeys, n, chainKey, (uint32_t)array_count(*addrChain)) != n) n = 0;
+
+    for (k = 0; k < n; k++) {
+        LWScriptHash sh = { SCRIPT_HASH_PUBKEY, 0, 20, { 0 } };
+        LWAddress address = LW_ADDRESS_NONE;
+
+        LWHash160(sh.hash, pubKeys[k].p, sizeof(pubKeys[k].p));
+        if (! LWScriptHashAddress(address.s, sizeof(address), &sh)) break;
+        array_add(*addrChain, address);
+        array_add(*hashChain, sh);
+    }
+
+    free(pubKeys);
+    return k;
+}
+
+// serializes the derived wallet state (address chain lengths, tx order, UTXOs and balance history) so a later
+// LWWalletNewWithState() can skip sorting and balance replay, and derive the address chains in one batch each
+// returns number of bytes written to buf, or total bufLen needed if buf is NULL
+size_t LWWalletSerializeState(LWWallet *wallet, uint8_t *buf, size_t bufLen)
+{
+    size_t i, off = 0, len, txCount;
+    UInt256 md;
+    LWTransaction *tx;
+
+    assert(wallet != NULL);
+    pthread_mutex_lock(&wallet->lock);
+    txCount = array_count(wallet->transactions);
+    len = sizeof(uint32_t) + sizeof(uint32_t) + sizeof(UInt256) + sizeof(wallet->masterPubKey.pubKey) +
+          sizeof(uint32_t) + txCount*(sizeof(UInt256) + sizeof(uint32_t) + 1) + sizeof(uint32_t) +
+          3*sizeof(uint64_t) + txCount*sizeof(uint64_t) + sizeof(uint32_t) +
+          array_count(wallet->utxos)*(sizeof(UInt256) + sizeof(uint32_t)) +
+          sizeof(uint32_t) + sizeof(uint32_t) + sizeof(uint32_t);
+
+    if (buf && len <= bufLen) {
+        UInt32SetLE(&buf[off], WALLET_STATE_VERSION);
+        off += sizeof(uint32_t);
+        UInt32SetLE(&buf[off], wallet->masterPubKey.fingerPrint);
+        off += sizeof(uint32_t);
+        UInt256Set(&buf[off], wallet->masterPubKey.chainCode);
+        off += sizeof(UInt256);
+        memcpy(&buf[off], wallet->masterPubKey.pubKey, sizeof(wallet->masterPubKey.pubKey));
+        off += sizeof(wallet->masterPubKey.pubKey);
+        UInt32SetLE(&buf[off], (uint32_t)txCount);
+        off += sizeof(uint32_t);
+
+        for (i = 0; i < txCount; i++) {
+            tx = wallet->transactions[i];
+            UInt256Set(&buf[off], tx->txHash);
+            off += sizeof(UInt256);
+            UInt32SetLE(&buf[off], tx->blockHeight);
+            off += sizeof(uint32_t);
+            buf[off++] = (LWSetContains(wallet->invalidTx, tx)) ? TX_STATUS_INVALID :
+                         (LWSetContains(wallet->pendingTx, tx)) ? TX_STATUS_PENDING : TX_STATUS_VALID;
+        }
+
+        UInt32SetLE(&buf[off], (wallet->lockedIndex < txCount) ? (uint32_t)wallet->lockedIndex : UINT32_MAX);
+        off += sizeof(uint32_t);
+        UInt64SetLE(&buf[off], wallet->balance);
+        off += sizeof(uint64_t);
+        UInt64SetLE(&buf[off], wallet->totalSent);
+        off += sizeof(uint64_t);
+        UInt64SetLE(&buf[off], wallet->totalReceived);
+        off += sizeof(uint64_t);
+
+        for (i = 0; i < txCount; i++) {
+            UInt64SetLE(&buf[off], wallet->balanceHist[i]);
+            off += sizeof(uint64_t);
+        }
+
+        UInt32SetLE(&buf[off], (uint32_t)array_count(wallet->utxos));
+        off += sizeof(uint32_t);
+
+        for (i = 0; i < array_count(wallet->utxos); i++) {
+            UInt256Set(&buf[off], wallet->utxos[i].hash);
+            off += sizeof(UInt256);
+            UInt32SetLE(&buf[off], wallet->utxos[i].n);
+            off += sizeof(uint32_t);
+        }
+
+        UInt32SetLE(&buf[off], (uint32_t)array_count(wallet->internalChain));
+        off += sizeof(uint32_t);
+        UInt32SetLE(&buf[off], (uint32_t)array_count(wallet->externalChain));
+        off += sizeof(uint32_t);
+        LWSHA256_2(&md, buf, off);
+        memcpy(&buf[off], &md, sizeof(uint32_t)); // checksum
+    }
+
+    pthread_mutex_unlock(&wallet->lock);
+    return (! buf || len <= bufLen) ? len : 0;
+}
+
+// puts wallet->transactions in saved order, and loads the rest of the derived wallet state, returns
+// true on success, or false if state is corrupt, from another wallet version, or doesn't match the wallet's txs
+static int _LWWalletLoadState(LWWallet *wallet, const uint8_t *state, size_t stateLen)
+{
+    size_t i, off = 0, len, txCount, utxoCount, lockedIndex, internalCount, externalCount;
+    LWTransaction **txs = NULL, *tx;
+    uint64_t *hist = NULL, balance, totalSent, totalReceived;
+    uint8_t *status = NULL;
+    LWUTXO *utxos = NULL;
+    LWAddress *internalChain = NULL, *externalChain = NULL;
+    LWScriptHash *internalHashes = NULL, *externalHashes = NULL;
+    LWBalanceUndo undo;
+    LWSet *seen;
+    UInt256 md, hash;
+    int r = 1;
+
+    len = sizeof(uint32_t) + sizeof(uint32_t) + sizeof(UInt256) + sizeof(wallet->masterPubKey.pubKey) +
+          sizeof(uint32_t);
+    if (! state || stateLen < len + sizeof(uint32_t)) return 0;
+    LWSHA256_2(&md, state, stateLen - sizeof(uint32_t));
+    if (memcmp(&md, &state[stateLen - sizeof(uint32_t)], sizeof(uint32_t)) != 0) return 0; // verify checksum
+    stateLen -= sizeof(uint32_t);
+
+    if (UInt32GetLE(&state[off]) != WALLET_STATE_VERSION) return 0;
+    off += sizeof(uint32_t);
+    if (UInt32GetLE(&state[off]) != wallet->masterPubKey.fingerPrint) return 0;
+    off += sizeof(uint32_t);
+    if (! UInt256Eq(UInt256Get(&state[off]), wallet->masterPubKey.chainCode)) return 0;
+    off += sizeof(UInt256);
+    if (memcmp(&state[off], wallet->masterPubKey.pubKey, sizeof(wallet->masterPubKey.pubKey)) != 0) return 0;
+    off += sizeof(wallet->masterPubKey.pubKey);
+    txCount = UInt32GetLE(&state[off]);
+    off += sizeof(uint32_t);
+
+    // every tx given to the wallet must appear in state once, in the same block as when the state was saved
+    if (txCount != array_count(wallet->transactions) ||
+        txCount > (stateLen - off)/(sizeof(UInt256) + sizeof(uint32_t) + 1 + sizeof(uint64_t))) return 0;
+    array_new(txs, txCount);
+    array_new(status, txCount);
+    array_new(hist, txCount);
+
+    seen = LWSetNew(LWTransactionHash, LWTransactionEq, txCount);
+
+    for (i = 0; r && i < txCount; i++) {
+        hash = UInt256Get(&state[off]);
+        off += sizeof(UInt256);
+        tx = LWSetGet(wallet->allTx, &hash);
+        if (! tx || LWSetContains(seen, tx) || tx->blockHeight != UInt32GetLE(&state[off])) r = 0;
+        off += sizeof(uint32_t);
+        if (state[off] > TX_STATUS_PENDING) r = 0;
+        array_add(status, state[off++]);
+        array_add(txs, tx);
+        if (tx) LWSetAdd(seen, tx);
+    }
+
+    LWSetFree(seen);
+    len = sizeof(uint32_t) + 3*sizeof(uint64_t) + txCount*sizeof(uint64_t) + sizeof(uint32_t);
+    if (r && off + len > stateLen) r = 0;
+
+    if (r) {
+        lockedIndex = UInt32GetLE(&state[off]);
+        off += sizeof(uint32_t);
+        balance = UInt64GetLE(&state[off]);
+        off += sizeof(uint64_t);
+        totalSent = UInt64GetLE(&state[off]);
+        off += sizeof(uint64_t);
+        totalReceived = UInt64GetLE(&state[off]);
+        off += sizeof(uint64_t);
+
+        for (i = 0; i < txCount; i++) {
+            array_add(hist, UInt64GetLE(&state[off]));
+            off += sizeof(uint64_t);
+        }
+
+        utxoCount = UInt32GetLE(&state[off]);
+        off += sizeof(uint32_t);
+        if (utxoCount > (stateLen - off)/(sizeof(UInt256) + sizeof(uint32_t))) r = 0;
+        if (r && off + utxoCount*(sizeof(UInt256) + sizeof(uint32_t)) + 2*sizeof(uint32_t) != stateLen) r = 0;
+    }
+
+    if (r) {
+        array_new(utxos, utxoCount);
+
+        for (i = 0; i < utxoCount; i++) {
+            array_add(utxos, ((LWUTXO) { UInt256Get(&state[off]), UInt32GetLE(&state[off + sizeof(UInt256)]) }));
+            off += sizeof(UInt256) + sizeof(uint32_t);
+        }
+
+        // only the chain lengths are saved, the addresses are derived again from the wallet's own chain keys
+        internalCount = UInt32GetLE(&state[off]);
+        off += sizeof(uint32_t);
+        externalCount = UInt32GetLE(&state[off]);
+        off += sizeof(uint32_t);
+        if (internalCount >= BIP32_HARD || externalCount >= BIP32_HARD) internalCount = externalCount = 0, r = 0;
+        array_new(internalChain, internalCount);
+        array_new(externalChain, externalCount);
+        array_new(internalHashes, internalCount);
+        array_new(externalHashes, externalCount);
+        if (r && _LWWalletDeriveAddrs(&internalChain, &internalHashes, wallet->internalChainKey, internalCount) !=
+            internalCount) r = 0;
+        if (r && _LWWalletDeriveAddrs(&externalChain, &externalHashes, wallet->externalChainKey, externalCount) !=
+            externalCount) r = 0;
+    }
+
+    if (r) {
+        array_free(wallet->internalChain);
+        array_free(wallet->externalChain);
+        array_free(wallet->internalHashes);
+        array_free(wallet->externalHashes);
+        wallet->internalChain = internalChain;
+        wallet->externalChain = externalChain;
+        wallet->internalHashes = internalHashes;
+        wallet->externalHashes = externalHashes;
+        LWSetClear(wallet->allAddrs);
+        for (i = 0; i < array_count(internalHashes); i++) LWSetAdd(wallet->allAddrs, &internalHashes[i]);
+        for (i = 0; i < array_count(externalHashes); i++) LWSetAdd(wallet->allAddrs, &externalHashes[i]);
+        internalChain = externalChain = NULL;
+        internalHashes = externalHashes = NULL;
+        wallet->balanceInternal = array_count(wallet->internalChain);
+        wallet->balanceExternal = array_count(wallet->externalChain);
+        array_clear(wallet->transactions);
+        array_add_array(wallet->transactions, txs, txCount);
+        array_add_array(wallet->balanceHist, hist, txCount);
+        array_add_array(wallet->utxos, utxos, utxoCount);
+        _LWWalletIndexUTXOs(wallet);
+        wallet->balance = balance;
+        wallet->totalSent = totalSent;
+        wallet->totalReceived = totalReceived;
+        wallet->lockedIndex = (lockedIndex < txCount) ? lockedIndex : SIZE_MAX;
+        wallet->balanceBase = txCount;
+        LWSetClear(wallet->usedAddrs);
+
+        // rebuild the spent output, invalid, pending and used address sets, with journal entries that have no undo data
+        for (i = 0; i < txCount; i++) {
+            tx = txs[i];
+            undo = (LWBalanceUndo) { tx, 0, 0, status[i], 0, 0, NULL, NULL };
+            array_add(wallet->balanceUndo, undo);
+
+            // status of an unconfirmed tx with a lockTime block height depends on the wallet blockHeight at the time
+            for (size_t j = 0; tx->blockHeight == TX_UNCONFIRMED && j < tx->inCount; j++) {
+                if (tx->inputs[j].sequence == UINT32_MAX || tx->lockTime >= TX_MAX_LOCK_HEIGHT ||
+                    tx->lockTime <= wallet->blockHeight + 1) continue;
+                if (i < wallet->lockedIndex) wallet->lockedIndex = i;
+                break;
+            }
+
+            if (status[i] == TX_STATUS_INVALID) LWSetAdd(wallet->invalidTx, tx);
+            if (status[i] == TX_STATUS_PENDING) LWSetAdd(wallet->pendingTx, tx);
+            if (status[i] == TX_STATUS_INVALID) continue;
+
+            for (size_t j = 0; j < tx->inCount; j++) {
+                if (LWSetContains(wallet->spentOutputs, &tx->inputs[j])) continue;
+                LWSetAdd(wallet->spentOutputs, &tx->inputs[j]);
+            }
+
+            for (size_t j = 0; status[i] == TX_STATUS_VALID && j < tx->outCount; j++) {
+                if (tx->outputs[j].address.type == SCRIPT_HASH_NONE) continue;
+                LWSetAdd(wallet->usedAddrs, &tx->outputs[j].address);
+            }
+        }
+    }
+
+    if (txs) array_free(txs);
+    if (status) array_free(status);
+    if (hist) array_free(hist);
+    if (utxos) array_free(utxos);
+    if (internalChain) array_free(internalChain);
+    if (externalChain) array_free(externalChain);
+    if (internalHashes) array_free(internalHashes);
+    if (externalHashes) array_free(externalHashes);
+    return r;
+}
+
+// allocates and populates a LWWallet struct which must be freed by calling LWWalletFree()
+// state is optional wallet state from LWWalletSerializeState(), used instead of rebuilding it when it matches the
+// wallet master pubKey and transactions
+LWWallet *LWWalletNewWithState(LWTransaction *transactions[], size_t txCount, LWMasterPubKey mpk,
+                               const uint8_t *state, size_t stateLen)
 {
     LWWallet *wallet = NULL;
     LWTransaction *tx;
+    int loaded;
 
     assert(transactions != NULL || txCount == 0);
+    assert(state != NULL || stateLen == 0);
     wallet = calloc(1, sizeof(*wallet));
     assert(wallet != NULL);
     array_new(wallet->utxos, 100);
     array_new(wallet->transactions, txCount + 100);
     wallet->feePerKb = DEFAULT_FEE_PER_KB;
     wallet->masterPubKey = mpk;
+    wallet->internalChainKey = LWBIP32ChainPubKey(mpk, SEQUENCE_INTERNAL_CHAIN);
+    wallet->externalChainKey = LWBIP32ChainPubKey(mpk, SEQUENCE_EXTERNAL_CHAIN);
     array_new(wallet->internalChain, 100);
     array_new(wallet->externalChain, 100);
+    array_new(wallet->internalHashes, 100);
+    array_new(wallet->externalHashes, 100);
     array_new(wallet->balanceHist, txCount + 100);
+    array_new(wallet->balanceUndo, txCount + 100);
+    wallet->lockedIndex = SIZE_MAX;
     wallet->allTx = LWSetNew(LWTransactionHash, LWTransactionEq, txCount + 100);
     wallet->invalidTx = LWSetNew(LWTransactionHash, LWTransactionEq, 10);
     wallet->pendingTx = LWSetNew(LWTransactionHash, LWTransactionEq, 10);
+    wallet->utxoSet = LWSetNew(LWUTXOHash, LWUTXOEq, txCount + 100);
     wallet->spentOutputs = LWSetNew(LWUTXOHash, LWUTXOEq, txCount + 100);
-    wallet->usedAddrs = LWSetNew(LWAddressHash, LWAddressEq, txCount + 100);
-    wallet->allAddrs = LWSetNew(LWAddressHash, LWAddressEq, txCount + 100);
+    wallet->usedAddrs = LWSetNew(LWScriptHashHash, LWScriptHashEq, txCount + 100);
+    wallet->allAddrs = LWSetNew(LWScriptHashHash, LWScriptHashEq, txCount + 100);
     pthread_mutex_init(&wallet->lock, NULL);
 
     for (size_t i = 0; transactions && i < txCount; i++) {
         tx = transactions[i];
         if (! LWTransactionIsSigned(tx) || LWSetContains(wallet->allTx, tx)) continue;
         LWSetAdd(wallet->allTx, tx);
-        _LWWalletInsertTx(wallet, tx);
+        array_add(wallet->transactions, tx);
 
         for (size_t j = 0; j < tx->outCount; j++) {
-            if (tx->outputs[j].address[0] != '\0') LWSetAdd(wallet->usedAddrs, tx->outputs[j].address);
+            if (tx->outputs[j].address.type != SCRIPT_HASH_NONE) LWSetAdd(wallet->usedAddrs, &tx->outputs[j].address);
         }
     }
-    
+
+    loaded = _LWWalletLoadState(wallet, state, stateLen);
+    if (! loaded) _LWWalletSortTxs(wallet);
+
     LWWalletUnusedAddrs(wallet, NULL, SEQUENCE_GAP_LIMIT_EXTERNAL, 0);
     LWWalletUnusedAddrs(wallet, NULL, SEQUENCE_GAP_LIMIT_INTERNAL, 1);
-    _LWWalletUpdateBalance(wallet);
+
+    if (! loaded) {
+        LWSetClear(wallet->usedAddrs); // rebuilt from valid txs below
+        _LWWalletUpdateBalance(wallet, 0);
+    }
+    else if (wallet->lockedIndex != SIZE_MAX) _LWWalletUpdateBalance(wallet, 0); // recheck lockTime of pending txs
 
     if (txCount > 0 && ! _LWWalletContainsTx(wallet, transactions[0])) { // verify transactions match master pubKey
         LWWalletFree(wallet);
@@ -294,63 +844,64 @@ void LWWalletSetCallbacks(LWWallet *wallet, void *info,
     wallet->txDeleted = txDeleted;
 }
 
-// wallets are composed of chains of addresses
-// each chain is traversed until a gap of a number of addresses is found that haven't been used in any transactions
-// this function writes to addrs an array of <gapLimit> unused addresses following the last used address in the chain
-// the internal chain is used for change addresses and the external chain for receive addresses
-// addrs may be NULL to only generate addresses for LWWalletContainsAddress()
-// returns the number addresses written to addrs
-size_t LWWalletUnusedAddrs(LWWallet *wallet, LWAddress addrs[], uint32_t gapLimit, int internal)
+// extends the address chain to <gapLimit> unused addresses, and writes them to addrs and/or hashes if not NULL
+// returns the number of addresses written
+static size_t _LWWalletUnusedAddrs(LWWallet *wallet, LWAddress addrs[], LWScriptHash hashes[], uint32_t gapLimit,
+                                   int internal)
 {
     LWAddress *addrChain;
+    LWScriptHash *hashChain;
+    LWMasterPubKey chainKey;
     size_t i, j = 0, count, startCount;
-    uint32_t chain = (internal) ? SEQUENCE_INTERNAL_CHAIN : SEQUENCE_EXTERNAL_CHAIN;
 
     assert(wallet != NULL);
     assert(gapLimit > 0);
     pthread_mutex_lock(&wallet->lock);
     addrChain = (internal) ? wallet->internalChain : wallet->externalChain;
+    hashChain = (internal) ? wallet->internalHashes : wallet->externalHashes;
+    chainKey = (internal) ? wallet->internalChainKey : wallet->externalChainKey;
     i = count = startCount = array_count(addrChain);
     
     // keep only the trailing contiguous block of addresses with no transactions
-    while (i > 0 && ! LWSetContains(wallet->usedAddrs, &addrChain[i - 1])) i--;
+    while (i > 0 && ! LWSetContains(wallet->usedAddrs, &hashChain[i - 1])) i--;
     
-    while (i + gapLimit > count) { // generate new addresses up to gapLimit
-        LWKey key;
-        LWAddress address = LW_ADDRESS_NONE;
-        uint8_t pubKey[LWBIP32PubKey(NULL, 0, wallet->masterPubKey, chain, count)];
-        size_t len = LWBIP32PubKey(pubKey, sizeof(pubKey), wallet->masterPubKey, chain, (uint32_t)count);
-        
-        if (! LWKeySetPubKey(&key, pubKey, len)) break;
-        if (! LWKeyAddress(&key, address.s, sizeof(address)) || LWAddressEq(&address, &LW_ADDRESS_NONE)) break;
-        array_add(addrChain, address);
-        count++;
-        if (LWSetContains(wallet->usedAddrs, &address)) i = count;
+    while (i + gapLimit > count) { // generate new addresses up to gapLimit, deriving each missing run as a batch
+        size_t n = i + gapLimit - count, k = _LWWalletDeriveAddrs(&addrChain, &hashChain, chainKey, n);
+
+        for (size_t end = count + k; count < end;) {
+            if (LWSetContains(wallet->usedAddrs, &hashChain[count++])) i = count;
+        }
+
+        if (k < n) break;
     }
 
-    if (addrs && i + gapLimit <= count) {
+    if ((addrs || hashes) && i + gapLimit <= count) {
         for (j = 0; j < gapLimit; j++) {
-            addrs[j] = addrChain[i + j];
+            if (addrs) addrs[j] = addrChain[i + j];
+            if (hashes) hashes[j] = hashChain[i + j];
         }
     }
     
-    // was addrChain moved to a new memory location?
-    if (addrChain == (internal ? wallet->internalChain : wallet->externalChain)) {
+    if (internal) wallet->internalChain = addrChain;
+    if (! internal) wallet->externalChain = addrChain;
+
+    // was hashChain moved to a new memory location?
+    if (hashChain == (internal ? wallet->internalHashes : wallet->externalHashes)) {
         for (i = startCount; i < count; i++) {
-            LWSetAdd(wallet->allAddrs, &addrChain[i]);
+            LWSetAdd(wallet->allAddrs, &hashChain[i]);
         }
     }
     else {
-        if (internal) wallet->internalChain = addrChain;
-        if (! internal) wallet->externalChain = addrChain;
+        if (internal) wallet->internalHashes = hashChain;
+        if (! internal) wallet->externalHashes = hashChain;
         LWSetClear(wallet->allAddrs); // clear and rebuild allAddrs
 
-        for (i = array_count(wallet->internalChain); i > 0; i--) {
-            LWSetAdd(wallet->allAddrs, &wallet->internalChain[i - 1]);
+        for (i = array_count(wallet->internalHashes); i > 0; i--) {
+            LWSetAdd(wallet->allAddrs, &wallet->internalHashes[i - 1]);
         }
         
-        for (i = array_count(wallet->externalChain); i > 0; i--) {
-            LWSetAdd(wallet->allAddrs, &wallet->externalChain[i - 1]);
+        for (i = array_count(wallet->externalHashes); i > 0; i--) {
+            LWSetAdd(wallet->allAddrs, &wallet->externalHashes[i - 1]);
         }
     }
 
@@ -358,6 +909,23 @@ size_t LWWalletUnusedAddrs(LWWallet *wallet, LWAddress addrs[], uint32_t gapLimi
     return j;
 }
 
+// wallets are composed of chains of addresses
+// each chain is traversed until a gap of a number of addresses is found that haven't been used in any transactions
+// this function writes to addrs an array of <gapLimit> unused addresses following the last used address in the chain
+// the internal chain is used for change addresses and the external chain for receive addresses
+// addrs may be NULL to only generate addresses for LWWalletContainsAddress()
+// returns the number addresses written to addrs
+size_t LWWalletUnusedAddrs(LWWallet *wallet, LWAddress addrs[], uint32_t gapLimit, int internal)
+{
+    return _LWWalletUnusedAddrs(wallet, addrs, NULL, gapLimit, internal);
+}
+
+// same as LWWalletUnusedAddrs(), but writes the addresses in binary form to hashes
+size_t LWWalletUnusedScriptHashes(LWWallet *wallet, LWScriptHash hashes[], uint32_t gapLimit, int internal)
+{
+    return _LWWalletUnusedAddrs(wallet, NULL, hashes, gapLimit, internal);
+}
+
 // current wallet balance, not including transactions known to be invalid
 uint64_t LWWalletBalance(LWWallet *wallet)
 {
@@ -501,28 +1069,107 @@ size_t LWWalletAllAddrs(LWWallet *wallet, LWAddress addrs[], size_t addrsCount)
     return internalCount + externalCount;
 }
 
+// same as LWWalletAllAddrs(), but writes the addresses in binary form to hashes
+size_t LWWalletAllScriptHashes(LWWallet *wallet, LWScriptHash hashes[], size_t hashesCount)
+{
+    size_t i, internalCount = 0, externalCount = 0;
+    
+    assert(wallet != NULL);
+    pthread_mutex_lock(&wallet->lock);
+    internalCount = (! hashes || array_count(wallet->internalHashes) < hashesCount) ?
+                    array_count(wallet->internalHashes) : hashesCount;
+
+    for (i = 0; hashes && i < internalCount; i++) {
+        hashes[i] = wallet->internalHashes[i];
+    }
+
+    externalCount = (! hashes || array_count(wallet->externalHashes) < hashesCount - internalCount) ?
+                    array_count(wallet->externalHashes) : hashesCount - internalCount;
+
+    for (i = 0; hashes && i < externalCount; i++) {
+        hashes[internalCount + i] = wallet->externalHashes[i];
+    }
+
+    pthread_mutex_unlock(&wallet->lock);
+    return internalCount + externalCount;
+}
+
 // true if the address was previously generated by LWWalletUnusedAddrs() (even if it's now used)
 int LWWalletContainsAddress(LWWallet *wallet, const char *addr)
 {
+    LWScriptHash sh;
     int r = 0;
 
     assert(wallet != NULL);
     assert(addr != NULL);
+    if (! addr || ! LWScriptHashFromAddress(&sh, addr)) return 0;
+    pthread_mutex_lock(&wallet->lock);
+    r = LWSetContains(wallet->allAddrs, &sh);
+    pthread_mutex_unlock(&wallet->lock);
+    return r;
+}
+
+// looks up sh in allAddrs, which maps each address to its chain and index by pointing into the chain hash arrays
+// returns true if sh was found, writing its chain and index
+static int _LWWalletScriptHashIndex(LWWallet *wallet, const LWScriptHash *sh, uint32_t *chain, uint32_t *index)
+{
+    const LWScriptHash *h = LWSetGet(wallet->allAddrs, sh);
+
+    if (! h) return 0;
+
+    if (h >= wallet->internalHashes && h < wallet->internalHashes + array_count(wallet->internalHashes)) {
+        *chain = SEQUENCE_INTERNAL_CHAIN;
+        *index = (uint32_t)(h - wallet->internalHashes);
+    }
+    else {
+        *chain = SEQUENCE_EXTERNAL_CHAIN;
+        *index = (uint32_t)(h - wallet->externalHashes);
+    }
+
+    return 1;
+}
+
+// true if the address in binary form was previously generated by LWWalletUnusedAddrs() (even if it's now used)
+int LWWalletContainsScriptHash(LWWallet *wallet, const LWScriptHash *sh)
+{
+    int r = 0;
+
+    assert(wallet != NULL);
+    assert(sh != NULL);
     pthread_mutex_lock(&wallet->lock);
-    if (addr) r = LWSetContains(wallet->allAddrs, addr);
+    if (sh) r = LWSetContains(wallet->allAddrs, sh);
     pthread_mutex_unlock(&wallet->lock);
     return r;
 }
 
+// writes the chain (SEQUENCE_EXTERNAL_CHAIN or SEQUENCE_INTERNAL_CHAIN) and index the wallet derived sh at
+// returns true if sh was previously generated by LWWalletUnusedAddrs()
+int LWWalletScriptHashIndex(LWWallet *wallet, const LWScriptHash *sh, uint32_t *chain, uint32_t *index)
+{
+    uint32_t c = 0, n = 0;
+    int r = 0;
+
+    assert(wallet != NULL);
+    assert(sh != NULL);
+    pthread_mutex_lock(&wallet->lock);
+    if (sh) r = _LWWalletScriptHashIndex(wallet, sh, &c, &n);
+    pthread_mutex_unlock(&wallet->lock);
+    if (r && chain) *chain = c;
+    if (r && index) *index = n;
+    return r;
+}
+
 // true if the address was previously used as an output in any wallet transaction
 int LWWalletAddressIsUsed(LWWallet *wallet, const char *addr)
 {
+    LWScriptHash sh;
     int r = 0;
 
     assert(wallet != NULL);
     assert(addr != NULL);
+    if (! addr || ! LWScriptHashFromAddress(&sh, addr)) return 0;
     pthread_mutex_lock(&wallet->lock);
-    if (addr) r = LWSetContains(wallet->usedAddrs, addr);
+    r = LWSetContains(wallet->usedAddrs, &sh);
     pthread_mutex_unlock(&wallet->lock);
     return r;
 }
@@ -541,15 +1188,97 @@ LWTransaction *LWWalletCreateTransaction(LWWallet *wallet, uint64_t amount, cons
     return LWWalletCreateTxForOutputs(wallet, &o, 1);
 }
 
+#define COIN_SELECTION_MAX_TRIES 100000 // limit on branch-and-bound search steps
+
+typedef struct {
+    LWUTXO utxo;
+    LWTransaction *tx;
+    uint64_t amount;
+    size_t pos; // position in wallet->utxos, keeps the ordering of equal amounts stable
+} LWCoin;
+
+// orders coins by descending amount
+static int _LWCoinCompare(const void *a, const void *b)
+{
+    const LWCoin *c1 = a, *c2 = b;
+
+    if (c1->amount != c2->amount) return (c1->amount > c2->amount) ? -1 : 1;
+    return (c1->pos < c2->pos) ? -1 : (c1->pos > c2->pos);
+}
+
+// estimated size of a transaction with outputs of outSize bytes, inCount inputs, and optionally a change output
+inline static size_t _txSizeWithInputs(size_t outSize, size_t inCount, int change)
+{
+    return outSize - LWVarIntSize(0) + LWVarIntSize(inCount) + inCount*TX_INPUT_SIZE + ((change) ? TX_OUTPUT_SIZE : 0);
+}
+
+// true if value pays amount plus fee exactly, or leaves enough over for a change output
+inline static int _txCovers(uint64_t value, uint64_t amount, uint64_t fee, uint64_t minAmount)
+{
+    return (value == amount + fee || value >= amount + fee + minAmount);
+}
+
+// fee for a transaction with inCount inputs and a change output
+static uint64_t _LWWalletChangeFee(LWWallet *wallet, uint64_t amount, size_t outSize, size_t inCount)
+{
+    uint64_t fee = _txFee(wallet->feePerKb, _txSizeWithInputs(outSize, inCount, 1));
+
+    // increase fee to round off remaining wallet balance to nearest 100 satoshi
+    if (wallet->balance > amount + fee) fee += (wallet->balance - (amount + fee)) % 100;
+    return fee;
+}
+
+// branch-and-bound search of coins, sorted by descending amount, for a set that pays amount plus fee without a change
+// output, leaving no more than maxWaste over to the fee, coins that cost more in fees to spend than they're worth are
+// skipped, writes the indexes of the selected coins to sel and returns their count, or 0 if no such set was found
+static size_t _LWWalletSelectCoinsBnB(const LWCoin coins[], size_t count, uint64_t amount, uint64_t feePerKb,
+                                      size_t outSize, uint64_t maxWaste, size_t sel[])
+{
+    uint64_t inFee = (feePerKb*TX_INPUT_SIZE + 999)/1000, target, fee, value = 0, effValue = 0, rem = 0;
+    size_t i = 0, n = 0, k = 0, tries;
+
+    while (k < count && coins[k].amount > inFee) rem += coins[k++].amount - inFee; // effective value of coins
+    target = amount + _txFee(feePerKb, _txSizeWithInputs(outSize, 0, 0));
+
+    for (tries = 0; tries < COIN_SELECTION_MAX_TRIES; tries++) {
+        if (effValue + rem >= target && effValue <= target + maxWaste) {
+            if (effValue < target) { // include the next coin
+                rem -= coins[i].amount - inFee;
+                effValue += coins[i].amount - inFee;
+                value += coins[i].amount;
+                sel[n++] = i++;
+                continue;
+            }
+
+            // effective values are estimates, so check the fee for the actual transaction size
+            fee = _txFee(feePerKb, _txSizeWithInputs(outSize, n, 0));
+
+            if (value >= amount + fee && value <= amount + fee + maxWaste &&
+                _txSizeWithInputs(outSize, n, 0) <= TX_MAX_SIZE) return n;
+        }
+
+        // backtrack to the most recently included coin, and try without it
+        while (i > 0 && (n == 0 || sel[n - 1] != i - 1)) i--, rem += coins[i].amount - inFee;
+        if (n == 0) break;
+        n--;
+        effValue -= coins[i - 1].amount - inFee;
+        value -= coins[i - 1].amount;
+    }
+
+    return 0;
+}
+
 // returns an unsigned transaction that satisifes the given transaction outputs
 // result must be freed by calling LWTransactionFree()
 LWTransaction *LWWalletCreateTxForOutputs(LWWallet *wallet, const LWTxOutput outputs[], size_t outCount)
 {
     LWTransaction *tx, *transaction = LWTransactionNew();
-    uint64_t feeAmount, amount = 0, balance = 0, minAmount;
-    size_t i, j, cpfpSize = 0;
+    uint64_t feeAmount, fee, amount = 0, balance = 0, minAmount;
+    size_t i, j, n = 0, coinCount = 0, outSize, cpfpSize = 0, *sel;
+    LWCoin *coins;
     LWUTXO *o;
     LWAddress addr = LW_ADDRESS_NONE;
+    int tooLarge = 0;
     
     assert(wallet != NULL);
     assert(outputs != NULL && outCount > 0);
@@ -562,7 +1291,12 @@ LWTransaction *LWWalletCreateTxForOutputs(LWWallet *wallet, const LWTxOutput out
     
     minAmount = LWWalletMinOutputAmount(wallet);
     pthread_mutex_lock(&wallet->lock);
-    feeAmount = _txFee(wallet->feePerKb, LWTransactionSize(transaction) + TX_OUTPUT_SIZE);
+    outSize = LWTransactionSize(transaction);
+    feeAmount = _txFee(wallet->feePerKb, outSize + TX_OUTPUT_SIZE);
+    coins = malloc((array_count(wallet->utxos) + 1)*sizeof(*coins));
+    sel = malloc((array_count(wallet->utxos) + 1)*sizeof(*sel));
+    assert(coins != NULL);
+    assert(sel != NULL);
     
     // TODO: use up all UTXOs for all used addresses to avoid leaving funds in addresses whose public key is revealed
     // TODO: avoid combining addresses in a single transaction when possible to reduce information leakage
@@ -572,51 +1306,74 @@ LWTransaction *LWWalletCreateTxForOutputs(LWWallet *wallet, const LWTxOutput out
         o = &wallet->utxos[i];
         tx = LWSetGet(wallet->allTx, o);
         if (! tx || o->n >= tx->outCount) continue;
-        LWTransactionAddInput(transaction, tx->txHash, o->n, tx->outputs[o->n].amount,
-                              tx->outputs[o->n].script, tx->outputs[o->n].scriptLen, NULL, 0, TXIN_SEQUENCE);
-        
-        if (LWTransactionSize(transaction) + TX_OUTPUT_SIZE > TX_MAX_SIZE) { // transaction size-in-bytes too large
-            LWTransactionFree(transaction);
-            transaction = NULL;
-        
-            // check for sufficient total funds before building a smaller transaction
-            if (wallet->balance < amount + _txFee(wallet->feePerKb, 10 + array_count(wallet->utxos)*TX_INPUT_SIZE +
-                                                  (outCount + 1)*TX_OUTPUT_SIZE + cpfpSize)) break;
-            pthread_mutex_unlock(&wallet->lock);
-
-            if (outputs[outCount - 1].amount > amount + feeAmount + minAmount - balance) {
-                LWTxOutput newOutputs[outCount];
-                
-                for (j = 0; j < outCount; j++) {
-                    newOutputs[j] = outputs[j];
-                }
-                
-                newOutputs[outCount - 1].amount -= amount + feeAmount - balance; // reduce last output amount
-                transaction = LWWalletCreateTxForOutputs(wallet, newOutputs, outCount);
-            }
-            else transaction = LWWalletCreateTxForOutputs(wallet, outputs, outCount - 1); // remove last output
-
-            balance = amount = feeAmount = 0;
-            pthread_mutex_lock(&wallet->lock);
-            break;
-        }
-        
-        balance += tx->outputs[o->n].amount;
+        coins[coinCount++] = (LWCoin) { *o, tx, tx->outputs[o->n].amount, i };
         
 //        // size of unconfirmed, non-change inputs for child-pays-for-parent fee
 //        // don't include parent tx with more than 10 inputs or 10 outputs
 //        if (tx->blockHeight == TX_UNCONFIRMED && tx->inCount <= 10 && tx->outCount <= 10 &&
 //            ! _LWWalletTxIsSend(wallet, tx)) cpfpSize += LWTransactionSize(tx);
+    }
 
-        // fee amount after adding a change output
-        feeAmount = _txFee(wallet->feePerKb, LWTransactionSize(transaction) + TX_OUTPUT_SIZE + cpfpSize);
+    qsort(coins, coinCount, sizeof(*coins), _LWCoinCompare); // index coins by value
+    n = _LWWalletSelectCoinsBnB(coins, coinCount, amount, wallet->feePerKb, outSize + cpfpSize, minAmount, sel);
 
-        // increase fee to round off remaining wallet balance to nearest 100 satoshi
-        if (wallet->balance > amount + feeAmount) feeAmount += (wallet->balance - (amount + feeAmount)) % 100;
-        
-        if (balance == amount + feeAmount || balance >= amount + feeAmount + minAmount) break;
+    if (n > 0) { // no change output, the amount left over goes to the fee
+        for (j = 0; j < n; j++) balance += coins[sel[j]].amount;
+        feeAmount = balance - amount;
+    }
+
+    // otherwise as few coins as possible, largest first, with the last being the smallest that covers the total
+    for (i = 0; n == 0 && i < coinCount; i++) {
+        if (_txSizeWithInputs(outSize, i + 1, 1) > TX_MAX_SIZE) { // transaction size-in-bytes too large
+            tooLarge = 1;
+            break;
+        }
+
+        fee = _LWWalletChangeFee(wallet, amount, outSize + cpfpSize, i + 1);
+        j = i;
+
+        if (_txCovers(balance + coins[i].amount, amount, fee, minAmount)) {
+            for (j = coinCount - 1; j > i && ! _txCovers(balance + coins[j].amount, amount, fee, minAmount); j--);
+        }
+
+        balance += coins[j].amount;
+        feeAmount = fee;
+        sel[i] = j;
+        if (j != i || _txCovers(balance, amount, fee, minAmount)) n = i + 1;
+    }
+
+    if (n == 0 && ! tooLarge) n = coinCount; // insufficient funds
+
+    // check for sufficient total funds before building a smaller transaction
+    if (tooLarge && wallet->balance < amount + _txFee(wallet->feePerKb, 10 + array_count(wallet->utxos)*TX_INPUT_SIZE +
+                                                      (outCount + 1)*TX_OUTPUT_SIZE + cpfpSize)) {
+        LWTransactionFree(transaction);
+        transaction = NULL;
+    }
+    else if (tooLarge && outputs[outCount - 1].amount > amount + feeAmount + minAmount - balance) {
+        // reduce last output amount to what the largest coins that fit can pay
+        transaction->outputs[outCount - 1].amount -= amount + feeAmount - balance;
+        amount = balance - feeAmount;
+        n = i;
+        tooLarge = 0;
+    }
+    else if (tooLarge) { // remove last output
+        LWTransactionFree(transaction);
+        pthread_mutex_unlock(&wallet->lock);
+        transaction = LWWalletCreateTxForOutputs(wallet, outputs, outCount - 1);
+        balance = amount = feeAmount = 0;
+        pthread_mutex_lock(&wallet->lock);
     }
     
+    for (j = 0; ! tooLarge && j < n; j++) {
+        tx = coins[sel[j]].tx;
+        o = &coins[sel[j]].utxo;
+        LWTransactionAddInput(transaction, tx->txHash, o->n, tx->outputs[o->n].amount,
+                              tx->outputs[o->n].script, tx->outputs[o->n].scriptLen, NULL, 0, TXIN_SEQUENCE);
+    }
+
+    free(coins);
+    free(sel);
     pthread_mutex_unlock(&wallet->lock);
     
     if (transaction && (outCount < 1 || balance < amount + feeAmount)) { // no outputs/insufficient funds
@@ -641,7 +1398,7 @@ LWTransaction *LWWalletCreateTxForOutputs(LWWallet *wallet, const LWTxOutput out
 // returns true if all inputs were signed, or false if there was an error or not all inputs were able to be signed
 int LWWalletSignTransaction(LWWallet *wallet, LWTransaction *tx, int forkId, const void *seed, size_t seedLen)
 {
-    uint32_t j, internalIdx[tx->inCount], externalIdx[tx->inCount];
+    uint32_t j, chain, internalIdx[tx->inCount], externalIdx[tx->inCount];
     size_t i, internalCount = 0, externalCount = 0;
     int r = 0;
     
@@ -650,13 +1407,9 @@ int LWWalletSignTransaction(LWWallet *wallet, LWTransaction *tx, int forkId, con
     pthread_mutex_lock(&wallet->lock);
     
     for (i = 0; tx && i < tx->inCount; i++) {
-        for (j = (uint32_t)array_count(wallet->internalChain); j > 0; j--) {
-            if (LWAddressEq(tx->inputs[i].address, &wallet->internalChain[j - 1])) internalIdx[internalCount++] = j - 1;
-        }
-
-        for (j = (uint32_t)array_count(wallet->externalChain); j > 0; j--) {
-            if (LWAddressEq(tx->inputs[i].address, &wallet->externalChain[j - 1])) externalIdx[externalCount++] = j - 1;
-        }
+        if (! _LWWalletScriptHashIndex(wallet, &tx->inputs[i].address, &chain, &j)) continue;
+        if (chain == SEQUENCE_INTERNAL_CHAIN) internalIdx[internalCount++] = j;
+        else externalIdx[externalCount++] = j;
     }
 
     pthread_mutex_unlock(&wallet->lock);
@@ -689,47 +1442,106 @@ int LWWalletContainsTransaction(LWWallet *wallet, const LWTransaction *tx)
     return r;
 }
 
+// true if the tx in view is associated with the wallet, checked without building an LWTransaction from it
+int LWWalletContainsTransactionView(LWWallet *wallet, LWTransactionView *view)
+{
+    LWTxInputView input;
+    LWTxOutputView output;
+    LWTransaction *t;
+    LWScriptHash sh;
+    int r = 0;
+    
+    assert(wallet != NULL);
+    assert(view != NULL);
+    pthread_mutex_lock(&wallet->lock);
+    
+    for (size_t i = 0; ! r && view && LWTransactionViewOutput(view, i, &output); i++) {
+        if (LWScriptHashFromScriptPubKey(&sh, output.script, output.scriptLen) &&
+            LWSetContains(wallet->allAddrs, &sh)) r = 1;
+    }
+    
+    for (size_t i = 0; ! r && view && LWTransactionViewInput(view, i, &input); i++) {
+        t = LWSetGet(wallet->allTx, &input.txHash);
+        if (t && input.index < t->outCount && LWSetContains(wallet->allAddrs, &t->outputs[input.index].address)) {
+            r = 1;
+        }
+    }
+    
+    pthread_mutex_unlock(&wallet->lock);
+    return r;
+}
+
 // adds a transaction to the wallet, or returns false if it isn't associated with the wallet
 int LWWalletRegisterTransaction(LWWallet *wallet, LWTransaction *tx)
 {
-    int wasAdded = 0, r = 1;
-    
     assert(wallet != NULL);
     assert(tx != NULL && LWTransactionIsSigned(tx));
-    
-    if (tx && LWTransactionIsSigned(tx)) {
-        pthread_mutex_lock(&wallet->lock);
+    return (LWWalletRegisterTransactions(wallet, &tx, 1) == 1);
+}
 
-        if (! LWSetContains(wallet->allTx, tx)) {
-            if (_LWWalletContainsTx(wallet, tx)) {
-                // TODO: verify signatures when possible
-                // TODO: handle tx replacement with input sequence numbers
-                //       (for now, replacements appear invalid until confirmation)
-                LWSetAdd(wallet->allTx, tx);
-                _LWWalletInsertTx(wallet, tx);
-                _LWWalletUpdateBalance(wallet);
-                wasAdded = 1;
-            }
-            else { // keep track of unconfirmed non-wallet tx for invalid tx checks and child-pays-for-parent fees
-                   // BUG: limit total non-wallet unconfirmed tx to avoid memory exhaustion attack
-                if (tx->blockHeight == TX_UNCONFIRMED) LWSetAdd(wallet->allTx, tx);
-                r = 0;
-                // BUG: XXX memory leak if tx is not added to wallet->allTx, and we can't just free it
-            }
+// adds transactions to the wallet in order, updating the balance once for the whole batch, or again for any txs that
+// only match addresses generated to replace ones the batch used
+// returns the number of transactions associated with the wallet
+size_t LWWalletRegisterTransactions(LWWallet *wallet, LWTransaction *transactions[], size_t txCount)
+{
+    LWTransaction *tx, *_added[(sizeof(tx)*txCount <= 0x1000) ? txCount + 1 : 1],
+                  **added = (sizeof(tx)*txCount <= 0x1000) ? _added : malloc(txCount*sizeof(*added));
+    size_t i, n, addedCount = 0, first, addrCount, r = 0;
+
+    assert(wallet != NULL);
+    assert(transactions != NULL || txCount == 0);
+    assert(added != NULL);
+    pthread_mutex_lock(&wallet->lock);
+
+    do { // repeat until no new addresses are generated, since a later tx may pay an address an earlier one revealed
+        first = SIZE_MAX;
+
+        for (i = 0; transactions && i < txCount; i++) {
+            tx = transactions[i];
+            if (! tx || ! LWTransactionIsSigned(tx) || LWSetContains(wallet->allTx, tx)) continue;
+            if (! _LWWalletContainsTx(wallet, tx)) continue;
+            // TODO: verify signatures when possible
+            // TODO: handle tx replacement with input sequence numbers
+            //       (for now, replacements appear invalid until confirmation)
+            LWSetAdd(wallet->allTx, tx);
+            n = _LWWalletInsertTx(wallet, tx);
+            if (n < first) first = n;
+            added[addedCount++] = tx;
         }
-    
-        pthread_mutex_unlock(&wallet->lock);
-    }
-    else r = 0;
 
-    if (wasAdded) {
+        if (first == SIZE_MAX) break;
+        _LWWalletUpdateBalance(wallet, first);
+        addrCount = array_count(wallet->internalChain) + array_count(wallet->externalChain);
+        pthread_mutex_unlock(&wallet->lock);
         // when a wallet address is used in a transaction, generate a new address to replace it
         LWWalletUnusedAddrs(wallet, NULL, SEQUENCE_GAP_LIMIT_EXTERNAL, 0);
         LWWalletUnusedAddrs(wallet, NULL, SEQUENCE_GAP_LIMIT_INTERNAL, 1);
+        pthread_mutex_lock(&wallet->lock);
+    } while (array_count(wallet->internalChain) + array_count(wallet->externalChain) > addrCount);
+
+    for (i = 0; transactions && i < txCount; i++) {
+        tx = transactions[i];
+        if (! tx || ! LWTransactionIsSigned(tx)) continue;
+        if (LWSetContains(wallet->allTx, tx)) r++;
+        else if (tx->blockHeight == TX_UNCONFIRMED) {
+            // keep track of unconfirmed non-wallet tx for invalid tx checks and child-pays-for-parent fees
+            // BUG: limit total non-wallet unconfirmed tx to avoid memory exhaustion attack
+            LWSetAdd(wallet->allTx, tx);
+        }
+        // BUG: XXX memory leak if tx is not added to wallet->allTx, and we can't just free it
+    }
+
+    pthread_mutex_unlock(&wallet->lock);
+
+    if (addedCount > 0) {
         if (wallet->balanceChanged) wallet->balanceChanged(wallet->callbackInfo, wallet->balance);
-        if (wallet->txAdded) wallet->txAdded(wallet->callbackInfo, tx);
+
+        for (i = 0; wallet->txAdded && i < addedCount; i++) {
+            wallet->txAdded(wallet->callbackInfo, added[i]);
+        }
     }
 
+    if (added != _added) free(added);
     return r;
 }
 
@@ -772,13 +1584,11 @@ void LWWalletRemoveTransaction(LWWallet *wallet, UInt256 txHash)
         else {
             LWSetRemove(wallet->allTx, tx);
             
-            for (size_t i = array_count(wallet->transactions); i > 0; i--) {
-                if (! LWTransactionEq(wallet->transactions[i - 1], tx)) continue;
-                array_rm(wallet->transactions, i - 1);
-                break;
-            }
-            
-            _LWWalletUpdateBalance(wallet);
+            size_t n = array_count(wallet->transactions);
+
+            while (n > 0 && ! LWTransactionEq(wallet->transactions[n - 1], tx)) n--;
+            if (n > 0) array_rm(wallet->transactions, n - 1);
+            _LWWalletUpdateBalance(wallet, (n > 0) ? n - 1 : array_count(wallet->transactions));
             pthread_mutex_unlock(&wallet->lock);
             
             // if this is for a transaction we sent, and it wasn't already known to be invalid, notify user
@@ -915,12 +1725,14 @@ void LWWalletUpdateTransactions(LWWallet *wallet, const UInt256 txHashes[], size
 {
     LWTransaction *tx;
     UInt256 hashes[txCount];
+    uint64_t balance;
     int needsUpdate = 0;
-    size_t i, j, k;
+    size_t i, j, k, n, first = SIZE_MAX;
     
     assert(wallet != NULL);
     assert(txHashes != NULL || txCount == 0);
     pthread_mutex_lock(&wallet->lock);
+    balance = wallet->balance;
     if (blockHeight > wallet->blockHeight) wallet->blockHeight = blockHeight;
     
     for (i = 0, j = 0; txHashes && i < txCount; i++) {
@@ -933,7 +1745,9 @@ void LWWalletUpdateTransactions(LWWallet *wallet, const UInt256 txHashes[], size
             for (k = array_count(wallet->transactions); k > 0; k--) { // remove and re-insert tx to keep wallet sorted
                 if (! LWTransactionEq(wallet->transactions[k - 1], tx)) continue;
                 array_rm(wallet->transactions, k - 1);
-                _LWWalletInsertTx(wallet, tx);
+                n = _LWWalletInsertTx(wallet, tx);
+                if (k - 1 < first) first = k - 1;
+                if (n < first) first = n;
                 break;
             }
             
@@ -946,7 +1760,8 @@ void LWWalletUpdateTransactions(LWWallet *wallet, const UInt256 txHashes[], size
         }
     }
     
-    if (needsUpdate) _LWWalletUpdateBalance(wallet);
+    if (first != SIZE_MAX) _LWWalletUpdateBalance(wallet, first);
+    if (wallet->balance != balance) needsUpdate = 1;
     pthread_mutex_unlock(&wallet->lock);
     if (needsUpdate && wallet->balanceChanged) {
         wallet->balanceChanged(wallet->callbackInfo, wallet->balance);
@@ -973,7 +1788,7 @@ void LWWalletSetTxUnconfirmedAfter(LWWallet *wallet, uint32_t blockHeight)
         hashes[j] = wallet->transactions[i + j]->txHash;
     }
     
-    if (count > 0) _LWWalletUpdateBalance(wallet);
+    if (count > 0) _LWWalletUpdateBalance(wallet, i);
     pthread_mutex_unlock(&wallet->lock);
     if (count > 0 && wallet->balanceChanged) {
         wallet->balanceChanged(wallet->callbackInfo, wallet->balance);
@@ -992,7 +1807,7 @@ uint64_t LWWalletAmountReceivedFromTx(LWWallet *wallet, const LWTransaction *tx)
     
     // TODO: don't include outputs below TX_MIN_OUTPUT_AMOUNT
     for (size_t i = 0; tx && i < tx->outCount; i++) {
-        if (LWSetContains(wallet->allAddrs, tx->outputs[i].address)) amount += tx->outputs[i].amount;
+        if (LWSetContains(wallet->allAddrs, &tx->outputs[i].address)) amount += tx->outputs[i].amount;
     }
     
     pthread_mutex_unlock(&wallet->lock);
@@ -1012,7 +1827,7 @@ uint64_t LWWalletAmountSentByTx(LWWallet *wallet, const LWTransaction *tx)
         LWTransaction *t = LWSetGet(wallet->allTx, &tx->inputs[i].txHash);
         uint32_t n = tx->inputs[i].index;
         
-        if (t && n < t->outCount && LWSetContains(wallet->allAddrs, t->outputs[n].address)) {
+        if (t && n < t->outCount && LWSetContains(wallet->allAddrs, &t->outputs[n].address)) {
             amount += t->outputs[n].amount;
         }
     }
@@ -1021,6 +1836,36 @@ uint64_t LWWalletAmountSentByTx(LWWallet *wallet, const LWTransaction *tx)
     return amount;
 }
 
+// writes to outputs a copy of each wallet output that is spent by an input of tx, with LW_TX_OUTPUT_NONE for inputs
+// that don't spend a wallet output, outputs must hold tx->inCount outputs, and each script must be set to NULL when
+// done to free memory
+// returns the number of inputs that spend a wallet output
+size_t LWWalletSpentOutputs(LWWallet *wallet, const LWTransaction *tx, LWTxOutput outputs[])
+{
+    size_t count = 0;
+
+    assert(wallet != NULL);
+    assert(tx != NULL);
+    assert(outputs != NULL || tx->inCount == 0);
+    pthread_mutex_lock(&wallet->lock);
+
+    for (size_t i = 0; tx && i < tx->inCount; i++) {
+        LWTransaction *t = LWSetGet(wallet->allTx, &tx->inputs[i].txHash);
+        uint32_t n = tx->inputs[i].index;
+
+        outputs[i] = LW_TX_OUTPUT_NONE;
+
+        if (t && n < t->outCount && LWSetContains(wallet->allAddrs, &t->outputs[n].address)) {
+            outputs[i].amount = t->outputs[n].amount;
+            LWTxOutputSetScript(&outputs[i], t->outputs[n].script, t->outputs[n].scriptLen);
+            count++;
+        }
+    }
+
+    pthread_mutex_unlock(&wallet->lock);
+    return count;
+}
+
 // returns the fee for the given transaction if all its inputs are from wallet transactions, UINT64_MAX otherwise
 uint64_t LWWalletFeeForTx(LWWallet *wallet, const LWTransaction *tx)
 {
@@ -1158,11 +2003,20 @@ void LWWalletFree(LWWallet *wallet)
     LWSetFree(wallet->allTx);
     LWSetFree(wallet->invalidTx);
     LWSetFree(wallet->pendingTx);
+    LWSetFree(wallet->utxoSet);
     LWSetFree(wallet->spentOutputs);
     array_free(wallet->internalChain);
     array_free(wallet->externalChain);
+    array_free(wallet->internalHashes);
+    array_free(wallet->externalHashes);
     array_free(wallet->balanceHist);
 
+    for (size_t i = array_count(wallet->balanceUndo); i > 0; i--) {
+        if (wallet->balanceUndo[i - 1].removed) free(wallet->balanceUndo[i - 1].removed);
+    }
+
+    array_free(wallet->balanceUndo);
+
     for (size_t i = array_count(wallet->transactions); i > 0; i--) {
         LWTransactionFree(wallet->transactions[i - 1]);
     }
@@ -41,6 +41,16 @@ typedef struct LWWalletStruct LWWallet;
 // allocates and populates a LWWallet struct that must be freed by calling LWWalletFree()
 LWWallet *LWWalletNew(LWTransaction *transactions[], size_t txCount, LWMasterPubKey mpk);
 
+// same as LWWalletNew(), but loads tx order, UTXOs, balance history and address chain lengths from state that was
+// returned by LWWalletSerializeState(), falling back to rebuilding them if state is corrupt or doesn't match mpk and
+// transactions, the address chains themselves are always derived from mpk
+LWWallet *LWWalletNewWithState(LWTransaction *transactions[], size_t txCount, LWMasterPubKey mpk,
+                               const uint8_t *state, size_t stateLen);
+
+// serializes the derived wallet state for LWWalletNewWithState(), the wallet transactions must be saved separately
+// returns number of bytes written to buf, or total bufLen needed if buf is NULL
+size_t LWWalletSerializeState(LWWallet *wallet, uint8_t *buf, size_t bufLen);
+
 // not thread-safe, set callbacks once after LWWalletNew(), before calling other LWWallet functions
 // info is a void pointer that will be passed along with each callback call
 // void balanceChanged(void *, uint64_t) - called when the wallet balance changes
@@ -63,6 +73,9 @@ void LWWalletSetCallbacks(LWWallet *wallet, void *info,
 // returns the number addresses written to addrs
 size_t LWWalletUnusedAddrs(LWWallet *wallet, LWAddress addrs[], uint32_t gapLimit, int internal);
 
+// same as LWWalletUnusedAddrs(), but writes the addresses in binary form to hashes
+size_t LWWalletUnusedScriptHashes(LWWallet *wallet, LWScriptHash hashes[], uint32_t gapLimit, int internal);
+
 // returns the first unused external address
 LWAddress LWWalletReceiveAddress(LWWallet *wallet);
 
@@ -70,9 +83,19 @@ LWAddress LWWalletReceiveAddress(LWWallet *wallet);
 // returns the number addresses written, or total number available if addrs is NULL
 size_t LWWalletAllAddrs(LWWallet *wallet, LWAddress addrs[], size_t addrsCount);
 
+// same as LWWalletAllAddrs(), but writes the addresses in binary form to hashes
+size_t LWWalletAllScriptHashes(LWWallet *wallet, LWScriptHash hashes[], size_t hashesCount);
+
 // true if the address was previously generated by LWWalletUnusedAddrs() (even if it's now used)
 int LWWalletContainsAddress(LWWallet *wallet, const char *addr);
 
+// true if the address in binary form was previously generated by LWWalletUnusedAddrs() (even if it's now used)
+int LWWalletContainsScriptHash(LWWallet *wallet, const LWScriptHash *sh);
+
+// writes the chain (SEQUENCE_EXTERNAL_CHAIN or SEQUENCE_INTERNAL_CHAIN) and index the wallet derived sh at
+// returns true if sh was previously generated by LWWalletUnusedAddrs()
+int LWWalletScriptHashIndex(LWWallet *wallet, const LWScriptHash *sh, uint32_t *chain, uint32_t *index);
+
 // true if the address was previously used as an input or output in any wallet transaction
 int LWWalletAddressIsUsed(LWWallet *wallet, const char *addr);
 
@@ -118,9 +141,17 @@ int LWWalletSignTransaction(LWWallet *wallet, LWTransaction *tx, int forkId, con
 // true if the given transaction is associated with the wallet (even if it hasn't been registered)
 int LWWalletContainsTransaction(LWWallet *wallet, const LWTransaction *tx);
 
+// true if the tx in view is associated with the wallet, checked without building an LWTransaction from it
+int LWWalletContainsTransactionView(LWWallet *wallet, LWTransactionView *view);
+
 // adds a transaction to the wallet, or returns false if it isn't associated with the wallet
 int LWWalletRegisterTransaction(LWWallet *wallet, LWTransaction *tx);
 
+// adds transactions to the wallet in order, updating the balance once for the whole batch, or again for any txs that
+// only match addresses generated to replace ones the batch used
+// returns the number of transactions associated with the wallet
+size_t LWWalletRegisterTransactions(LWWallet *wallet, LWTransaction *transactions[], size_t txCount);
+
 // removes a tx from the wallet and calls LWTransactionFree() on it, along with any tx that depend on its outputs
 void LWWalletRemoveTransaction(LWWallet *wallet, UInt256 txHash);
 
@@ -150,6 +181,12 @@ uint64_t LWWalletAmountReceivedFromTx(LWWallet *wallet, const LWTransaction *tx)
 // returns the amount sent from the wallet by the trasaction (total wallet outputs consumed, change and fee included)
 uint64_t LWWalletAmountSentByTx(LWWallet *wallet, const LWTransaction *tx);
 
+// writes to outputs a copy of each wallet output that is spent by an input of tx, with LW_TX_OUTPUT_NONE for inputs
+// that don't spend a wallet output, outputs must hold tx->inCount outputs, and each script must be set to NULL when
+// done to free memory
+// returns the number of inputs that spend a wallet output
+size_t LWWalletSpentOutputs(LWWallet *wallet, const LWTransaction *tx, LWTxOutput outputs[]);
+
 // returns the fee for the given transaction if all its inputs are from wallet transactions, UINT64_MAX otherwise
 uint64_t LWWalletFeeForTx(LWWallet *wallet, const LWTransaction *tx);
 
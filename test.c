@@ -29,6 +29,8 @@
 #include <time.h>
 #include <unistd.h>
 #include <arpa/inet.h>
+#include <netinet/in.h>
+#include <sys/socket.h>
 
 #define SKIP_BIP38 1
 
@@ -408,6 +410,27 @@ int LWHashTests()
                     "\x14\x7c\x4e\x72\xb9\x80\x77\x85\xaf\xee\x48\xbb", *(UInt256 *)md))
         r = 0, fprintf(stderr, "***FAILED*** %s: LWSHA256() test 6\n", __func__);
 
+    // test incremental sha256 against one-shot sha256 for chunk boundaries on either side of the block size
+
+    s = "this is some text to test the incremental sha256 implementation with more than 64bytes of data, split into "
+        "chunks of every size from 1 byte up to past its 64byte internal digest buffer";
+
+    for (size_t chunk = 1; chunk <= 70; chunk++) {
+        LWSHA256Context sha;
+        UInt256 md2;
+
+        LWSHA256Init(&sha);
+
+        for (size_t i = 0; i < strlen(s); i += chunk) {
+            LWSHA256Update(&sha, &s[i], (i + chunk < strlen(s)) ? chunk : strlen(s) - i);
+        }
+
+        LWSHA256Final(&sha, md2.u8);
+        LWSHA256(md, s, strlen(s));
+        if (! UInt256Eq(md2, *(UInt256 *)md)) r = 0, fprintf(stderr, "***FAILED*** %s: LWSHA256Update() test %zu\n",
+                                                              __func__, chunk);
+    }
+
     // test sha512
     
     s = "Free online SHA512 Calculator, type text here...";
@@ -1390,6 +1413,23 @@ int LWAddressTests()
     if (script3Len != sizeof(script2) || memcmp(script2, script3, sizeof(script2)))
         r = 0, fprintf(stderr, "\n***FAILED*** %s: LWAddressScriptPubKey() test", __func__);
 
+    LWScriptHash sh, sh2;
+    LWAddress addr4;
+    
+    if (! LWScriptHashFromScriptPubKey(&sh, (uint8_t *)script2, sizeof(script2)) || sh.type != SCRIPT_HASH_WITNESS ||
+        sh.version != 0 || sh.len != 20 || ! LWScriptHashFromAddress(&sh2, addr3.s) || ! LWScriptHashEq(&sh, &sh2) ||
+        ! LWScriptHashAddress(addr4.s, sizeof(addr4), &sh) || ! LWAddressEq(&addr3, &addr4))
+        r = 0, fprintf(stderr, "\n***FAILED*** %s: LWScriptHash witness test", __func__);
+    
+    if (! LWScriptHashFromScriptPubKey(&sh, script, scriptLen) || sh.type != SCRIPT_HASH_PUBKEY ||
+        ! LWScriptHashFromAddress(&sh2, addr.s) || ! LWScriptHashEq(&sh, &sh2) ||
+        ! LWScriptHashAddress(addr4.s, sizeof(addr4), &sh) || ! LWAddressEq(&addr, &addr4))
+        r = 0, fprintf(stderr, "\n***FAILED*** %s: LWScriptHash pubkey hash test", __func__);
+    
+    sh2.type = SCRIPT_HASH_SCRIPT; // same hash paid to by a different script type is a different address
+    if (LWScriptHashEq(&sh, &sh2))
+        r = 0, fprintf(stderr, "\n***FAILED*** %s: LWScriptHashEq() test", __func__);
+
     if (! r) fprintf(stderr, "\n                                    ");
     return r;
 }
@@ -1571,6 +1611,27 @@ int LWBIP32SequenceTests()
                     uint256("7b6a7dd645507d775215a9035be06700e1ed8c541da9351b4bd14bd50ab61428")))
         r = 0, fprintf(stderr, "***FAILED*** %s: LWBIP32PubKey() test\n", __func__);
     
+    uint8_t childKey[33];
+    LWMasterPubKey chainKey = LWBIP32ChainPubKey(mpk, SEQUENCE_EXTERNAL_CHAIN);
+
+    LWBIP32ChildPubKey(childKey, sizeof(childKey), chainKey, 0);
+    if (memcmp(childKey, pubKey, sizeof(pubKey)) != 0)
+        r = 0, fprintf(stderr, "***FAILED*** %s: LWBIP32ChildPubKey() test 1\n", __func__);
+
+    LWBIP32PubKey(pubKey, sizeof(pubKey), mpk, SEQUENCE_EXTERNAL_CHAIN, 97);
+    LWBIP32ChildPubKey(childKey, sizeof(childKey), chainKey, 97);
+    if (memcmp(childKey, pubKey, sizeof(pubKey)) != 0)
+        r = 0, fprintf(stderr, "***FAILED*** %s: LWBIP32ChildPubKey() test 2\n", __func__);
+
+    LWECPoint pubKeys[300];
+
+    if (LWBIP32ChildPubKeyList(pubKeys, 300, chainKey, 0) != 300 || memcmp(pubKeys[97].p, pubKey, sizeof(pubKey)) != 0)
+        r = 0, fprintf(stderr, "***FAILED*** %s: LWBIP32ChildPubKeyList() test 1\n", __func__);
+
+    LWBIP32ChildPubKey(childKey, sizeof(childKey), chainKey, 299);
+    if (memcmp(pubKeys[299].p, childKey, sizeof(childKey)) != 0)
+        r = 0, fprintf(stderr, "***FAILED*** %s: LWBIP32ChildPubKeyList() test 2\n", __func__);
+
     // TODO: XXX test LWBIP32SerializeMasterPrivKey()
     // TODO: XXX test LWBIP32SerializeMasterPubKey()
 
@@ -1580,7 +1641,7 @@ int LWBIP32SequenceTests()
 
 static int LWTxOutputEqual(LWTxOutput *out1, LWTxOutput *out2) {
     return out1->amount == out2->amount
-           && 0 == memcmp (out1->address, out2->address, sizeof (out1->address))
+           && LWScriptHashEq(&out1->address, &out2->address)
            && out1->scriptLen == out2->scriptLen
            && 0 == memcmp (out1->script, out2->script, out1->scriptLen * sizeof (uint8_t));
 }
@@ -1590,12 +1651,14 @@ static int LWTxOutputEqual(LWTxOutput *out1, LWTxOutput *out2) {
 static int LWTxInputEqual(LWTxInput *in1, LWTxInput *in2) {
     return 0 == memcmp(&in1->txHash, &in2->txHash, sizeof(UInt256))
            && in1->index == in2->index
-           && 0 == memcmp(in1->address, in2->address, sizeof(in1->address))
+           && LWScriptHashEq(&in1->address, &in2->address)
            && in1->amount == in2->amount
            && in1->scriptLen == in2->scriptLen
            && 0 == memcmp(in1->script, in2->script, in1->scriptLen * sizeof(uint8_t))
            && in1->sigLen == in2->sigLen
            && 0 == memcmp(in1->signature, in2->signature, in1->sigLen * sizeof(uint8_t))
+           && in1->witLen == in2->witLen
+           && 0 == memcmp(in1->witness, in2->witness, in1->witLen * sizeof(uint8_t))
            && in1->sequence == in2->sequence;
 }
 
@@ -1669,6 +1732,24 @@ int LWTransactionTests()
     if (! tx || ! LWTransactionIsSigned(tx))
         r = 0, fprintf(stderr, "\n***FAILED*** %s: LWTransactionParse() test 1", __func__);
     if (! tx) return r;
+
+    LWTxOutput prevOuts[40], otherOut = LW_TX_OUTPUT_NONE;
+    int verified[40];
+
+    prevOuts[0] = LW_TX_OUTPUT_NONE;
+    LWTxOutputSetScript(&prevOuts[0], script, scriptLen);
+    prevOuts[0].amount = 1;
+    for (size_t i = 1; i < 40; i++) prevOuts[i] = prevOuts[0]; // shallow copies of the output every input spends
+    LWTxOutputSetScript(&otherOut, (uint8_t []) { OP_DUP, OP_HASH160, 20, [23] = OP_EQUALVERIFY, OP_CHECKSIG }, 25);
+
+    if (! LWTransactionVerify(tx, prevOuts, verified) || ! verified[0])
+        r = 0, fprintf(stderr, "\n***FAILED*** %s: LWTransactionVerify() test 1", __func__);
+
+    if (! LWTransactionVerify(tx, &LW_TX_OUTPUT_NONE, verified) || verified[0]) // unknown previous output
+        r = 0, fprintf(stderr, "\n***FAILED*** %s: LWTransactionVerify() unverifiable test", __func__);
+
+    if (LWTransactionVerify(tx, &otherOut, verified) || verified[0]) // pubKey doesn't match the previous output
+        r = 0, fprintf(stderr, "\n***FAILED*** %s: LWTransactionVerify() wrong script test", __func__);
     
     uint8_t buf3[LWTransactionSerialize(tx, NULL, 0)];
     size_t len3 = LWTransactionSerialize(tx, buf3, sizeof(buf3));
@@ -1707,6 +1788,9 @@ int LWTransactionTests()
     uint8_t buf4[LWTransactionSerialize(tx, NULL, 0)];
     size_t len4 = LWTransactionSerialize(tx, buf4, sizeof(buf4));
     
+    if (LWTransactionSize(tx) != len4)
+        r = 0, fprintf(stderr, "\n***FAILED*** %s: LWTransactionSize() test 1", __func__);
+
     LWTransactionFree(tx);
     tx = LWTransactionParse(buf4, len4);
     if (! tx || ! LWTransactionIsSigned(tx))
@@ -1715,11 +1799,175 @@ int LWTransactionTests()
 
     uint8_t buf5[LWTransactionSerialize(tx, NULL, 0)];
     size_t len5 = LWTransactionSerialize(tx, buf5, sizeof(buf5));
+
+    if (LWTransactionSize(tx) != len5)
+        r = 0, fprintf(stderr, "\n***FAILED*** %s: LWTransactionSize() test 2", __func__);
     
     if (len4 != len5 || memcmp(buf4, buf5, len4) != 0)
         r = 0, fprintf(stderr, "\n***FAILED*** %s: LWTransactionSerialize() test 2", __func__);
     LWTransactionFree(tx);
 
+    tx = LWTransactionNew(); // enough inputs to sign on worker threads
+    for (uint32_t i = 0; i < 40; i++) {
+        LWTransactionAddInput(tx, inHash, i, 1, script, scriptLen, NULL, 0, TXIN_SEQUENCE);
+    }
+    
+    LWTransactionAddOutput(tx, 1000000, script, scriptLen);
+    LWTransactionSign(tx, 0, k, 2);
+    
+    for (size_t i = 0; i < tx->inCount; i++) {
+        LWAddressFromScriptSig(addr.s, sizeof(addr), tx->inputs[i].signature, tx->inputs[i].sigLen);
+        if (! LWAddressEq(&address, &addr)) break;
+    }
+    
+    if (! LWTransactionIsSigned(tx) || ! LWAddressEq(&address, &addr) ||
+        LWTransactionSize(tx) != LWTransactionSerialize(tx, NULL, 0))
+        r = 0, fprintf(stderr, "\n***FAILED*** %s: LWTransactionSign() test 3", __func__);
+
+    if (! LWTransactionVerify(tx, prevOuts, verified) || ! verified[0] || ! verified[39])
+        r = 0, fprintf(stderr, "\n***FAILED*** %s: LWTransactionVerify() test 2", __func__);
+    
+    tx->outputs[0].amount++; // changing an output invalidates every SIGHASH_ALL signature
+    if (LWTransactionVerify(tx, prevOuts, NULL))
+        r = 0, fprintf(stderr, "\n***FAILED*** %s: LWTransactionVerify() test 3", __func__);
+    LWTransactionFree(tx);
+
+    tx = LWTransactionNew(); // BIP143 digests must reflect inputs and outputs changed after an earlier signing
+    LWTransactionAddInput(tx, inHash, 0, 1, script, scriptLen, NULL, 0, TXIN_SEQUENCE);
+    LWTransactionAddOutput(tx, 999999, script, scriptLen);
+    LWTransactionSign(tx, 0x40, k, 2);
+    tx->outputs[0].amount = 1000000; // changed directly, as LWWalletCreateTxForOutputs() does
+    LWTransactionAddInput(tx, inHash, 1, 1, script, scriptLen, NULL, 0, TXIN_SEQUENCE);
+    LWTransactionAddOutput(tx, 2000000, script, scriptLen);
+    LWTransactionSign(tx, 0x40, k, 2);
+    
+    LWTransaction *tx2 = LWTransactionNew();
+    LWTransactionAddInput(tx2, inHash, 0, 1, script, scriptLen, NULL, 0, TXIN_SEQUENCE);
+    LWTransactionAddInput(tx2, inHash, 1, 1, script, scriptLen, NULL, 0, TXIN_SEQUENCE);
+    LWTransactionAddOutput(tx2, 1000000, script, scriptLen);
+    LWTransactionAddOutput(tx2, 2000000, script, scriptLen);
+    LWTransactionSign(tx2, 0x40, k, 2);
+    
+    if (! LWTransactionIsSigned(tx) || tx->inputs[1].sigLen != tx2->inputs[1].sigLen ||
+        memcmp(tx->inputs[1].signature, tx2->inputs[1].signature, tx->inputs[1].sigLen) != 0)
+        r = 0, fprintf(stderr, "\n***FAILED*** %s: LWTransactionSign() test 4", __func__);
+
+    if (! LWTransactionVerify(tx2, prevOuts, verified) || ! verified[0] || ! verified[1])
+        r = 0, fprintf(stderr, "\n***FAILED*** %s: LWTransactionVerify() BIP143 test", __func__);
+
+    prevOuts[1].amount = 2; // BIP143 signatures commit to the previous output amount
+    if (LWTransactionVerify(tx2, prevOuts, verified) || ! verified[0] || verified[1])
+        r = 0, fprintf(stderr, "\n***FAILED*** %s: LWTransactionVerify() BIP143 amount test", __func__);
+
+    prevOuts[1].amount = 1;
+    LWTxOutputSetScript(&prevOuts[0], NULL, 0);
+    LWTxOutputSetScript(&otherOut, NULL, 0);
+    LWTransactionFree(tx2);
+    LWTransactionFree(tx);
+
+    LWTransactionView view;
+    LWTxInputView in;
+    LWTxOutputView out;
+    
+    tx = LWTransactionParse(buf4, len4);
+    if (! LWTransactionViewParse(&view, buf4, len4) || view.len != len4 || view.inCount != tx->inCount ||
+        view.outCount != tx->outCount || ! UInt256Eq(view.txHash, tx->txHash))
+        r = 0, fprintf(stderr, "\n***FAILED*** %s: LWTransactionViewParse() test 1", __func__);
+    
+    if (! LWTransactionViewInput(&view, 9, &in) || in.sigLen != tx->inputs[9].sigLen ||
+        memcmp(in.signature, tx->inputs[9].signature, in.sigLen) != 0 || // read back from the first input
+        ! LWTransactionViewInput(&view, 0, &in) || in.index != tx->inputs[0].index || in.script != NULL ||
+        LWTransactionViewInput(&view, 10, &in) || ! LWTransactionViewOutput(&view, 9, &out) ||
+        out.amount != tx->outputs[9].amount || out.scriptLen != scriptLen ||
+        memcmp(out.script, script, scriptLen) != 0)
+        r = 0, fprintf(stderr, "\n***FAILED*** %s: LWTransactionView accessor test", __func__);
+    
+    if (LWTransactionViewParse(&view, buf4, len4 - 1))
+        r = 0, fprintf(stderr, "\n***FAILED*** %s: LWTransactionViewParse() test 2", __func__);
+    LWTransactionFree(tx);
+
+    tx = LWTransactionNew(); // BIP144 witness serialization, with an empty witness stack for the second input
+    LWTransactionAddInput(tx, inHash, 0, 1, script, scriptLen, NULL, 0, TXIN_SEQUENCE);
+    LWTransactionAddInput(tx, inHash, 1, 1, script, scriptLen, NULL, 0, TXIN_SEQUENCE);
+    LWTransactionAddOutput(tx, 1000000, script, scriptLen);
+    LWTransactionSign(tx, 0, k, 2);
+
+    uint8_t wit[] = { 0x02, 0x01, 0xaa, 0x02, 0xbb, 0xcc };
+    uint8_t wBuf[LWTransactionSerialize(tx, NULL, 0) + 2 + sizeof(wit) + 1], wBuf2[sizeof(wBuf)];
+    UInt256 txHash = tx->txHash, wtxHash;
+    size_t wLen;
+
+    if (! UInt256Eq(tx->wtxHash, tx->txHash))
+        r = 0, fprintf(stderr, "\n***FAILED*** %s: LWTransactionSign() wtxHash test", __func__);
+    LWTxInputSetWitness(&tx->inputs[0], wit, sizeof(wit));
+    wLen = LWTransactionSerialize(tx, wBuf, sizeof(wBuf));
+    LWSHA256_2(&wtxHash, wBuf, wLen);
+    LWTransactionFree(tx);
+    tx = LWTransactionParse(wBuf, wLen);
+
+    if (! tx || wLen != sizeof(wBuf) || wBuf[4] != 0x00 || wBuf[5] != 0x01 || ! UInt256Eq(tx->txHash, txHash) ||
+        ! UInt256Eq(tx->wtxHash, wtxHash) || tx->inputs[0].witLen != sizeof(wit) ||
+        memcmp(tx->inputs[0].witness, wit, sizeof(wit)) != 0 || tx->inputs[1].witLen != 1 ||
+        LWTransactionSerialize(tx, wBuf2, sizeof(wBuf2)) != wLen || memcmp(wBuf, wBuf2, wLen) != 0)
+        r = 0, fprintf(stderr, "\n***FAILED*** %s: LWTransactionParse() witness test", __func__);
+
+    if (! tx || LWTransactionSize(tx) != wLen || tx->weight != (wLen - 2 - sizeof(wit) - 1)*4 + 2 + sizeof(wit) + 1 ||
+        LWTransactionVSize(tx) != (tx->weight + 3)/4 || LWTransactionVSize(tx) >= wLen)
+        r = 0, fprintf(stderr, "\n***FAILED*** %s: LWTransactionSize() witness test", __func__);
+
+    if (tx) LWTransactionAddInput(tx, inHash, 2, 1, script, scriptLen, NULL, 0, TXIN_SEQUENCE);
+    if (tx) LWTransactionSign(tx, 0, k, 2); // an added input gets an empty witness stack, so size must stay exact
+
+    if (! tx || LWTransactionSize(tx) != LWTransactionSerialize(tx, NULL, 0) ||
+        tx->weight != (LWTransactionSize(tx) - 2 - sizeof(wit) - 2)*4 + 2 + sizeof(wit) + 2)
+        r = 0, fprintf(stderr, "\n***FAILED*** %s: LWTransactionSize() witness test 2", __func__);
+
+    if (tx) LWTxInputSetWitness(&tx->inputs[1], wit, sizeof(wit)); // setters don't update the size on their own
+    if (tx) LWTxInputSetSignature(&tx->inputs[2], NULL, 0);
+    if (tx) LWTransactionSign(tx, 0, k, 2);
+
+    if (! tx || ! LWTransactionIsSigned(tx) || LWTransactionSize(tx) != LWTransactionSerialize(tx, NULL, 0) ||
+        tx->weight != (LWTransactionSize(tx) - 2 - 2*sizeof(wit) - 1)*4 + 2 + 2*sizeof(wit) + 1)
+        r = 0, fprintf(stderr, "\n***FAILED*** %s: LWTransactionSize() witness test 3", __func__);
+
+    if (! LWTransactionViewParse(&view, wBuf, wLen) || ! LWTransactionViewInput(&view, 0, &in) ||
+        in.witLen != sizeof(wit) || memcmp(in.witness, wit, sizeof(wit)) != 0 ||
+        LWTransactionViewParse(&view, wBuf, wLen - 5))
+        r = 0, fprintf(stderr, "\n***FAILED*** %s: LWTransactionViewParse() witness test", __func__);
+    if (tx) LWTransactionFree(tx);
+
+    size_t manyLen = 0, manyCount = 150; // enough txs to be parsed across several worker threads
+    uint8_t *many = malloc((LWVarIntSize(len4) + len4)*manyCount + 5);
+    LWTransaction *txs[manyCount + 1];
+
+    assert(many != NULL);
+    for (size_t i = 0; i < manyCount; i++) {
+        manyLen += LWVarIntSet(&many[manyLen], 9, len4);
+        memcpy(&many[manyLen], buf4, len4);
+        manyLen += len4;
+    }
+
+    many[manyLen++] = 3, many[manyLen++] = 0, many[manyLen++] = 0, many[manyLen++] = 0; // malformed tx
+    many[manyLen] = 9; // truncated length prefix with no tx following
+    tx = LWTransactionParse(buf4, len4);
+
+    if (LWTransactionParseMany(NULL, 0, many, manyLen + 1) != 0 ||
+        LWTransactionParseMany(txs, manyCount + 1, many, manyLen + 1) != 0)
+        r = 0, fprintf(stderr, "\n***FAILED*** %s: LWTransactionParseMany() truncated test", __func__);
+
+    if (LWTransactionParseMany(NULL, 0, many, manyLen) != manyCount + 1 ||
+        LWTransactionParseMany(txs, manyCount + 1, many, manyLen) != manyCount + 1 || txs[manyCount] != NULL)
+        r = 0, fprintf(stderr, "\n***FAILED*** %s: LWTransactionParseMany() test", __func__);
+
+    for (size_t i = 0; i < manyCount; i++) {
+        if (! txs[i] || ! UInt256Eq(txs[i]->txHash, tx->txHash) || txs[i]->inCount != tx->inCount)
+            r = 0, fprintf(stderr, "\n***FAILED*** %s: LWTransactionParseMany() test %zu", __func__, i);
+        if (txs[i]) LWTransactionFree(txs[i]);
+    }
+
+    LWTransactionFree(tx);
+    free(many);
+
     LWTransaction *src = LWTransactionNew ();
     LWTransactionAddInput(src, inHash, 0, 1, script, scriptLen, NULL, 0, TXIN_SEQUENCE);
     LWTransactionAddInput(src, inHash, 0, 1, script, scriptLen, NULL, 0, TXIN_SEQUENCE);
@@ -1743,6 +1991,18 @@ int LWTransactionTests()
     if (!LWTransactionEqual(tgt, src))
         r = 0, fprintf(stderr, "\n***FAILED*** %s: LWTransactionCopy() test 3", __func__);
     LWTransactionFree(tgt);
+
+    tgt = LWTransactionCopy(src); // a packed copy must still be modifiable
+    LWTransactionAddInput(tgt, inHash, 11, 1, script, scriptLen, NULL, 0, TXIN_SEQUENCE);
+    LWTransactionAddOutput(tgt, 1000000, script, scriptLen);
+    LWTxInputSetSignature(&tgt->inputs[0], src->inputs[0].signature, src->inputs[0].sigLen);
+    LWTransactionSign(tgt, 0, k, 2);
+    if (! LWTransactionIsSigned(tgt) || tgt->inCount != src->inCount + 1 || tgt->outCount != src->outCount + 1 ||
+        tgt->inputs[0].sigLen != src->inputs[0].sigLen ||
+        memcmp(tgt->inputs[0].signature, src->inputs[0].signature, src->inputs[0].sigLen) != 0 ||
+        LWTransactionSize(tgt) != LWTransactionSerialize(tgt, NULL, 0))
+        r = 0, fprintf(stderr, "\n***FAILED*** %s: LWTransactionCopy() test 4", __func__);
+    LWTransactionFree(tgt);
     LWTransactionFree(src);
     
     if (! r) fprintf(stderr, "\n                                    ");
@@ -1770,6 +2030,52 @@ static void walletTxDeleted(void *info, UInt256 txHash, int notifyUser, int reco
     printf("tx deleted: %s\n", u256hex(txHash));
 }
 
+// deterministic pseudo-random number less than upperBound, so a failing sequence of wallet changes can be replayed
+static uint32_t _walletTestRand(uint32_t *seed, uint32_t upperBound)
+{
+    *seed = *seed*1103515245 + 12345;
+    return (*seed >> 16) % upperBound;
+}
+
+// true if the balance, totals, utxos and status of each tx in w match a wallet rebuilt from copies of its txs
+static int _walletTestMatchesRebuild(LWWallet *w, LWMasterPubKey mpk)
+{
+    size_t i, txCount = LWWalletTransactions(w, NULL, 0), utxoCount = LWWalletUTXOs(w, NULL, 0);
+    LWTransaction *txs[txCount + 1], *cpys[txCount + 1];
+    LWUTXO utxos[utxoCount + 1], utxos2[utxoCount + 1];
+    LWWallet *w2;
+    int r = 1;
+
+    LWWalletTransactions(w, txs, txCount);
+    for (i = 0; i < txCount; i++) cpys[i] = LWTransactionCopy(txs[i]);
+    w2 = LWWalletNew(cpys, txCount, mpk);
+    if (! w2) return 0;
+
+    if (LWWalletBalance(w) != LWWalletBalance(w2) || LWWalletTotalSent(w) != LWWalletTotalSent(w2) ||
+        LWWalletTotalReceived(w) != LWWalletTotalReceived(w2) || LWWalletUTXOs(w2, NULL, 0) != utxoCount) r = 0;
+
+    LWWalletUTXOs(w, utxos, utxoCount);
+    LWWalletUTXOs(w2, utxos2, utxoCount);
+
+    for (i = 0; r && i < utxoCount; i++) { // utxo order depends on the order outputs were spent in
+        size_t j = 0;
+
+        while (j < utxoCount && ! LWUTXOEq(&utxos[i], &utxos2[j])) j++;
+        if (j == utxoCount) r = 0;
+    }
+
+    for (i = 0; r && i < txCount; i++) {
+        LWTransaction *tx2 = LWWalletTransactionForHash(w2, txs[i]->txHash);
+
+        if (! tx2 || LWWalletBalanceAfterTx(w, txs[i]) != LWWalletBalanceAfterTx(w2, tx2) ||
+            LWWalletTransactionIsValid(w, txs[i]) != LWWalletTransactionIsValid(w2, tx2) ||
+            LWWalletTransactionIsPending(w, txs[i]) != LWWalletTransactionIsPending(w2, tx2)) r = 0;
+    }
+
+    LWWalletFree(w2);
+    return r;
+}
+
 // TODO: test standard free transaction no change
 // TODO: test free transaction who's inputs are too new to hit min free priority
 // TODO: test transaction with change below min allowable output
@@ -1800,7 +2106,22 @@ int LWWalletTests()
     
     tx = LWWalletCreateTransaction(w, SATOSHIS, addr.s);
     if (tx) r = 0, fprintf(stderr, "***FAILED*** %s: LWWalletCreateTransaction() test 1\n", __func__);
-    
+
+    LWScriptHash sh, hashes[SEQUENCE_GAP_LIMIT_INTERNAL];
+    uint32_t chain = 0, index = 0;
+
+    LWScriptHashFromAddress(&sh, recvAddr.s);
+    if (! LWWalletScriptHashIndex(w, &sh, &chain, &index) || chain != SEQUENCE_EXTERNAL_CHAIN || index != 0)
+        r = 0, fprintf(stderr, "***FAILED*** %s: LWWalletScriptHashIndex() test 1\n", __func__);
+
+    if (LWWalletUnusedScriptHashes(w, hashes, SEQUENCE_GAP_LIMIT_INTERNAL, 1) != SEQUENCE_GAP_LIMIT_INTERNAL ||
+        ! LWWalletScriptHashIndex(w, &hashes[1], &chain, &index) || chain != SEQUENCE_INTERNAL_CHAIN || index != 1)
+        r = 0, fprintf(stderr, "***FAILED*** %s: LWWalletScriptHashIndex() test 2\n", __func__);
+
+    LWScriptHashFromAddress(&sh, addr.s);
+    if (LWWalletScriptHashIndex(w, &sh, &chain, &index))
+        r = 0, fprintf(stderr, "***FAILED*** %s: LWWalletScriptHashIndex() test 3\n", __func__);
+
     uint8_t inScript[LWAddressScriptPubKey(NULL, 0, addr.s)];
     size_t inScriptLen = LWAddressScriptPubKey(inScript, sizeof(inScript), addr.s);
     uint8_t outScript[LWAddressScriptPubKey(NULL, 0, recvAddr.s)];
@@ -1828,6 +2149,10 @@ int LWWalletTests()
     if (LWWalletBalance(w) != SATOSHIS)
         r = 0, fprintf(stderr, "***FAILED*** %s: LWWalletRegisterTransaction() test 3\n", __func__);
 
+    if (LWWalletRegisterTransactions(w, &tx, 1) != 1 || LWWalletTransactions(w, NULL, 0) != 1 ||
+        LWWalletBalance(w) != SATOSHIS) // test batch adding an already registered tx
+        r = 0, fprintf(stderr, "***FAILED*** %s: LWWalletRegisterTransactions() test\n", __func__);
+
     tx = LWTransactionNew();
     LWTransactionAddInput(tx, inHash, 1, 1, inScript, inScriptLen, NULL, 0, TXIN_SEQUENCE - 1);
     LWTransactionAddOutput(tx, SATOSHIS, outScript, outScriptLen);
@@ -1837,6 +2162,13 @@ int LWWalletTests()
     if (! LWWalletTransactionIsPending(w, tx))
         r = 0, fprintf(stderr, "***FAILED*** %s: LWWalletTransactionIsPending() test\n", __func__);
 
+    uint8_t txBuf[LWTransactionSerialize(tx, NULL, 0)];
+    LWTransactionView view;
+    
+    if (! LWTransactionViewParse(&view, txBuf, LWTransactionSerialize(tx, txBuf, sizeof(txBuf))) ||
+        ! LWWalletContainsTransactionView(w, &view)) // test matching a tx without building an LWTransaction
+        r = 0, fprintf(stderr, "***FAILED*** %s: LWWalletContainsTransactionView() test\n", __func__);
+
     LWWalletRegisterTransaction(w, tx); // test adding tx with future lockTime
     if (LWWalletBalance(w) != SATOSHIS)
         r = 0, fprintf(stderr, "***FAILED*** %s: LWWalletRegisterTransaction() test 4\n", __func__);
@@ -1845,6 +2177,14 @@ int LWWalletTests()
     if (LWWalletBalance(w) != SATOSHIS*2)
         r = 0, fprintf(stderr, "***FAILED*** %s: LWWalletUpdateTransactions() test\n", __func__);
 
+    LWWalletSetTxUnconfirmedAfter(w, 998); // test rewinding balance to a tx that is pending again
+    if (LWWalletBalance(w) != SATOSHIS)
+        r = 0, fprintf(stderr, "***FAILED*** %s: LWWalletSetTxUnconfirmedAfter() test\n", __func__);
+
+    LWWalletUpdateTransactions(w, &tx->txHash, 1, 1000, 1);
+    if (LWWalletBalance(w) != SATOSHIS*2)
+        r = 0, fprintf(stderr, "***FAILED*** %s: LWWalletUpdateTransactions() test 2\n", __func__);
+
     LWWalletFree(w);
     tx = LWTransactionNew();
     LWTransactionAddInput(tx, inHash, 0, 1, inScript, inScriptLen, NULL, 0, TXIN_SEQUENCE);
@@ -1857,7 +2197,26 @@ int LWWalletTests()
 
     if (LWWalletAllAddrs(w, NULL, 0) != SEQUENCE_GAP_LIMIT_EXTERNAL + SEQUENCE_GAP_LIMIT_INTERNAL + 1)
         r = 0, fprintf(stderr, "***FAILED*** %s: LWWalletAllAddrs() test\n", __func__);
-    
+
+    uint8_t state[LWWalletSerializeState(w, NULL, 0)];
+    size_t stateLen = LWWalletSerializeState(w, state, sizeof(state));
+    LWTransaction *txCopy = LWTransactionCopy(tx);
+    LWWallet *w2 = LWWalletNewWithState(&txCopy, 1, mpk, state, stateLen);
+
+    if (! w2 || LWWalletBalance(w2) != SATOSHIS || LWWalletAllAddrs(w2, NULL, 0) != LWWalletAllAddrs(w, NULL, 0) ||
+        ! LWAddressEq(LWWalletReceiveAddress(w2).s, LWWalletReceiveAddress(w).s))
+        r = 0, fprintf(stderr, "***FAILED*** %s: LWWalletNewWithState() test\n", __func__);
+
+    size_t addrsCount = LWWalletAllAddrs(w, NULL, 0);
+    LWAddress allAddrs[addrsCount], allAddrs2[addrsCount];
+
+    if (! w2 || LWWalletAllAddrs(w, allAddrs, addrsCount) != addrsCount ||
+        LWWalletAllAddrs(w2, allAddrs2, addrsCount) != addrsCount ||
+        memcmp(allAddrs, allAddrs2, sizeof(allAddrs)) != 0) // address chains are derived again, not read from state
+        r = 0, fprintf(stderr, "***FAILED*** %s: LWWalletNewWithState() address chain test\n", __func__);
+
+    if (w2) LWWalletFree(w2);
+
     UInt256 hash = tx->txHash;
 
     tx = LWWalletCreateTransaction(w, SATOSHIS*2, addr.s);
@@ -1922,6 +2281,116 @@ int LWWalletTests()
 
     LWTransactionFree(tx);
     LWWalletFree(w);
+
+    tx = LWTransactionNew();
+    LWTransactionAddInput(tx, inHash, 0, 1, inScript, inScriptLen, NULL, 0, TXIN_SEQUENCE);
+    LWTransactionAddOutput(tx, 740000, outScript, outScriptLen);
+    LWTransactionAddOutput(tx, 2000000, outScript, outScriptLen);
+    LWTransactionAddOutput(tx, 5000000, outScript, outScriptLen);
+    LWTransactionSign(tx, 0, &k, 1);
+    w = LWWalletNew(&tx, 1, mpk);
+    tx = LWWalletCreateTransaction(w, 2000000 - 10600, addr.s); // the 2000000 coin pays this without change
+
+    if (! tx || tx->inCount != 1 || tx->outCount != 1 || tx->inputs[0].amount != 2000000)
+        r = 0, fprintf(stderr, "***FAILED*** %s: LWWalletCreateTransaction() test 5\n", __func__);
+
+    if (tx) LWTransactionFree(tx);
+    LWWalletFree(w);
+
+    LWAddress gapAddrs[SEQUENCE_GAP_LIMIT_EXTERNAL*2];
+    LWTransaction *batch[2];
+
+    w = LWWalletNew(NULL, 0, mpk);
+    w2 = LWWalletNew(NULL, 0, mpk);
+    LWWalletUnusedAddrs(w2, gapAddrs, SEQUENCE_GAP_LIMIT_EXTERNAL*2, 0);
+    LWWalletFree(w2);
+
+    for (size_t i = 0; i < 2; i++) { // the first tx pays an address that only exists once the second tx is seen
+        uint8_t script[LWAddressScriptPubKey(NULL, 0, gapAddrs[0].s)];
+        size_t j = SEQUENCE_GAP_LIMIT_EXTERNAL + 1 - i*2,
+               scriptLen = LWAddressScriptPubKey(script, sizeof(script), gapAddrs[j].s);
+
+        batch[i] = LWTransactionNew();
+        LWTransactionAddInput(batch[i], inHash, (uint32_t)i, 1, inScript, inScriptLen, NULL, 0, TXIN_SEQUENCE);
+        LWTransactionAddOutput(batch[i], SATOSHIS, script, scriptLen);
+        LWTransactionSign(batch[i], 0, &k, 1);
+    }
+
+    if (LWWalletRegisterTransactions(w, batch, 2) != 2 || LWWalletBalance(w) != SATOSHIS*2)
+        r = 0, fprintf(stderr, "***FAILED*** %s: LWWalletRegisterTransactions() gap limit test\n", __func__);
+
+    LWWalletFree(w);
+
+    // random registers, removes and updates must leave the incrementally updated balance the same as a full rebuild
+    // each confirmed tx gets a block of its own after any wallet txs it spends, so the order of txs is unambiguous
+    // txs only pay the first few addresses of each chain, which any new wallet has, since removing txs can leave used
+    // addresses further apart than the gap limit
+    LWAddress walletAddrs[10];
+    uint32_t seed = 1, height = 100;
+
+    w = LWWalletNew(NULL, 0, mpk);
+    LWWalletUnusedAddrs(w, walletAddrs, 5, 0);
+    LWWalletUnusedAddrs(w, &walletAddrs[5], 5, 1);
+
+    for (size_t i = 0; i < 300; i++) {
+        uint32_t op = _walletTestRand(&seed, 16);
+        size_t txCount = LWWalletTransactions(w, NULL, 0);
+        LWTransaction *txs[txCount + 1];
+
+        LWWalletTransactions(w, txs, txCount);
+
+        if (op < 10 || txCount < 3) { // register a tx that spends wallet outputs or others, and pays the wallet
+            int confirmed = (_walletTestRand(&seed, 2) == 0);
+
+            tx = LWTransactionNew();
+
+            for (uint32_t j = _walletTestRand(&seed, 3) + 1; j > 0; j--) {
+                LWTransaction *prev = (txCount > 0 && _walletTestRand(&seed, 5) > 0) ?
+                                      txs[_walletTestRand(&seed, (uint32_t)txCount)] : NULL;
+                UInt256 prevHash = (prev) ? prev->txHash : inHash;
+
+                if (! prev) prevHash.u32[1] = (uint32_t)i;
+                if (prev && prev->blockHeight == TX_UNCONFIRMED) confirmed = 0;
+                LWTransactionAddInput(tx, prevHash, (prev) ? _walletTestRand(&seed, (uint32_t)prev->outCount) : j, 1,
+                                      inScript, inScriptLen, NULL, 0,
+                                      (_walletTestRand(&seed, 10) == 0) ? TXIN_SEQUENCE - 2 : TXIN_SEQUENCE);
+            }
+
+
+            for (uint32_t j = _walletTestRand(&seed, 3) + 1; j > 0; j--) {
+                const char *a = (j == 1 || _walletTestRand(&seed, 3) > 0) ?
+                                walletAddrs[_walletTestRand(&seed, 10)].s : addr.s;
+                uint8_t script[LWAddressScriptPubKey(NULL, 0, a)];
+                size_t scriptLen = LWAddressScriptPubKey(script, sizeof(script), a);
+
+                LWTransactionAddOutput(tx, (_walletTestRand(&seed, 1000) + 1)*100000, script, scriptLen);
+            }
+
+            LWTransactionSign(tx, 0, &k, 1);
+            tx->blockHeight = (confirmed) ? ++height : TX_UNCONFIRMED;
+            if (! LWWalletRegisterTransaction(w, tx)) LWTransactionFree(tx);
+        }
+        else if (op == 10) { // remove a tx along with any that spend its outputs
+            LWWalletRemoveTransaction(w, txs[_walletTestRand(&seed, (uint32_t)txCount)]->txHash);
+        }
+        else if (op < 15) { // confirm the first unconfirmed tx, since any wallet txs it spends come before it
+            size_t j = 0;
+
+            while (j < txCount && txs[j]->blockHeight != TX_UNCONFIRMED) j++;
+            if (j < txCount) LWWalletUpdateTransactions(w, &txs[j]->txHash, 1, ++height, 1);
+        }
+        else { // chain re-org
+            height -= _walletTestRand(&seed, 4);
+            LWWalletSetTxUnconfirmedAfter(w, height);
+        }
+
+        if (i % 10 == 9 && ! _walletTestMatchesRebuild(w, mpk)) {
+            r = 0, fprintf(stderr, "***FAILED*** %s: random balance test %zu\n", __func__, i);
+            break;
+        }
+    }
+
+    LWWalletFree(w);
     
     amt = LWBitcoinAmount(50000, 50000);
     if (amt != SATOSHIS) r = 0, fprintf(stderr, "***FAILED*** %s: LWBitcoinAmount() test 1\n", __func__);
@@ -2543,7 +3012,46 @@ int LWPaymentProtocolEncryptionTests()
     return r;
 }
 
-void LWPeerAcceptMessageTest(LWPeer *peer, const uint8_t *msg, size_t len, const char *type);
+int LWPeerAcceptMessageTest(LWPeer *peer, const uint8_t *msg, size_t len, const char *type);
+void LWPeerSetMessageTimeoutTest(LWPeer *peer, double timeout);
+
+static void _peerTestDisconnected(void *info, int error)
+{
+    *(volatile int *)info = (error) ? error : -1;
+}
+
+// connects p to a loopback listener, then writes the header and first 10 bytes of a 100 byte payload and stops sending
+// returns the connected remote socket, or -1 on failure
+static int _peerTestStalledPayload(LWPeer *p, volatile int *error)
+{
+    struct sockaddr_in sa;
+    socklen_t saLen = sizeof(sa);
+    uint8_t msg[24 + 10];
+    int fd = socket(AF_INET, SOCK_STREAM, 0), cfd = -1;
+
+    memset(&sa, 0, sizeof(sa));
+    sa.sin_family = AF_INET;
+    sa.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+    memset(msg, 0, sizeof(msg));
+    UInt32SetLE(&msg[0], LW_CHAIN_PARAMS.magicNumber);
+    strncpy((char *)&msg[4], MSG_INV, 12);
+    UInt32SetLE(&msg[16], 100);
+
+    if (fd >= 0 && bind(fd, (struct sockaddr *)&sa, sizeof(sa)) == 0 && listen(fd, 1) == 0 &&
+        getsockname(fd, (struct sockaddr *)&sa, &saLen) == 0) {
+        p->address = ((UInt128) { .u8 = { 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0xff, 0xff, 127, 0, 0, 1 } });
+        p->port = ntohs(sa.sin_port);
+        LWPeerSetCallbacks(p, (void *)error, NULL, _peerTestDisconnected, NULL, NULL, NULL, NULL, NULL, NULL, NULL,
+                           NULL, NULL, NULL);
+        LWPeerConnect(p);
+        cfd = accept(fd, NULL, NULL);
+        LWPeerScheduleDisconnect(p, -1); // cancel connect timeout
+        if (cfd >= 0 && write(cfd, msg, sizeof(msg)) != sizeof(msg)) close(cfd), cfd = -1;
+    }
+
+    if (fd >= 0) close(fd);
+    return cfd;
+}
 
 int LWPeerTests()
 {
@@ -2551,7 +3059,158 @@ int LWPeerTests()
     LWPeer *p = LWPeerNew(LW_CHAIN_PARAMS.magicNumber);
     const char msg[] = "my message";
     
+    LWPeerStats stats, total;
+    
     LWPeerAcceptMessageTest(p, (const uint8_t *)msg, sizeof(msg) - 1, "inv");
+    LWPeerStatsSnapshot(p, &stats);
+    
+    if (strcmp(stats.messages[0].type, MSG_VERSION) != 0 || stats.messages[LW_PEER_STATS_TYPES - 1].type[0] != '\0')
+        r = 0, fprintf(stderr, "***FAILED*** %s: LWPeerStatsSnapshot() test 1\n", __func__);
+    
+    memset(&total, 0, sizeof(total));
+    stats.messages[3].msgsIn = 2, stats.messages[3].bytesIn = 100, stats.blockLatency[5] = 1;
+    LWPeerStatsAdd(&total, &stats);
+    LWPeerStatsAdd(&total, &stats);
+    
+    if (strcmp(total.messages[3].type, MSG_INV) != 0 || total.messages[3].msgsIn != 4 ||
+        total.messages[3].bytesIn != 200 || total.blockLatency[5] != 2)
+        r = 0, fprintf(stderr, "***FAILED*** %s: LWPeerStatsAdd() test 1\n", __func__);
+    
+    // a headers message with more than 2000 headers is a protocol violation, since it can't be a getheaders reply
+    size_t headersLen = 3 + 81*2001;
+    uint8_t *headers = calloc(headersLen, 1);
+
+    assert(headers != NULL);
+    LWVarIntSet(headers, headersLen, 2001);
+
+    if (LWPeerAcceptMessageTest(p, headers, headersLen, MSG_HEADERS))
+        r = 0, fprintf(stderr, "***FAILED*** %s: headers message test 1\n", __func__);
+
+    free(headers);
+    LWPeerFree(p);
+
+    // a stalled payload times out after its header, even if the peer thread keeps being woken up
+    volatile int error = 0;
+    time_t start = time(NULL);
+    int fd;
+
+    p = LWPeerNew(LW_CHAIN_PARAMS.magicNumber);
+    LWPeerSetMessageTimeoutTest(p, 0.05);
+    fd = _peerTestStalledPayload(p, &error);
+    while (fd >= 0 && ! error && time(NULL) < start + 5) usleep(10000), LWPeerScheduleDisconnect(p, -1);
+
+    if (fd < 0 || error != ETIMEDOUT)
+        r = 0, fprintf(stderr, "***FAILED*** %s: stalled payload test 1\n", __func__);
+
+    if (fd >= 0) close(fd);
+    LWPeerFree(p);
+
+    // a disconnect scheduled during a stalled payload happens before the payload times out
+    error = 0;
+    start = time(NULL);
+    p = LWPeerNew(LW_CHAIN_PARAMS.magicNumber);
+    LWPeerSetMessageTimeoutTest(p, 60);
+    fd = _peerTestStalledPayload(p, &error);
+    LWPeerScheduleDisconnect(p, 0.05);
+    while (fd >= 0 && ! error && time(NULL) < start + 5) usleep(10000);
+
+    if (fd < 0 || error != ETIMEDOUT)
+        r = 0, fprintf(stderr, "***FAILED*** %s: stalled payload test 2\n", __func__);
+
+    if (fd >= 0) close(fd);
+    LWPeerFree(p);
+    return r;
+}
+
+void LWPeerManagerRelayedTxTest(LWPeerManager *manager, LWPeer *peer, LWTransaction *tx);
+
+// serializes and frees tx, and returns it parsed again, so its hash matches its contents as they are relayed
+static LWTransaction *_peerManagerTestRelay(LWTransaction *tx)
+{
+    uint8_t buf[LWTransactionSerialize(tx, NULL, 0)];
+    size_t bufLen = LWTransactionSerialize(tx, buf, sizeof(buf));
+
+    LWTransactionFree(tx);
+    return LWTransactionParse(buf, bufLen);
+}
+
+// returns a tx spending output n of a non-wallet tx to the wallet receive address, signed with secret 1 if scriptSig
+// is NULL, or else with scriptSig set as the input signature
+static LWTransaction *_peerManagerTestTx(LWWallet *w, uint32_t n, uint64_t amount, const uint8_t *scriptSig,
+                                         size_t sigLen)
+{
+    UInt256 secret = uint256("0000000000000000000000000000000000000000000000000000000000000001"),
+            inHash = uint256("0000000000000000000000000000000000000000000000000000000000000001");
+    LWAddress addr, recvAddr = LWWalletReceiveAddress(w);
+    LWTransaction *tx = LWTransactionNew();
+    LWKey k;
+
+    LWKeySetSecret(&k, &secret, 1);
+    LWKeyAddress(&k, addr.s, sizeof(addr));
+
+    uint8_t inScript[LWAddressScriptPubKey(NULL, 0, addr.s)];
+    size_t inScriptLen = LWAddressScriptPubKey(inScript, sizeof(inScript), addr.s);
+    uint8_t outScript[LWAddressScriptPubKey(NULL, 0, recvAddr.s)];
+    size_t outScriptLen = LWAddressScriptPubKey(outScript, sizeof(outScript), recvAddr.s);
+
+    LWTransactionAddInput(tx, inHash, n, 1, inScript, inScriptLen, NULL, 0, TXIN_SEQUENCE);
+    LWTransactionAddOutput(tx, amount, outScript, outScriptLen);
+    if (scriptSig) LWTxInputSetSignature(&tx->inputs[0], scriptSig, sigLen);
+    else LWTransactionSign(tx, 0, &k, 1);
+    return _peerManagerTestRelay(tx);
+}
+
+int LWPeerManagerTests()
+{
+    int r = 1;
+    LWMasterPubKey mpk = LWBIP32MasterPubKey("", 1);
+    LWWallet *w = LWWalletNew(NULL, 0, mpk);
+    LWPeerManager *manager = LWPeerManagerNew(&LW_CHAIN_PARAMS, w, 0, NULL, 0, NULL, 0);
+    LWPeer *peers[PEER_MAX_CONNECTIONS];
+    LWTransaction *tx;
+    UInt256 txHash;
+    size_t i;
+
+    LWPeerManagerSetVerifyTx(manager, 1);
+
+    for (i = 0; i < PEER_MAX_CONNECTIONS; i++) {
+        peers[i] = LWPeerNew(LW_CHAIN_PARAMS.magicNumber);
+        peers[i]->address = ((UInt128) { .u8 = { 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0xff, 0xff, 127, 0, 0, 1 + i } });
+    }
+
+    // a relayed tx that spends no wallet outputs has its signature checked against the pubkey in its scriptSig
+    tx = _peerManagerTestTx(w, 0, SATOSHIS, NULL, 0);
+    txHash = tx->txHash;
+    LWPeerManagerRelayedTxTest(manager, peers[0], tx);
+
+    if (! LWWalletTransactionForHash(w, txHash) || LWWalletBalance(w) != SATOSHIS)
+        r = 0, fprintf(stderr, "***FAILED*** %s: relayed tx test 1\n", __func__);
+
+    // a forged tx that only pays to the wallet is dropped, even though the wallet doesn't know the output it spends
+    tx = _peerManagerTestTx(w, 1, SATOSHIS, NULL, 0);
+    tx->outputs[0].amount = 2*SATOSHIS;
+    tx = _peerManagerTestRelay(tx);
+    txHash = tx->txHash;
+    LWPeerManagerRelayedTxTest(manager, peers[0], tx);
+
+    if (LWWalletTransactionForHash(w, txHash) || LWWalletBalance(w) != SATOSHIS)
+        r = 0, fprintf(stderr, "***FAILED*** %s: relayed tx test 2\n", __func__);
+
+    // a tx spending a pay-to-script-hash output has no signature to check, so it's held until enough peers relay it
+    const uint8_t p2shSig[] = { 0x01, 0x01, 0x01, OP_1 }; // redeem script OP_1 with a 1 byte push before it
+
+    for (i = 0; i < PEER_MAX_CONNECTIONS; i++) {
+        tx = _peerManagerTestTx(w, 2, 3*SATOSHIS, p2shSig, sizeof(p2shSig));
+        txHash = tx->txHash;
+        LWPeerManagerRelayedTxTest(manager, peers[i], tx);
+
+        if ((LWWalletTransactionForHash(w, txHash) != NULL) != (i + 1 == PEER_MAX_CONNECTIONS))
+            r = 0, fprintf(stderr, "***FAILED*** %s: relayed tx test 3 (%zu peers)\n", __func__, i + 1);
+    }
+
+    LWPeerManagerFree(manager);
+    LWWalletFree(w);
+    for (i = 0; i < PEER_MAX_CONNECTIONS; i++) LWPeerFree(peers[i]);
     return r;
 }
 
@@ -2605,6 +3264,10 @@ int LWRunTests()
     printf("%s\n", (LWPaymentProtocolTests()) ? "success" : (fail++, "***FAIL***"));
     printf("LWPaymentProtocolEncryptionTests... ");
     printf("%s\n", (LWPaymentProtocolEncryptionTests()) ? "success" : (fail++, "***FAIL***"));
+    printf("LWPeerTests...                      ");
+    printf("%s\n", (LWPeerTests()) ? "success" : (fail++, "***FAIL***"));
+    printf("LWPeerManagerTests...               ");
+    printf("%s\n", (LWPeerManagerTests()) ? "success" : (fail++, "***FAIL***"));
     printf("\n");
     
     if (fail > 0) printf("%d TEST FUNCTION(S) ***FAILED***\n", fail);